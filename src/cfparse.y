@@ -63,12 +63,15 @@ int numbounds = 0;			/* Number of named boundaries */
 
 %token CACHE_LIFETIME PRUNE_LIFETIME PRUNING BLACK_HOLE NOFLOOD
 %token QUERY_INTERVAL QUERY_LAST_MEMBER_INTERVAL QUERY_RESPONSE_INTERVAL IGMP_ROBUSTNESS
+%token IGMP_RECV_BUDGET
 %token NO PHYINT TUNNEL NAME
 %token DISABLE ENABLE IGMPV1 IGMPV2 IGMPV3 STATIC_GROUP JOIN_GROUP SRCRT BESIDE
 %token METRIC THRESHOLD RATE_LIMIT BOUNDARY NETMASK ALTNET ADVERT_METRIC
 %token FILTER ACCEPT DENY EXACT BIDIR REXMIT_PRUNES REXMIT_PRUNES2
 %token PASSIVE ALLOW_NONPRUNERS
 %token NOTRANSIT BLASTER FORCE_LEAF ROUTER_ALERT ROUTER_TIMEOUT
+%token CACHE_MAX_GROUPS CACHE_MAX_SOURCES CACHE_MAX_PRUNES
+%token UPCALL_RATE UPCALL_BURST PRUNE_RATE
 %token PRUNE_LIFETIME2 NOFLOOD2
 %token SYSNAM SYSCONTACT SYSVERSION SYSLOCATION
 %token <num> BOOLEAN
@@ -157,6 +160,48 @@ stmt	: error
 	    else
 		prune_lifetime = $2;
 	}
+	| CACHE_MAX_GROUPS NUMBER
+	{
+	    if ($2 < 0)
+		warn("cache-max-groups %d must not be negative", $2);
+	    else
+		cache_max_groups = $2;
+	}
+	| CACHE_MAX_SOURCES NUMBER
+	{
+	    if ($2 < 0)
+		warn("cache-max-sources %d must not be negative", $2);
+	    else
+		cache_max_sources = $2;
+	}
+	| CACHE_MAX_PRUNES NUMBER
+	{
+	    if ($2 < 0)
+		warn("cache-max-prunes %d must not be negative", $2);
+	    else
+		cache_max_prunes = $2;
+	}
+	| UPCALL_RATE NUMBER
+	{
+	    if ($2 < 0)
+		warn("upcall-rate %d must not be negative", $2);
+	    else
+		upcall_rate = $2;
+	}
+	| UPCALL_BURST NUMBER
+	{
+	    if ($2 < 0)
+		warn("upcall-burst %d must not be negative", $2);
+	    else
+		upcall_burst = $2;
+	}
+	| PRUNE_RATE NUMBER
+	{
+	    if ($2 < 0)
+		warn("prune-rate %d must not be negative", $2);
+	    else
+		prune_rate = $2;
+	}
 	| PRUNING BOOLEAN
 	{
 	    if ($2 != 1)
@@ -264,6 +309,12 @@ stmt	: error
 		fatal("Invalid IGMP robustness value [2,10]: %d", $2);
 	    igmp_robustness = $2;
 	}
+	| IGMP_RECV_BUDGET NUMBER
+	{
+	    if ($2 < 1 || $2 > 65535)
+		fatal("Invalid IGMP receive budget [1,65535]: %d", $2);
+	    igmp_recv_budget = $2;
+	}
 	;
 
 tunnelmods	: /* empty */
@@ -761,12 +812,19 @@ static struct keyword {
 } words[] = {
 	{ "cache_lifetime",	CACHE_LIFETIME, 0 },
 	{ "cache-lifetime",	CACHE_LIFETIME, 0 },
+	{ "cache-max-groups",	CACHE_MAX_GROUPS, 0 },
+	{ "cache-max-sources",	CACHE_MAX_SOURCES, 0 },
+	{ "cache-max-prunes",	CACHE_MAX_PRUNES, 0 },
+	{ "upcall-rate",	UPCALL_RATE, 0 },
+	{ "upcall-burst",	UPCALL_BURST, 0 },
+	{ "prune-rate",		PRUNE_RATE, 0 },
 	{ "prune_lifetime",	PRUNE_LIFETIME,	PRUNE_LIFETIME2 },
 	{ "prune-lifetime",	PRUNE_LIFETIME,	PRUNE_LIFETIME2 },
 	{ "igmp-query-interval", QUERY_INTERVAL, 0 },
 	{ "igmp-query-reponse-interval", QUERY_RESPONSE_INTERVAL, 0 },
 	{ "igmp-query-last-member-interval", QUERY_LAST_MEMBER_INTERVAL, 0 },
 	{ "igmp-robustness",    IGMP_ROBUSTNESS, 0 },
+	{ "igmp-recv-budget",   IGMP_RECV_BUDGET, 0 },
 	{ "no",                 NO, 0 },
 	{ "pruning",		PRUNING, 0 },
 	{ "phyint",		PHYINT, 0 },
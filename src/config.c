@@ -197,6 +197,9 @@ void config_vifs_correlate(void)
 	    continue;
 	}
 
+	if (v->uv_filter)
+	    vif_filter_compile(v->uv_filter);
+
 	if (v->uv_flags & VIFF_TUNNEL)
 	    logit(LOG_INFO, 0, "Installing tunnel %s from %s to %s as VIF #%u, rate %d pps",
 		  v->uv_name, inet_fmt(v->uv_lcl_addr, s1, sizeof(s1)),
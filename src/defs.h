@@ -78,6 +78,7 @@ typedef void (*ihfunc_t) (int);
 #include "prune.h"
 #include "pathnames.h"
 #include "pev.h"
+#include "pool.h"
 
 /*
  * Miscellaneous constants and macros.
@@ -136,6 +137,7 @@ typedef void (*ihfunc_t) (int);
  * External declarations for global variables and functions.
  */
 #define RECV_BUF_SIZE 8192
+#define IGMP_RECV_BUDGET_DEFAULT 64
 extern uint8_t		*recv_buf;
 extern uint8_t		*send_buf;
 extern int		igmp_socket;
@@ -150,6 +152,7 @@ extern uint32_t		igmp_query_interval;
 extern uint32_t		igmp_response_interval;
 extern uint32_t		igmp_last_member_interval;
 extern uint32_t		igmp_robustness;
+extern uint32_t		igmp_recv_budget;
 extern uint32_t		virtual_time;
 
 #define	IF_DEBUG(l)	if (debug && debug & (l))
@@ -253,6 +256,12 @@ extern int              debug_parse(char *arg);
 extern char	       *config_file;
 extern int		cache_lifetime;
 extern int		prune_lifetime;
+extern int		cache_max_groups;
+extern int		cache_max_sources;
+extern int		cache_max_prunes;
+extern int		upcall_rate;
+extern int		upcall_burst;
+extern int		prune_rate;
 extern int		mrt_table_id;
 extern int              debug_list(int, char *, size_t);
 extern int              debug_parse(char *);
@@ -269,7 +278,7 @@ extern void		logit(int, int, const char *, ...) __attribute__ ((format (printf,
 /* igmp.c */
 extern void		igmp_init(void);
 extern void		igmp_exit(void);
-extern void		accept_igmp(int, size_t);
+extern void		accept_igmp(int, uint8_t *, size_t);
 extern size_t		build_igmp(uint32_t, uint32_t, int, int, uint32_t, int);
 extern void		send_igmp(uint32_t, uint32_t, int, int, uint32_t, int);
 extern char *		igmp_packet_kind(uint32_t, uint32_t);
@@ -294,6 +303,7 @@ extern void		accept_probe(uint32_t, uint32_t, char *, size_t, uint32_t);
 extern void		accept_report(uint32_t, uint32_t, char *, size_t, uint32_t);
 extern struct rtentry  *determine_route(uint32_t src);
 extern struct rtentry  *route_iter(struct rtentry **rt);
+extern uint32_t		route_timer(struct rtentry *rt);
 extern void		report(int, vifi_t, uint32_t);
 extern void		report_to_all_neighbors(int);
 extern int		report_next_chunk(void);
@@ -307,6 +317,9 @@ extern void		dump_routes(FILE *, int);
 extern void		init_vifs(void);
 extern void		blaster_alloc(struct uvif *);
 extern void		blaster_free(struct uvif *);
+extern int		vif_filter_compile(struct vif_filter *);
+extern int		vif_filter_match(struct vif_filter *, uint32_t, uint32_t, struct vf_element **);
+extern void		vif_filter_free(struct vif_filter *);
 extern void		zero_vif(struct uvif *, int);
 extern void		init_installvifs(void);
 extern int		install_uvif(struct uvif *);
@@ -363,21 +376,39 @@ extern uint16_t		inet_cksum(uint16_t *, uint32_t);
 /* prune.c */
 extern struct gtable	*kernel_table;
 extern struct gtable	*kernel_no_route;
-extern struct gtable	*gtp;
 
 extern unsigned		kroutes;
+extern unsigned long	mfc_updates;
+extern unsigned long	upcalls_received;
+extern unsigned long	upcalls_merged;
+extern unsigned long	upcalls_limited;
+extern unsigned long	upcalls_dropped;
+extern unsigned long	mfc_suppressed;
+extern unsigned long	prunes_sent;
+extern unsigned long	prunes_delayed;
+extern unsigned long	prunes_merged;
+extern unsigned long	prunes_flushed;
+extern unsigned int	prune_qlen;
+extern unsigned int	prune_qmax;
+extern unsigned long	prune_delay_sum;
+extern unsigned long	prune_delay_max;
 extern void		determine_forwvifs(struct gtable *);
 extern void		send_prune_or_graft(struct gtable *);
 extern void		add_table_entry(uint32_t, uint32_t);
+extern void		accept_upcall(uint32_t, uint32_t);
+extern void		run_upcalls(void);
 extern void 		del_table_entry(struct rtentry *, uint32_t, uint32_t);
 extern void		update_table_entry(struct rtentry *, uint32_t);
-extern int		find_src_grp(uint32_t, uint32_t, uint32_t);
+extern struct gtable   *find_src_grp(uint32_t, uint32_t, uint32_t);
+extern struct gtable  **sort_kernel_table(size_t *);
 extern void		init_ktable(void);
 extern void		steal_sources(struct rtentry *);
-extern void		reset_neighbor_state(vifi_t, uint32_t);
+extern void		reset_neighbor_state(vifi_t, uint32_t, uint32_t);
 extern int		grplst_mem(vifi_t, uint32_t);
 extern void		free_all_prunes(void);
 extern void 		age_table_entry(void);
+extern void		prune_tick(void);
+extern int		cache_timer(struct gtable *);
 extern void		dump_cache(FILE *, int);
 extern void 		update_lclgrp(vifi_t, uint32_t);
 extern void		delete_lclgrp(vifi_t, uint32_t);
@@ -390,6 +421,8 @@ extern void		accept_mtrace(uint32_t, uint32_t, uint32_t, char *, uint8_t, size_t
 
 /* kern.c */
 extern int              curttl;
+extern int              curloop;
+extern uint32_t         curif;
 
 extern void		k_set_rcvbuf(int, int);
 extern void		k_hdr_include(int);
@@ -397,6 +430,7 @@ extern void		k_set_pktinfo(int);
 extern void		k_set_ttl(int);
 extern void		k_set_loop(int);
 extern void		k_set_if(uint32_t);
+extern int		k_get_ifindex(uint32_t);
 extern void		k_join(uint32_t, uint32_t);
 extern void		k_leave(uint32_t, uint32_t);
 extern void		k_init_dvmrp(void);
@@ -405,6 +439,7 @@ extern void		k_add_vif(vifi_t, struct uvif *);
 extern void		k_del_vif(vifi_t, struct uvif *);
 extern void		k_add_rg(uint32_t, struct gtable *);
 extern int		k_del_rg(uint32_t, struct gtable *);
+extern void		k_flush_rg(void);
 extern int		k_get_version(void);
 
 #ifndef HAVE_STRLCPY
@@ -440,6 +475,7 @@ extern int		pidfile(const char *basename);
 #define IPC_SHOW_MFC_CMD          21
 #define IPC_SHOW_NEIGH_CMD        22
 #define IPC_SHOW_ROUTES_CMD       23
+#define IPC_SHOW_POOLS_CMD        24
 #define IPC_SHOW_COMPAT_CMD       250
 #define IPC_EOF_CMD               254
 #define IPC_ERR_CMD               255
@@ -183,3 +183,4 @@
 #define	MIN_PRUNE_LIFETIME	120	/* minimum allowed prune lifetime   */
 #define GRAFT_TIMEOUT_VAL	5	/* retransmission time for grafts   */
 #define	PRUNE_REXMIT_VAL	3	/* initial time for prune rexmission*/
+#define DEFAULT_PRUNE_RATE	100	/* prunes+grafts/sec per neighbor   */
@@ -18,10 +18,19 @@
 #define PIM_GRAFT           6
 #define PIM_GRAFT_ACK       7
 
+#define IGMP_RECV_RING      16	/* receive buffers, packets per syscall */
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int  msg_len;
+};
+#endif
+
 /*
  * Exported variables.
  */
-uint8_t		*recv_buf; 		     /* input packet buffer         */
+uint8_t		*recv_buf; 		     /* input packet buffer(s)      */
 uint8_t		*send_buf; 		     /* output packet buffer        */
 int		igmp_socket;		     /* socket for all network I/O  */
 int             router_alert;		     /* IP option Router Alert      */
@@ -30,6 +39,7 @@ uint32_t	igmp_query_interval;	     /* Default: 125 sec            */
 uint32_t	igmp_response_interval;	     /* Default: 10 sec		    */
 uint32_t	igmp_last_member_interval;   /* Default: 1                  */
 uint32_t	igmp_robustness;	     /* Default: 2                  */
+uint32_t	igmp_recv_budget;	     /* Default: 64, pkts per wakeup*/
 uint32_t	allhosts_group;		     /* All hosts addr in net order */
 uint32_t	allrtrs_group;		     /* All-Routers "  in net order */
 uint32_t	allreports_group;	     /* IGMPv3 member reports       */
@@ -42,10 +52,14 @@ uint32_t	dvmrp_genid;		     /* IGMP generation id          */
 #ifdef REGISTER_HANDLER
 static int	sock_id = -1;
 #endif
+static struct iovec recv_iov[IGMP_RECV_RING];
+static char	recv_cmsg[IGMP_RECV_RING][0x100];
 
 /*
  * Local function definitions.
  */
+static int	igmp_recv(int sd, struct mmsghdr *msgv, int num);
+static int	igmp_ifindex(struct msghdr *msgh);
 static void	igmp_read(int sd, void *arg);
 static int	igmp_log_level(uint32_t type, uint32_t code);
 
@@ -58,7 +72,7 @@ void igmp_init(void)
     struct ip *ip;
     uint8_t *ip_opt;
 
-    recv_buf = calloc(1, RECV_BUF_SIZE);
+    recv_buf = calloc(IGMP_RECV_RING, RECV_BUF_SIZE);
     send_buf = calloc(1, RECV_BUF_SIZE);
 
     if (!recv_buf || !send_buf) {
@@ -69,6 +83,8 @@ void igmp_init(void)
     igmp_socket = socket(AF_INET, SOCK_RAW, IPPROTO_IGMP);
     if (igmp_socket < 0)
 	logit(LOG_ERR, errno, "Failed creating IGMP socket");
+    curloop = -1;		/* new socket, forget cached options */
+    curif   = INADDR_ANY;
 
     k_hdr_include(TRUE);	/* include IP header when sending */
     k_set_pktinfo(TRUE);	/* ifindex in aux data on receive */
@@ -108,6 +124,7 @@ void igmp_init(void)
     igmp_response_interval    = IGMP_QUERY_RESPONSE_INTERVAL;
     igmp_last_member_interval = IGMP_LAST_MEMBER_INTERVAL_DEFAULT;
     igmp_robustness           = IGMP_ROBUSTNESS_DEFAULT;
+    igmp_recv_budget          = IGMP_RECV_BUDGET_DEFAULT;
     router_alert              = 1;
     router_timeout            = IGMP_OTHER_QUERIER_PRESENT_INTERVAL;
 
@@ -222,55 +239,110 @@ int igmp_debug_kind(uint32_t type, uint32_t code)
 }
 
 /*
- * Read an IGMP message from igmp_socket
+ * Receive up to 'num' packets into the receive buffers, without
+ * blocking.  Returns the number received, 0 if there were none.
  */
-static void igmp_read(int sd, void *arg)
+static int igmp_recv(int sd, struct mmsghdr *msgv, int num)
 {
-    struct cmsghdr *cmsg;
-    struct msghdr msgh;
-    char cmbuf[0x100];
-    struct iovec iov;
-    int ifi = -1;
-    ssize_t len;
-
-    memset(&msgh, 0, sizeof(msgh));
-    iov.iov_base = recv_buf;
-    iov.iov_len = RECV_BUF_SIZE;
-    msgh.msg_control = cmbuf;
-    msgh.msg_controllen = sizeof(cmbuf);
-    msgh.msg_iov  = &iov;
-    msgh.msg_iovlen = 1;
-    msgh.msg_flags = 0;
-
-    while ((len = recvmsg(sd, &msgh, 0)) < 0) {
+    int i;
+
+    for (i = 0; i < num; i++) {
+	struct msghdr *msgh = &msgv[i].msg_hdr;
+
+	recv_iov[i].iov_base = recv_buf + i * RECV_BUF_SIZE;
+	recv_iov[i].iov_len  = RECV_BUF_SIZE;
+
+	memset(msgh, 0, sizeof(*msgh));
+	msgh->msg_iov        = &recv_iov[i];
+	msgh->msg_iovlen     = 1;
+	msgh->msg_control    = recv_cmsg[i];
+	msgh->msg_controllen = sizeof(recv_cmsg[i]);
+	msgv[i].msg_len      = 0;
+    }
+
+#ifdef HAVE_RECVMMSG
+    while ((num = recvmmsg(sd, msgv, num, MSG_DONTWAIT, NULL)) < 0) {
 	if (errno == EINTR)
 	    continue;		/* Received signal, retry syscall. */
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return 0;
 
-	logit(LOG_ERR, errno, "Failed recvfrom() in igmp_read()");
-	return;
+	logit(LOG_ERR, errno, "Failed recvmmsg() in igmp_read()");
+	return 0;
     }
+#else
+    for (i = 0; i < num; i++) {
+	ssize_t len;
+
+	while ((len = recvmsg(sd, &msgv[i].msg_hdr, MSG_DONTWAIT)) < 0) {
+	    if (errno == EINTR)
+		continue;	/* Received signal, retry syscall. */
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return i;
+
+	    logit(LOG_ERR, errno, "Failed recvmsg() in igmp_read()");
+	    return i;
+	}
+	msgv[i].msg_len = len;
+    }
+#endif
+
+    return num;
+}
+
+/*
+ * Inbound interface of a received packet, from its IP_PKTINFO, or -1
+ */
+static int igmp_ifindex(struct msghdr *msgh)
+{
+    struct cmsghdr *cmsg;
 
-    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+    for (cmsg = CMSG_FIRSTHDR(msgh); cmsg; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
 #ifdef IP_PKTINFO
 	const struct in_pktinfo *ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
-	char tmp[IF_NAMESIZE + 1] = { 0 };
 
 	if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_PKTINFO)
 	    continue;
 
-	ifi = ipi->ipi_ifindex;
-	break;
+	return ipi->ipi_ifindex;
 #endif
     }
 
-    accept_igmp(ifi, len);
+    return -1;
 }
 
 /*
- * Process a newly received IGMP packet that is sitting in the input
- * packet buffer.
+ * Drain the IGMP socket, which also carries DVMRP and kernel upcalls.
+ * Up to igmp_recv_budget packets are handled per wakeup, read at most
+ * IGMP_RECV_RING per syscall, so a report storm or an upcall burst does
+ * not cost a full event loop turn per packet.  Anything left over is
+ * handled on the next turn, after other sockets and timers have run.
  */
-void accept_igmp(int ifi, size_t recvlen)
+static void igmp_read(int sd, void *arg)
+{
+    struct mmsghdr msgv[IGMP_RECV_RING];
+    uint32_t budget = igmp_recv_budget;
+
+    while (budget > 0) {
+	int i, num, want;
+
+	want = budget < IGMP_RECV_RING ? budget : IGMP_RECV_RING;
+	num  = igmp_recv(sd, msgv, want);
+	for (i = 0; i < num; i++)
+	    accept_igmp(igmp_ifindex(&msgv[i].msg_hdr), recv_buf + i * RECV_BUF_SIZE,
+			msgv[i].msg_len);
+
+	if (num < want)
+	    break;		/* Drained */
+	budget -= num;
+    }
+}
+
+/*
+ * Process a newly received IGMP packet that is sitting in one of the
+ * input packet buffers.
+ */
+void accept_igmp(int ifi, uint8_t *buf, size_t recvlen)
 {
     struct igmp *igmp;
     struct ip *ip;
@@ -283,7 +355,7 @@ void accept_igmp(int ifi, size_t recvlen)
 	return;
     }
 
-    ip        = (struct ip *)recv_buf;
+    ip        = (struct ip *)buf;
     src       = ip->ip_src.s_addr;
     dst       = ip->ip_dst.s_addr;
 
@@ -294,7 +366,7 @@ void accept_igmp(int ifi, size_t recvlen)
      */
     if (ip->ip_p == 0) {
 	if (src != 0 && dst != 0)
-	    add_table_entry(src, dst);
+	    accept_upcall(src, dst);
 	return;
     }
 
@@ -312,7 +384,7 @@ void accept_igmp(int ifi, size_t recvlen)
 	return;
     }
 
-    igmp        = (struct igmp *)(recv_buf + iphdrlen);
+    igmp        = (struct igmp *)(buf + iphdrlen);
     group       = igmp->igmp_group.s_addr;
     igmpdatalen = ipdatalen - IGMP_MINLEN;
     if (igmpdatalen < 0) {
@@ -359,7 +431,7 @@ void accept_igmp(int ifi, size_t recvlen)
 		      igmpdatalen, IGMP_V3_GROUP_RECORD_MIN_SIZE);
 		return;
 	    }
-	    accept_membership_report(ifi, src, dst, (struct igmpv3_report *)(recv_buf + iphdrlen), recvlen - iphdrlen);
+	    accept_membership_report(ifi, src, dst, (struct igmpv3_report *)(buf + iphdrlen), recvlen - iphdrlen);
 	    return;
 
 	case IGMP_DVMRP:
@@ -622,9 +694,14 @@ size_t build_igmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group
 void send_igmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen)
 {
     struct sockaddr_in sin;
+    struct msghdr msg;
+    struct iovec iov;
+#ifdef IP_PKTINFO
+    char cmsgbuf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
     struct ip *ip;
     size_t len;
-    int rc, setloop = 0;
+    int rc, ifindex = 0;
 
     /* Set IP header length,  router-alert is optional */
     ip        = (struct ip *)send_buf;
@@ -635,12 +712,20 @@ void send_igmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, i
     else
        len = build_igmp(src, dst, type, code, group, datalen);
 
+    /*
+     * The outbound interface of a multicast is given per packet, as
+     * IP_PKTINFO, when src is the address of one of our phyints.  Other
+     * cases fall back to IP_MULTICAST_IF.  Both it and the loopback
+     * setting are cached by k_set_if() and k_set_loop(), so a run of
+     * sends costs one syscall per packet.
+     */
     if (IN_MULTICAST(ntohl(dst))) {
-	k_set_if(src);
-	if (type != IGMP_DVMRP || dst == allhosts_group) {
-	    setloop = 1;
-	    k_set_loop(TRUE);
-	}
+#ifdef IP_PKTINFO
+	ifindex = k_get_ifindex(src);
+#endif
+	if (!ifindex)
+	    k_set_if(src);
+	k_set_loop(type != IGMP_DVMRP || dst == allhosts_group);
     }
 
     memset(&sin, 0, sizeof(sin));
@@ -650,7 +735,36 @@ void send_igmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, i
 #endif
     sin.sin_addr.s_addr = dst;
 
-    rc = sendto(igmp_socket, send_buf, len, 0, (struct sockaddr *)&sin, sizeof(sin));
+    iov.iov_base = send_buf;
+    iov.iov_len  = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = &sin;
+    msg.msg_namelen = sizeof(sin);
+    msg.msg_iov     = &iov;
+    msg.msg_iovlen  = 1;
+
+#ifdef IP_PKTINFO
+    if (ifindex) {
+	struct in_pktinfo *ipi;
+	struct cmsghdr *cmsg;
+
+	memset(cmsgbuf, 0, sizeof(cmsgbuf));
+	msg.msg_control    = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_IP;
+	cmsg->cmsg_type  = IP_PKTINFO;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(struct in_pktinfo));
+
+	ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+	ipi->ipi_ifindex         = ifindex;
+	ipi->ipi_spec_dst.s_addr = src;
+    }
+#endif
+
+    rc = sendmsg(igmp_socket, &msg, 0);
     if (rc < 0) {
 	switch (errno) {
 	case ENETUNREACH:
@@ -658,15 +772,12 @@ void send_igmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, i
 	    check_vif_state();
 	    break;
 	default:
-	    logit(igmp_log_level(type, code), errno, "sendto to %s on %s",
+	    logit(igmp_log_level(type, code), errno, "sendmsg to %s on %s",
 		  inet_fmt(dst, s1, sizeof(s1)), inet_fmt(src, s2, sizeof(s2)));
 	    break;
 	}
     }
 
-    if (setloop)
-	    k_set_loop(FALSE);
-
     IF_DEBUG(DEBUG_PKT | igmp_debug_kind(type, code)) {
 	logit(LOG_DEBUG, 0, "SENT %s from %-15s to %s", igmp_packet_kind(type, code),
 	      src == INADDR_ANY ? "INADDR_ANY" : inet_fmt(src, s1, sizeof(s1)),
@@ -245,7 +245,7 @@ static void show_routes(FILE *fp, int detail)
 		if (r->rt_gateway == 0)
 			fprintf(fp, "%8s", "Never");
 		else
-			fprintf(fp, "%7us", r->rt_timer);
+			fprintf(fp, "%7us", route_timer(r));
 
 	next:
 		fprintf(fp, "\n");
@@ -266,13 +266,15 @@ static void show_mfc_header(FILE *fp, int detail)
 static void show_mfc(FILE *fp, int detail)
 {
 	struct rtentry *r;
-	struct gtable *gt;
+	struct gtable *gt, **tbl;
 	struct stable *st;
 	time_t thyme = time(NULL);
+	size_t j, num;
 	vifi_t i;
 	char flags[5];
 	int once = 1;
 
+	k_flush_rg();		/* for the kernel's packet counters */
 	for (gt = kernel_no_route; gt; gt = gt->gt_next) {
 		if (gt->gt_srctbl) {
 			if (once) {
@@ -289,7 +291,7 @@ static void show_mfc(FILE *fp, int detail)
 				fprintf(fp, "%2s%10s %8s  ",
 					"!!",			     /* No route */
 					scaletime(thyme - gt->gt_ctime), /* Age/Uptime */
-					scaletime(gt->gt_timer));	     /* Timeout/Expire */
+					scaletime(cache_timer(gt)));	     /* Timeout/Expire */
 
 			for (i = 0; i < numvifs; ++i) {
 				if (VIFM_ISSET(i, gt->gt_grpmems))
@@ -299,11 +301,14 @@ static void show_mfc(FILE *fp, int detail)
 		}
 	}
 
-	for (gt = kernel_table; gt; gt = gt->gt_gnext) {
+	tbl = sort_kernel_table(&num);
+	for (j = 0; j < num; j++) {
 		int any = 0;
 
+		gt = tbl[j];
+
 		/* Pruned upstream and no detail? */
-		if (gt->gt_prsent_timer && !detail)
+		if (gt->gt_prsent && !detail)
 			continue;
 
 		/* Pruned downstream, no outbounds, and no detail? */
@@ -327,7 +332,7 @@ static void show_mfc(FILE *fp, int detail)
 
 		if (detail) {
 			snprintf(flags, sizeof(flags), "%c%c",
-				 gt->gt_prsent_timer
+				 gt->gt_prsent
 				 ? 'P'
 				 : (gt->gt_grftsnt
 				    ? 'G'
@@ -338,7 +343,7 @@ static void show_mfc(FILE *fp, int detail)
 			fprintf(fp, "%2s%10s %8s  ",
 				flags,
 				scaletime(thyme - gt->gt_ctime),	/* Age/Uptime */
-				scaletime(gt->gt_timer));		/* Timeout/Expire */
+				scaletime(cache_timer(gt)));		/* Timeout/Expire */
 		}
 
 		for (i = 0; i < numvifs; i++) {
@@ -361,11 +366,12 @@ static void show_mfc(FILE *fp, int detail)
 	}
 
 	if (!detail)
-		return;
+		goto done;
 
 	once = 1;
-	for (gt = kernel_table; gt; gt = gt->gt_gnext) {
-		if (gt->gt_prsent_timer)
+	for (j = 0; j < num; j++) {
+		gt = tbl[j];
+		if (gt->gt_prsent)
 			continue;
 
 		r = gt->gt_route;
@@ -399,6 +405,24 @@ static void show_mfc(FILE *fp, int detail)
 			fputs("\n", fp);
 		}
 	}
+
+	fputs("\nKernel MFC Updates_\n", fp);
+	fprintf(fp, "%10s %10s=\n", "Sent", "Suppressed");
+	fprintf(fp, "%10lu %10lu\n", mfc_updates, mfc_suppressed);
+
+	fputs("\nKernel Upcalls_\n", fp);
+	fprintf(fp, "%10s %10s %10s %10s=\n", "Received", "Merged", "Limited", "Dropped");
+	fprintf(fp, "%10lu %10lu %10lu %10lu\n", upcalls_received, upcalls_merged,
+		upcalls_limited, upcalls_dropped);
+
+	fputs("\nPrune/Graft Queue_\n", fp);
+	fprintf(fp, "%9s %9s %9s %9s %9s %9s %9s %9s=\n", "Queued", "Peak", "Sent",
+		"Delayed", "Merged", "Flushed", "Avg ms", "Max ms");
+	fprintf(fp, "%9u %9u %9lu %9lu %9lu %9lu %9lu %9lu\n", prune_qlen, prune_qmax,
+		prunes_sent, prunes_delayed, prunes_merged, prunes_flushed,
+		prunes_delayed ? prune_delay_sum / prunes_delayed : 0, prune_delay_max);
+done:
+	free(tbl);
 }
 
 static uint32_t diff_vtime(uint32_t mtime)
@@ -513,12 +537,32 @@ static void show_igmp(FILE *fp, int detail)
 	show_igmp_group(fp, detail);
 }
 
+static void show_pools(FILE *fp, int detail)
+{
+	struct pool *p = NULL;
+	int once = 1;
+
+	while (pool_iter(&p)) {
+		if (once) {
+			fputs("Memory Pools_\n", fp);
+			fprintf(fp, "%-15s %6s %6s %8s %8s %8s %8s %10s=\n",
+				"Pool", "Size", "Slabs", "Total", "In-use", "Peak", "Fails", "Bytes");
+			once = 0;
+		}
+
+		fprintf(fp, "%-15s %6zu %6zu %8zu %8zu %8zu %8zu %10zu\n",
+			p->p_name, p->p_size, p->p_nslabs, p->p_total,
+			p->p_inuse, p->p_hiwat, p->p_fails, p->p_total * p->p_size);
+	}
+}
+
 static void show_status(FILE *fp, int detail)
 {
 	show_iface(fp, detail);
 	show_neighbor(fp, detail);
 	show_routes(fp, detail);
 	show_mfc(fp, detail);
+	show_pools(fp, detail);
 }
 
 static void show_version(FILE *fp, int detail)
@@ -659,6 +703,10 @@ static void ipc_handle(int sd, void *arg)
 		ipc_show(client, &msg, show_mfc);
 		break;
 
+	case IPC_SHOW_POOLS_CMD:
+		ipc_show(client, &msg, show_pools);
+		break;
+
 	case IPC_SHOW_STATUS_CMD:
 		ipc_show(client, &msg, show_status);
 
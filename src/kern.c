@@ -10,12 +10,62 @@
 #include "defs.h"
 
 #ifdef __linux__ /* Currently only available on Linux  */
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
 # ifndef MRT_TABLE
 #  define MRT_TABLE       (MRT_BASE + 9)
 # endif
+# ifndef RTNL_FAMILY_IPMR
+#  define RTNL_FAMILY_IPMR 128
+# endif
+# ifndef RTPROT_MROUTED
+#  define RTPROT_MROUTED  17
+# endif
+# ifndef NETLINK_CAP_ACK
+#  define NETLINK_CAP_ACK 10
+# endif
+
+/*
+ * MFC changes are queued and sent to the kernel in one go as netlink
+ * RTM_NEWROUTE/RTM_DELROUTE messages for RTNL_FAMILY_IPMR, by calling
+ * k_flush_rg() at the end of each event loop iteration.  The batch is
+ * flushed early when full, or before any MFC change that has to take
+ * the setsockopt() path, so the kernel sees changes in order.
+ */
+#define NL_BATCH_MAX    128		/* MFC changes per batch            */
+#define NL_BUFSIZ       (64 * 1024)	/* room for NL_BATCH_MAX messages   */
+#define NL_RCVBUF       (256 * 1024)	/* room for an error per message    */
+
+struct nlop {
+    int           cmd;			/* MRT_ADD_MFC or MRT_DEL_MFC       */
+    struct mfcctl mc;
+};
+
+static int         nl_sd = -1;		/* NETLINK_ROUTE socket, or -1      */
+static uint32_t    nl_seq;		/* seq of first message in batch    */
+static size_t      nl_len;		/* bytes queued in nl_buf           */
+static size_t      nl_nops;		/* messages queued in nl_buf        */
+static struct nlop nl_ops[NL_BATCH_MAX];
+static union {
+    struct nlmsghdr nh;
+    char            buf[NL_BUFSIZ];
+} nl_buf;
+
+/* Netlink identifies the inbound interface by ifindex, not vif */
+static int         vif_ifindex[MAXVIFS];
+static uint32_t    vif_lcladdr[MAXVIFS];
+
+static void nl_open   (void);
+static void nl_close  (void);
+static int  nl_queue  (int cmd, struct mfcctl *mc);
+static void nl_errors (size_t num);
 #endif
 
-int curttl = 0;
+int      curttl  = 0;
+int      curloop = -1;			/* -1 unknown, re-set on next call  */
+uint32_t curif   = INADDR_ANY;
+
+static int  k_set_mfc (int cmd, struct mfcctl *mc);
 
 /*
  * Open/init the multicast routing in the kernel and sets the
@@ -41,6 +91,10 @@ void k_init_dvmrp(void)
 	else
 	    logit(LOG_ERR, errno, "Cannot enable multicast routing in kernel");
     }
+
+#ifdef __linux__
+    nl_open();
+#endif
 }
 
 
@@ -50,6 +104,11 @@ void k_init_dvmrp(void)
  */
 void k_stop_dvmrp(void)
 {
+#ifdef __linux__
+    /* The kernel drops all our MFC entries anyway */
+    nl_close();
+#endif
+
     if (setsockopt(igmp_socket, IPPROTO_IP, MRT_DONE, NULL, 0) < 0)
 	logit(LOG_WARNING, errno, "Cannot disable multicast routing in kernel");
 }
@@ -143,24 +202,34 @@ void k_set_ttl(int t)
 
 /*
  * Set/reset the IP_MULTICAST_LOOP. Set/reset is specified by "flag".
+ * The current setting is cached, so this is a no-op if unchanged.
  */
 void k_set_loop(int flag)
 {
     uint8_t loop;
 
-    loop = flag;
+    loop = flag ? 1 : 0;
+    if (curloop == loop)
+	return;
+
     if (setsockopt(igmp_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
         logit(LOG_ERR, errno, "Failed setting socket IP_MULTICAST_LOOP to %u", loop);
+
+    curloop = loop;
 }
 
 
 /*
- * Set the IP_MULTICAST_IF option on local interface ifa.
+ * Set the IP_MULTICAST_IF option on local interface ifa.  Like the
+ * loop setting this is cached, so it is a no-op if unchanged.
  */
 void k_set_if(uint32_t ifa)
 {
     struct in_addr adr;
 
+    if (curif == ifa)
+	return;
+
     adr.s_addr = ifa;
     if (setsockopt(igmp_socket, IPPROTO_IP, IP_MULTICAST_IF, &adr, sizeof(adr)) < 0) {
         if (errno == EADDRNOTAVAIL || errno == EINVAL)
@@ -168,6 +237,29 @@ void k_set_if(uint32_t ifa)
         logit(LOG_ERR, errno, "Failed setting IP_MULTICAST_IF to %s",
               inet_fmt(ifa, s1, sizeof(s1)));
     }
+
+    curif = ifa;
+}
+
+
+/*
+ * Find the ifindex of the phyint vif with local address ifa, used by
+ * send_igmp() to pick the outbound interface per packet with IP_PKTINFO
+ * instead of a setsockopt() call.  Returns 0 if there is no such vif,
+ * or on systems where this is not supported.
+ */
+int k_get_ifindex(uint32_t ifa)
+{
+#ifdef __linux__
+    vifi_t vifi;
+
+    for (vifi = 0; vifi < MAXVIFS; vifi++) {
+	if (vif_ifindex[vifi] && vif_lcladdr[vifi] == ifa)
+	    return vif_ifindex[vifi];
+    }
+#endif
+
+    return 0;
 }
 
 
@@ -236,6 +328,10 @@ void k_add_vif(vifi_t vifi, struct uvif *v)
 
     vc.vifc_vifi = vifi;
     uvif_to_vifctl(&vc, v);
+#ifdef __linux__
+    vif_ifindex[vifi] = (v->uv_flags & VIFF_TUNNEL) ? 0 : v->uv_ifindex;
+    vif_lcladdr[vifi] = v->uv_lcl_addr;
+#endif
     if (setsockopt(igmp_socket, IPPROTO_IP, MRT_ADD_VIF, &vc, sizeof(vc)) < 0) {
 #ifdef __linux__
 	int olderrno = errno;
@@ -263,6 +359,11 @@ void k_del_vif(vifi_t vifi, struct uvif *v)
 #ifdef __linux__
     struct vifctl vc;
 
+    /* Queued MFC changes may still refer to this vif */
+    k_flush_rg();
+    vif_ifindex[vifi] = 0;
+    vif_lcladdr[vifi] = 0;
+
     vc.vifc_vifi = vifi;
     uvif_to_vifctl(&vc, v);
 
@@ -279,9 +380,47 @@ void k_del_vif(vifi_t vifi, struct uvif *v)
 }
 
 
+/*
+ * Add or delete an MFC entry using setsockopt(), logs any error.
+ */
+static int k_set_mfc(int cmd, struct mfcctl *mc)
+{
+    char ttls[3 * MAXVIFS + 1] = { 0 };
+    vifi_t i;
+
+    if (!setsockopt(igmp_socket, IPPROTO_IP, cmd, mc, sizeof(*mc)))
+	return 0;
+
+    if (cmd == MRT_DEL_MFC) {
+	if (errno == ENOENT)
+	    return 0;
+
+	logit(LOG_WARNING, errno, "Failed MRT_DEL_MFC(%s %s)",
+	      inet_fmt(mc->mfcc_origin.s_addr, s1, sizeof(s1)),
+	      inet_fmt(mc->mfcc_mcastgrp.s_addr, s2, sizeof(s2)));
+	return -1;
+    }
+
+    for (i = 0; i < numvifs; i++) {
+	char buf[10];
+
+	snprintf(buf, sizeof(buf), "%d%s", mc->mfcc_ttls[i], i + 1 < numvifs ? ", " : "");
+	strlcat(ttls, buf, sizeof(ttls));
+    }
+
+    logit(LOG_WARNING, errno, "Failed MRT_ADD_MFC(%s, %s) from vif %d to vif(s) %s",
+	  inet_fmt(mc->mfcc_origin.s_addr, s1, sizeof(s1)),
+	  inet_fmt(mc->mfcc_mcastgrp.s_addr, s2, sizeof(s2)),
+	  mc->mfcc_parent, ttls);
+
+    return -1;
+}
+
+
 /*
  * Adds a (source, mcastgrp) entry to the kernel.  Called by
  * prune.c:add_table_entry() on IGMPMSG_NOCACHE from the kernel.
+ * On Linux the change is usually queued, see k_flush_rg().
  */
 void k_add_rg(uint32_t origin, struct gtable *g)
 {
@@ -307,27 +446,18 @@ void k_add_rg(uint32_t origin, struct gtable *g)
 	      inet_fmt(origin, s1, sizeof(s1)), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)));
 	return;
     }
-#endif
-
-    if (setsockopt(igmp_socket, IPPROTO_IP, MRT_ADD_MFC, &mc, sizeof(mc)) < 0) {
-	char ttls[3 * MAXVIFS + 1] = { 0 };
 
-	for (i = 0; i < numvifs; i++) {
-	    char buf[10];
-
-	    snprintf(buf, sizeof(buf), "%d%s", mc.mfcc_ttls[i], i + 1 < numvifs ? ", " : "");
-	    strlcat(ttls, buf, sizeof(ttls));
-	}
+    if (!nl_queue(MRT_ADD_MFC, &mc))
+	return;
+#endif
 
-	logit(LOG_WARNING, errno, "Failed MRT_ADD_MFC(%s, %s) from vif %d to vif(s) %s",
-	      inet_fmt(origin, s1, sizeof(s1)), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)),
-	      mc.mfcc_parent, ttls);
-    }
+    k_set_mfc(MRT_ADD_MFC, &mc);
 }
 
 
 /*
- * Deletes a (source, mcastgrp) entry from the kernel
+ * Deletes a (source, mcastgrp) entry from the kernel.  On Linux the
+ * change is usually queued, errors are then logged by k_flush_rg().
  */
 int k_del_rg(uint32_t origin, struct gtable *g)
 {
@@ -337,16 +467,238 @@ int k_del_rg(uint32_t origin, struct gtable *g)
     mc.mfcc_origin.s_addr = origin;
     mc.mfcc_mcastgrp.s_addr = g->gt_mcastgrp;
 
+#ifdef __linux__
+    if (!nl_queue(MRT_DEL_MFC, &mc))
+	return 0;
+#endif
+
     /* write to kernel space */
-    if (setsockopt(igmp_socket, IPPROTO_IP, MRT_DEL_MFC, &mc, sizeof(mc)) < 0 && errno != ENOENT) {
-	logit(LOG_WARNING, errno, "Failed MRT_DEL_MFC(%s %s)",
-	      inet_fmt(origin, s1, sizeof(s1)), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)));
+    return k_set_mfc(MRT_DEL_MFC, &mc);
+}
+
+
+/*
+ * Send all queued MFC changes to the kernel.  Called at the end of each
+ * event loop iteration, and before anything that depends on the kernel
+ * MFC being up to date.  No-op on systems without netlink.
+ */
+void k_flush_rg(void)
+{
+#ifdef __linux__
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+    struct iovec iov = { .iov_base = nl_buf.buf, .iov_len = nl_len };
+    struct msghdr msg = {
+	.msg_name    = &sa,
+	.msg_namelen = sizeof(sa),
+	.msg_iov     = &iov,
+	.msg_iovlen  = 1,
+    };
+    size_t i, num = nl_nops;
+
+    if (!num)
+	return;
+    nl_nops = nl_len = 0;
+
+    if (sendmsg(nl_sd, &msg, 0) < 0) {
+	logit(LOG_WARNING, errno, "Failed sending %zu MFC changes over netlink, retrying", num);
+	for (i = 0; i < num; i++)
+	    k_set_mfc(nl_ops[i].cmd, &nl_ops[i].mc);
+    } else {
+	IF_DEBUG(DEBUG_KERN)
+	    logit(LOG_DEBUG, 0, "Sent %zu MFC changes over netlink", num);
+	nl_errors(num);
+    }
+
+    nl_seq += num;
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Open the netlink socket used for MFC changes.  Without it, or if the
+ * kernel turns out to not support IPMR routes over netlink, all changes
+ * go by setsockopt() instead.
+ */
+static void nl_open(void)
+{
+    int val;
+
+    nl_close();
+
+    nl_sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (nl_sd < 0) {
+	logit(LOG_INFO, errno, "Cannot open netlink socket, using setsockopt() for MFC changes");
+	return;
+    }
+
+    /* Only need the error code back, not the whole failed message */
+    val = 1;
+    (void)setsockopt(nl_sd, SOL_NETLINK, NETLINK_CAP_ACK, &val, sizeof(val));
+    val = NL_RCVBUF;
+    (void)setsockopt(nl_sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+    nl_seq = time(NULL);
+}
+
+/*
+ * Drop any queued MFC changes and close the netlink socket.
+ */
+static void nl_close(void)
+{
+    nl_nops = nl_len = 0;
+    if (nl_sd < 0)
+	return;
+
+    close(nl_sd);
+    nl_sd = -1;
+}
+
+/*
+ * Append a route attribute to netlink message nh, returns it so the
+ * caller can fill in data of its own if val is NULL.
+ */
+static struct rtattr *nl_attr(struct nlmsghdr *nh, int type, const void *val, size_t len)
+{
+    struct rtattr *rta;
+
+    rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(len);
+    if (val)
+	memcpy(RTA_DATA(rta), val, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
 
+    return rta;
+}
+
+/*
+ * Queue an MFC change as a netlink message.  Returns -1, after flushing
+ * the queue, if the change must be made with setsockopt() instead.  The
+ * outbound TTLs are sent as one rtnexthop per vif, in vif order.
+ */
+static int nl_queue(int cmd, struct mfcctl *mc)
+{
+    uint32_t table = mrt_table_id ? mrt_table_id : RT_TABLE_DEFAULT;
+    struct rtnexthop *rtnh;
+    struct nlmsghdr *nh;
+    struct rtattr *rta;
+    struct rtmsg *rtm;
+    size_t len;
+    vifi_t i;
+
+    if (nl_sd < 0 || (cmd == MRT_ADD_MFC && !vif_ifindex[mc->mfcc_parent])) {
+	k_flush_rg();
 	return -1;
     }
 
+    len = NLMSG_SPACE(sizeof(struct rtmsg)) + 3 * RTA_SPACE(sizeof(uint32_t));
+    if (cmd == MRT_ADD_MFC)
+	len += RTA_SPACE(sizeof(uint32_t)) + RTA_SPACE(numvifs * sizeof(struct rtnexthop));
+    if (nl_nops == NL_BATCH_MAX || nl_len + len > sizeof(nl_buf))
+	k_flush_rg();
+
+    nh = (struct nlmsghdr *)(nl_buf.buf + nl_len);
+    memset(nh, 0, len);
+    nh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    nh->nlmsg_type  = cmd == MRT_ADD_MFC ? RTM_NEWROUTE : RTM_DELROUTE;
+    nh->nlmsg_flags = NLM_F_REQUEST;
+    nh->nlmsg_seq   = nl_seq + nl_nops;
+
+    rtm = NLMSG_DATA(nh);
+    rtm->rtm_family   = RTNL_FAMILY_IPMR;
+    rtm->rtm_src_len  = 32;
+    rtm->rtm_dst_len  = 32;
+    rtm->rtm_type     = RTN_MULTICAST;
+    rtm->rtm_scope    = RT_SCOPE_UNIVERSE;
+    rtm->rtm_protocol = RTPROT_MROUTED;
+
+    nl_attr(nh, RTA_TABLE, &table, sizeof(table));
+    nl_attr(nh, RTA_SRC, &mc->mfcc_origin.s_addr, sizeof(uint32_t));
+    nl_attr(nh, RTA_DST, &mc->mfcc_mcastgrp.s_addr, sizeof(uint32_t));
+    if (cmd == MRT_ADD_MFC) {
+	nl_attr(nh, RTA_IIF, &vif_ifindex[mc->mfcc_parent], sizeof(uint32_t));
+
+	rta = nl_attr(nh, RTA_MULTIPATH, NULL, numvifs * sizeof(struct rtnexthop));
+	rtnh = RTA_DATA(rta);
+	for (i = 0; i < numvifs; i++, rtnh++) {
+	    rtnh->rtnh_len     = sizeof(*rtnh);
+	    rtnh->rtnh_hops    = mc->mfcc_ttls[i];
+	    rtnh->rtnh_ifindex = vif_ifindex[i];
+	}
+    }
+
+    nl_len += NLMSG_ALIGN(nh->nlmsg_len);
+    nl_ops[nl_nops].cmd = cmd;
+    nl_ops[nl_nops].mc  = *mc;
+    nl_nops++;
+
     return 0;
-}	
+}
+
+/*
+ * Collect errors for the 'num' messages just sent.  The kernel handles
+ * netlink requests synchronously, so all errors are already queued on
+ * the socket.  Messages are not acked, only failures are reported.
+ */
+static void nl_errors(size_t num)
+{
+    union {
+	struct nlmsghdr nh;
+	char            buf[1024];
+    } rsp;
+    struct nlmsgerr *err;
+    struct nlmsghdr *nh;
+    struct nlop *op;
+    int nosupp = 0;
+    ssize_t len;
+    size_t i;
+
+    while (1) {
+	len = recv(nl_sd, rsp.buf, sizeof(rsp.buf), MSG_DONTWAIT);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == ENOBUFS) {
+		logit(LOG_WARNING, 0, "Lost netlink replies, some failed MFC changes not logged");
+		continue;
+	    }
+	    break;
+	}
+
+	for (nh = &rsp.nh; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+	    if (nh->nlmsg_type != NLMSG_ERROR)
+		continue;
+
+	    err = NLMSG_DATA(nh);
+	    i = nh->nlmsg_seq - nl_seq;
+	    if (!err->error || i >= num)
+		continue;
+
+	    op = &nl_ops[i];
+	    if (err->error == -EOPNOTSUPP) {
+		nosupp = 1;
+		k_set_mfc(op->cmd, &op->mc);
+		continue;
+	    }
+
+	    if (op->cmd == MRT_DEL_MFC && err->error == -ENOENT)
+		continue;
+
+	    errno = -err->error;
+	    logit(LOG_WARNING, errno, "Failed netlink %s(%s, %s)",
+		  op->cmd == MRT_ADD_MFC ? "RTM_NEWROUTE" : "RTM_DELROUTE",
+		  inet_fmt(op->mc.mfcc_origin.s_addr, s1, sizeof(s1)),
+		  inet_fmt(op->mc.mfcc_mcastgrp.s_addr, s2, sizeof(s2)));
+	}
+    }
+
+    if (nosupp) {
+	logit(LOG_INFO, 0, "Kernel does not support IPMR routes over netlink, "
+	      "using setsockopt() for MFC changes");
+	nl_close();
+    }
+}
+#endif /* __linux__ */
 
 /*
  * Get the kernel's idea of what version of mrouted needs to run with it.
@@ -28,6 +28,12 @@ int did_final_init = 0;
 
 int cache_lifetime 	= DEFAULT_CACHE_LIFETIME;
 int prune_lifetime	= AVERAGE_PRUNE_LIFETIME;
+int cache_max_groups	= 0;
+int cache_max_sources	= 0;
+int cache_max_prunes	= 0;
+int upcall_rate		= 0;
+int upcall_burst	= 0;
+int prune_rate		= DEFAULT_PRUNE_RATE;
 
 int startupdelay = 0;
 int mrt_table_id = 0;
@@ -50,6 +56,7 @@ static void final_init     (int, void *);
 static void fasttimer      (int, void *);
 static void timer          (int, void *);
 static void handle_signals (int, void *);
+static void flush_kernel   (void *);
 static int  timeout        (int);
 static void cleanup        (void);
 
@@ -397,6 +404,9 @@ int main(int argc, char *argv[])
     pev_sig_add(SIGUSR1, handle_signals, NULL);
     pev_sig_add(SIGUSR2, handle_signals, NULL);
 
+    /* Commit MFC changes queued while handling events */
+    pev_hook_set(flush_kernel, NULL);
+
     /* XXX HACK
      * This will cause black holes for the first few seconds after startup,
      * since we are exchanging routes but not actually forwarding.
@@ -451,7 +461,8 @@ static void final_init(int id, void *arg)
  * the routing table and send partial updates to all neighbors at a
  * rate that will cause the entire table to be sent in ROUTE_REPORT_INTERVAL
  * seconds.  Also, every TIMER_INTERVAL seconds it calls timer() to
- * do all the other time-based processing.
+ * do all the other time-based processing.  Prune retransmission and
+ * pacing of prunes and grafts run every second, see prune_tick().
  */
 static void fasttimer(int id, void *arg)
 {
@@ -460,6 +471,8 @@ static void fasttimer(int id, void *arg)
     unsigned int t = tlast + 1;
     int n;
 
+    prune_tick();
+
     /*
      * if we're in the last second, send everything that's left.
      * otherwise send at least the fraction we should have sent by now.
@@ -488,6 +501,16 @@ static void fasttimer(int id, void *arg)
     }
 }
 
+/*
+ * Called at the end of each event loop iteration, see run_upcalls()
+ * and k_flush_rg().
+ */
+static void flush_kernel(void *arg)
+{
+    run_upcalls();
+    k_flush_rg();
+}
+
 /*
  * The 'virtual_time' variable is initialized to a value that will cause the
  * first invocation of timer() to send a probe or route report to all vifs
@@ -1000,7 +1000,7 @@ int main(int argc, char *argv[])
 
 	recvlen = recvfrom(igmp_socket, recv_buf, RECV_BUF_SIZE, 0, NULL, &dummy);
 	if (recvlen >= 0)
-	    accept_igmp(-1, recvlen);
+	    accept_igmp(-1, recv_buf, recvlen);
 	else if (errno != EINTR)
 	    perror("recvfrom");
     }
@@ -1032,6 +1032,9 @@ void accept_g_ack(uint32_t src, uint32_t dst, char *p, size_t datalen)
 void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 {
 }
+void accept_upcall(uint32_t origin, uint32_t mcastgrp)
+{
+}
 void accept_leave_message(int ifi, uint32_t src, uint32_t dst, uint32_t group)
 {
 }
@@ -542,6 +542,9 @@ void accept_g_ack(uint32_t src, uint32_t dst, char *p, size_t datalen)
 void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 {
 }
+void accept_upcall(uint32_t origin, uint32_t mcastgrp)
+{
+}
 void check_vif_state(void)
 {
 }
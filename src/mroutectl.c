@@ -328,6 +328,7 @@ static int usage(int rc)
 	       "  show interfaces         Show interface table\n"
 	       "  show mfc                Show multicast forwarding cache\n"
 	       "  show neighbor           Show information about DVMRP neighbors\n"
+	       "  show pools              Show memory pool usage\n"
 	       "  show routes             Show DVMRP routing table\n");
 
 	fputs("\nValid debug subsystems:\n", stderr);
@@ -412,6 +413,7 @@ int main(int argc, char *argv[])
 		{ "ifaces",     NULL, NULL,         IPC_SHOW_IFACE_CMD      }, /* alias */
 		{ "mfc",        NULL, NULL,         IPC_SHOW_MFC_CMD        },
 		{ "neighbor",   NULL, NULL,         IPC_SHOW_NEIGH_CMD      },
+		{ "pools",      NULL, NULL,         IPC_SHOW_POOLS_CMD      },
 		{ "status",     NULL, NULL,         IPC_SHOW_STATUS_CMD     },
 		{ "version",    NULL, NULL,         IPC_VERSION_CMD         },
 		{ NULL, NULL, NULL, 0 }
@@ -1703,6 +1703,10 @@ void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 {
 }
 
+void accept_upcall(uint32_t origin, uint32_t mcastgrp)
+{
+}
+
 void accept_leave_message(int ifi, uint32_t src, uint32_t dst, uint32_t group)
 {
 }
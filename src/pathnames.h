@@ -16,4 +16,8 @@
 #define _PATH_MROUTED_RUNDIR    RUNSTATEDIR
 #define _PATH_MROUTED_SOCK	RUNSTATEDIR  "/%s.sock"
 
+#ifdef __linux__
+#define _PATH_MROUTE_CACHE	"/proc/net/ip_mr_cache"
+#endif
+
 #endif /* MROUTED_PATHNAMES_H_ */
@@ -1,7 +1,12 @@
 /* This is free and unencumbered software released into the public domain. */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,16 +14,40 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <stdint.h>
 #include <sys/types.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 
 #include "pev.h"
+#include "pool.h"
 
 #define PEV_SOCK   1
 #define PEV_TIMER  2
 #define PEV_SIG    3
 
+#define PEV_MAX_EVENTS 64	/* epoll events handled per iteration */
+
+/*
+ * An id maps directly to a slot in the slot table: the low PEV_IDX_BITS
+ * are the slot index, the rest the slot's generation, which is bumped
+ * every time the slot is freed.  So the stale id of a deleted event does
+ * not match the event now using its slot.  Free slots are reused in FIFO
+ * order, and a slot whose generation would wrap is retired instead, so
+ * an id is never handed out twice.  Like the old id counter, that holds
+ * for the first 2^31 events, after which pev_new() fails.
+ */
+#define PEV_IDX_BITS   16
+#define PEV_IDX_MASK   ((1 << PEV_IDX_BITS) - 1)
+#define PEV_GEN_MASK   (INT_MAX >> PEV_IDX_BITS)
+
 struct pev {
 	struct pev *prev, *next;
+	struct pev *dnext;	/* deleted, waiting for pev_cleanup() */
 
 	int id;
 	char type;
@@ -31,6 +60,7 @@ struct pev {
 			int timeout;
 			int period;
 			int gettime;
+			int hidx;	/* index in timer heap, or -1 */
 			struct timespec expiry;
 		};
 	};
@@ -40,16 +70,40 @@ struct pev {
 	void *arg;
 };
 
+struct pevslot {
+	struct pev *entry;	/* NULL when free */
+	int gen;
+	int next;		/* next free slot, 0 for none */
+};
+
 struct pev *pl;
 
+static struct pool *pev_pool;
+static struct pev *dead;
+
+static struct pevslot *slots;
+static int slot_max;		/* slot 0 is never used */
+static int slot_head;		/* free list, oldest first */
+static int slot_tail;
+
 static int events[2];
+#ifdef USE_EPOLL
+static int epfd = -1;
+#else
 static int max_fdnum = -1;
-static int id = 1;
+#endif
 static int running;
 static int status;
 
+static void (*hook_cb)(void *);
+static void *hook_arg;
+static int hook_again;
+
 static struct pev *pev_new  (int type, void (*cb)(int, void *), void *arg);
 static struct pev *pev_find (int type, int signo);
+static struct pev *pev_get  (int id);
+static void        pev_del  (struct pev *entry);
+static void        heap_remove(struct pev *entry);
 
 /******************************* SIGNALS ******************************/
 
@@ -90,9 +144,11 @@ int pev_sig_del(int id)
 {
 	struct pev *entry;
 
-	entry = pev_find(PEV_SIG, id);
-	if (!entry)
+	entry = pev_get(id);
+	if (!entry || entry->type != PEV_SIG) {
+		errno = ENOENT;
 		return -1;
+	}
 
 	sigaction(entry->signo, NULL, NULL);
 
@@ -103,8 +159,8 @@ int pev_sig_set_cb_del(int id, void (*cb)(void *))
 {
 	struct pev *entry;
 
-	entry = pev_find(PEV_SIG, id);
-	if (!entry) {
+	entry = pev_get(id);
+	if (!entry || entry->type != PEV_SIG) {
 		errno = ENOENT;
 		return -1;
 	}
@@ -116,6 +172,91 @@ int pev_sig_set_cb_del(int id, void (*cb)(void *))
 
 /******************************* SOCKETS ******************************/
 
+/*
+ * Two backends: epoll, where sockets are registered once, in
+ * pev_sock_add(), and only ready sockets are returned.  Or select(),
+ * where the fd_set is rebuilt from the list on every iteration.
+ */
+#ifdef USE_EPOLL
+static int sock_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+
+	return 0;
+}
+
+static void sock_exit(void)
+{
+	if (epfd < 0)
+		return;
+
+	close(epfd);
+	epfd = -1;
+}
+
+static int sock_reg(struct pev *entry)
+{
+	struct epoll_event ev = { 0 };
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = entry;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, entry->sd, &ev);
+}
+
+static void sock_unreg(struct pev *entry)
+{
+	/* Fails with EBADF if already closed, the kernel then did it for us */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, entry->sd, NULL);
+}
+
+static int sock_wait(int msec)
+{
+	struct epoll_event ev[PEV_MAX_EVENTS];
+	int i, num;
+
+	num = epoll_wait(epfd, ev, PEV_MAX_EVENTS, msec);
+	for (i = 0; i < num; i++) {
+		struct pev *entry = ev[i].data.ptr;
+
+		/* Deleted by an earlier callback, freed next iteration */
+		if (entry->active < 1 || !entry->cb)
+			continue;
+
+		entry->cb(entry->sd, entry->arg);
+	}
+
+	return num;
+}
+#else
+static int sock_init(void)
+{
+	return 0;
+}
+
+static void sock_exit(void)
+{
+}
+
+static int sock_reg(struct pev *entry)
+{
+	if (entry->sd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sock_unreg(struct pev *entry)
+{
+	/* Issue a new run, to rebuild the fd_set */
+	(void)entry;
+	sig_handler(0);
+}
+
 static int nfds(void)
 {
 	return max_fdnum + 1;
@@ -141,6 +282,35 @@ static void sock_run(fd_set *fds)
 		max_fdnum = fdmax;
 }
 
+static int sock_wait(int msec)
+{
+	struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+	struct pev *entry, *next;
+	fd_set fds;
+	int num;
+
+	sock_run(&fds);
+	num = select(nfds(), &fds, NULL, NULL, msec < 0 ? NULL : &tv);
+	if (num <= 0)
+		return num;
+
+	for (entry = pl; entry; entry = next) {
+		next = entry->next;
+
+		if (entry->type != PEV_SOCK)
+			continue;
+
+		if (!FD_ISSET(entry->sd, &fds))
+			continue;
+
+		if (entry->active > 0 && entry->cb)
+			entry->cb(entry->sd, entry->arg);
+	}
+
+	return num;
+}
+#endif
+
 int pev_sock_add(int sd, void (*cb)(int, void *), void *arg)
 {
 	struct pev *entry;
@@ -163,6 +333,10 @@ int pev_sock_add(int sd, void (*cb)(int, void *), void *arg)
 		return -1;
 
 	entry->sd = sd;
+	if (sock_reg(entry)) {
+		pev_del(entry);
+		return -1;
+	}
 
 	return entry->id;
 }
@@ -171,21 +345,20 @@ int pev_sock_del(int id)
 {
 	struct pev *entry;
 
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->id == id) {
-			/* Mark for deletion and issue a new run */
-			entry->active = 0;
-			sig_handler(0);
+	entry = pev_get(id);
+	if (!entry)
+		return -1;
 
-			if (entry->cb_del)
-				entry->cb_del(entry->arg);
+	if (entry->type == PEV_SOCK)
+		sock_unreg(entry);
+	if (entry->type == PEV_TIMER)
+		heap_remove(entry);
+	pev_del(entry);
 
-			return 0;
-		}
-	}
+	if (entry->cb_del)
+		entry->cb_del(entry->arg);
 
-	errno = ENOENT;
-	return -1;
+	return 0;
 }
 
 int pev_sock_open(int domain, int type, int proto, void (*cb)(int, void *), void *arg)
@@ -227,153 +400,296 @@ int pev_sock_set_cb_del(int id, void (*cb)(void *))
 {
 	struct pev *entry;
 
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->id == id) {
-			entry->cb_del = cb;
+	entry = pev_get(id);
+	if (!entry)
+		return -1;
 
-			return 0;
-		}
-	}
+	entry->cb_del = cb;
 
-	errno = ENOENT;
-	return -1;
+	return 0;
 }
 
 /******************************* TIMERS *******************************/
 
-static struct pev *timer_ffs(void)
+/*
+ * Armed timers are kept in a binary min-heap, ordered by expiry, so
+ * adding, re-arming, deleting and firing a timer is O(log n).  On Linux
+ * the earliest expiry is programmed into a timerfd, which is polled like
+ * any other socket.  Elsewhere the event loop sleeps until it expires.
+ */
+static struct pev **heap;
+static int heap_len;
+static int heap_max;
+
+#ifdef HAVE_SYS_TIMERFD_H
+static int timer_fd = -1;
+static struct timespec timer_armed;	/* expiry timerfd is set to */
+#endif
+
+static int timer_before(const struct timespec *a, const struct timespec *b)
 {
-	struct pev *entry;
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
 
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->type == PEV_TIMER && entry->active > 0)
-			return entry;
-	}
+	return a->tv_nsec < b->tv_nsec;
+}
 
-	return NULL;
+static void heap_set(int i, struct pev *entry)
+{
+	heap[i] = entry;
+	entry->hidx = i;
 }
 
-static struct pev *timer_compare(struct pev *a, struct pev *b)
+static void heap_up(int i)
 {
-	if (b->type != PEV_TIMER || b->active < 1)
-		return a;
+	struct pev *entry = heap[i];
 
-	if (a->expiry.tv_sec < b->expiry.tv_sec)
-		return a;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
 
-	if (a->expiry.tv_sec == b->expiry.tv_sec &&
-	    a->expiry.tv_nsec <= b->expiry.tv_nsec)
-		return a;
+		if (!timer_before(&entry->expiry, &heap[parent]->expiry))
+			break;
 
-	return b;
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+	heap_set(i, entry);
 }
 
-static int timer_start(const struct timespec *now)
+static void heap_down(int i)
 {
-	struct itimerval it = { 0 };
-	struct pev *next, *entry;
+	struct pev *entry = heap[i];
 
-	next = timer_ffs();
-	if (!next)
-		return -1;
+	while (1) {
+		int child = 2 * i + 1;
 
-	for (entry = pl; entry; entry = entry->next)
-		next = timer_compare(next, entry);
+		if (child >= heap_len)
+			break;
+		if (child + 1 < heap_len &&
+		    timer_before(&heap[child + 1]->expiry, &heap[child]->expiry))
+			child++;
+		if (!timer_before(&heap[child]->expiry, &entry->expiry))
+			break;
 
-	it.it_value.tv_sec  =  next->expiry.tv_sec  - now->tv_sec;
-	it.it_value.tv_usec = (next->expiry.tv_nsec - now->tv_nsec) / 1000;
-	if (it.it_value.tv_usec < 0) {
-		it.it_value.tv_sec -= 1;
-		it.it_value.tv_usec = 1000000 + it.it_value.tv_usec;
+		heap_set(i, heap[child]);
+		i = child;
 	}
+	heap_set(i, entry);
+}
 
-	/* Sanity check resulting value, prevent disabling timer */
-	if (it.it_value.tv_sec < 0)
-		it.it_value.tv_sec = 0;
-	if (it.it_value.tv_sec == 0 && it.it_value.tv_usec < 1)
-		it.it_value.tv_usec = 1;
+static int heap_insert(struct pev *entry)
+{
+	if (heap_len == heap_max) {
+		struct pev **tmp;
+		int max;
 
-	return setitimer(ITIMER_REAL, &it, NULL);
+		max = heap_max ? heap_max * 2 : 64;
+		tmp = realloc(heap, max * sizeof(*heap));
+		if (!tmp)
+			return -1;
+
+		heap = tmp;
+		heap_max = max;
+	}
+
+	heap_set(heap_len++, entry);
+	heap_up(entry->hidx);
+
+	return 0;
 }
 
-static int timer_expired(const struct pev *entry, const struct timespec *now)
+static void heap_clear(void)
 {
-	if (entry->type != PEV_TIMER || entry->active < 1)
-		return 0;
+	while (heap_len > 0)
+		heap[--heap_len]->hidx = -1;
+}
+
+static void heap_remove(struct pev *entry)
+{
+	int i = entry->hidx;
+
+	if (i < 0)
+		return;
+
+	entry->hidx = -1;
+	if (--heap_len == i)
+		return;
+
+	heap_set(i, heap[heap_len]);
+	heap_down(i);
+	heap_up(heap[i]->hidx);
+}
 
-	if (entry->expiry.tv_sec < now->tv_sec)
-		return 1;
+/*
+ * (Re)arm timer to expire 'usec' microseconds from now
+ */
+static int timer_arm(struct pev *entry, int usec, const struct timespec *now)
+{
+	entry->expiry.tv_sec  = now->tv_sec + usec / 1000000;
+	entry->expiry.tv_nsec = now->tv_nsec + (usec % 1000000) * 1000;
+	if (entry->expiry.tv_nsec >= 1000000000) {
+		entry->expiry.tv_sec++;
+		entry->expiry.tv_nsec -= 1000000000;
+	}
 
-	if (entry->expiry.tv_sec == now->tv_sec &&
-	    entry->expiry.tv_nsec <= now->tv_nsec)
-		return 1;
+	if (entry->hidx < 0)
+		return heap_insert(entry);
+
+	heap_down(entry->hidx);
+	heap_up(entry->hidx);
 
 	return 0;
 }
 
-static void timer_run(int signo, void *arg)
+/*
+ * Program the timerfd with the earliest expiry, unless already done
+ */
+static void timer_start(void)
 {
-	struct pev *entry, *next;
+#ifdef HAVE_SYS_TIMERFD_H
+	struct itimerspec it = { 0 };
+
+	if (heap_len)
+		it.it_value = heap[0]->expiry;
+
+	if (it.it_value.tv_sec == timer_armed.tv_sec &&
+	    it.it_value.tv_nsec == timer_armed.tv_nsec)
+		return;
+
+	/* A zero it_value disarms the timer */
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &it, NULL))
+		return;
+
+	timer_armed = it.it_value;
+#endif
+}
+
+/*
+ * Milliseconds the event loop may sleep before the next timer, or -1
+ */
+static int timer_wait(void)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+	return -1;
+#else
 	struct timespec now;
+	long msec;
+
+	if (!heap_len)
+		return -1;
 
-	(void)arg;
 	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec  = (heap[0]->expiry.tv_sec - now.tv_sec) * 1000;
+	msec += (heap[0]->expiry.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	if (msec < 0)
+		return 0;
 
-	for (entry = pl; entry; entry = next) {
-		unsigned int sec, usec;
-		int timeout;
+	return msec;
+#endif
+}
 
-		next = entry->next;
-		if (entry->type != PEV_TIMER)
-			continue;
+/*
+ * Run callbacks of all expired timers, returns the number run
+ */
+static int timer_run(void)
+{
+	struct timespec now;
+	int num = 0;
 
-		if (!timer_expired(entry, &now))
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (heap_len && !timer_before(&now, &heap[0]->expiry)) {
+		struct pev *entry = heap[0];
+		int timeout;
+
+		heap_remove(entry);
 
 		if (entry->timeout)
 			timeout = entry->timeout;
 		else
 			timeout = entry->period;
 
-		if (signo && entry->cb) {
-			entry->timeout = 0;
-			entry->gettime = timeout;
-			entry->cb(entry->id, entry->arg);
-			entry->gettime = 0;
+		entry->timeout = 0;
+		entry->gettime = timeout;
+		entry->cb(entry->id, entry->arg);
+		entry->gettime = 0;
+		num++;
 
-			if (!entry->period && !entry->timeout) {
-				entry->active = -1;
-				continue;
-			}
-		}
+		/* Deleted, or re-armed with pev_timer_set(), in callback */
+		if (!entry->active || entry->hidx >= 0)
+			continue;
 
-		sec  = timeout / 1000000;
-		usec = timeout % 1000000;
-		entry->expiry.tv_sec  = now.tv_sec + sec;
-		entry->expiry.tv_nsec = now.tv_nsec + (usec * 1000);
-		if (entry->expiry.tv_nsec > 1000000000) {
-			entry->expiry.tv_sec++;
-			entry->expiry.tv_nsec -= 1000000000;
-		}
+		if (entry->period)
+			timer_arm(entry, entry->period, &now);
+		else
+			pev_sock_del(entry->id); /* Spent one-shot, free its slot */
 	}
 
-	timer_start(&now);
+	return num;
+}
+
+#ifdef HAVE_SYS_TIMERFD_H
+static void timer_event(int sd, void *arg)
+{
+	uint64_t cnt;
+
+	(void)arg;
+	if (read(sd, &cnt, sizeof(cnt)) < 0)
+		return;
+
+	timer_run();
 }
 
 static int timer_init(void)
 {
-	return pev_sig_add(SIGALRM, timer_run, NULL);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return -1;
+
+	if (pev_sock_add(timer_fd, timer_event, NULL) < 0) {
+		close(timer_fd);
+		timer_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int timer_exit(void)
+{
+	heap_clear();
+	memset(&timer_armed, 0, sizeof(timer_armed));
+
+	return pev_sock_close(timer_fd);
+}
+
+/* Timers are run from timer_event() */
+static int timer_poll(void)
+{
+	return 0;
+}
+#else
+static int timer_init(void)
+{
+	return 0;
 }
 
 static int timer_exit(void)
 {
-	struct itimerval it = { 0 };
+	heap_clear();
 
-	return setitimer(ITIMER_REAL, &it, NULL);
+	return 0;
 }
 
+static int timer_poll(void)
+{
+	return timer_run();
+}
+#endif
+
 int pev_timer_add(int timeout, int period, void (*cb)(int, void *), void *arg)
 {
+	struct timespec now;
 	struct pev *entry;
 
 	if (timeout <= 0 && period <= 0) {
@@ -387,7 +703,13 @@ int pev_timer_add(int timeout, int period, void (*cb)(int, void *), void *arg)
 
 	entry->timeout = timeout;
 	entry->period  = period;
-	entry->active++;
+	entry->hidx    = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timer_arm(entry, timeout > 0 ? timeout : period, &now)) {
+		pev_del(entry);
+		return -1;
+	}
 
 	return entry->id;
 }
@@ -399,44 +721,41 @@ int pev_timer_del(int id)
 
 int pev_timer_set(int id, int timeout)
 {
+	struct timespec now;
 	struct pev *entry;
 
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->type != PEV_TIMER)
-			continue;
-		if (entry->id != id)
-			continue;
+	entry = pev_get(id);
+	if (!entry || entry->type != PEV_TIMER) {
+		errno = ENOENT;
+		return -1;
+	}
 
-		entry->timeout = timeout;
-		memset(&entry->expiry, 0, sizeof(entry->expiry));
-		entry->active = 2;
+	entry->timeout = timeout;
+	if (timeout <= 0) {
+		heap_remove(entry);
 		return 0;
 	}
 
-	errno = ENOENT;
-	return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timer_arm(entry, timeout, &now);
 }
 
 int pev_timer_get(int id)
 {
 	struct pev *entry;
 
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->type != PEV_TIMER)
-			continue;
-		if (entry->id != id)
-			continue;
-
-		if (entry->gettime)
-			return entry->gettime;
-		if (entry->timeout)
-			return entry->timeout;
-
-		return entry->period;
+	entry = pev_get(id);
+	if (!entry || entry->type != PEV_TIMER) {
+		errno = ENOENT;
+		return -1;
 	}
 
-	errno = ENOENT;
-	return -1;
+	if (entry->gettime)
+		return entry->gettime;
+	if (entry->timeout)
+		return entry->timeout;
+
+	return entry->period;
 }
 
 int pev_timer_set_cb_del(int id, void (*cb)(void *))
@@ -446,6 +765,96 @@ int pev_timer_set_cb_del(int id, void (*cb)(void *))
 
 /******************************* GENERIC ******************************/
 
+static void slot_put(int i)
+{
+	slots[i].next = 0;
+	if (slot_tail)
+		slots[slot_tail].next = i;
+	else
+		slot_head = i;
+	slot_tail = i;
+}
+
+static int slot_grow(void)
+{
+	struct pevslot *tmp;
+	int i, max;
+
+	max = slot_max ? slot_max * 2 : 64;
+	if (max > PEV_IDX_MASK + 1)
+		max = PEV_IDX_MASK + 1;
+	if (max <= slot_max) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tmp = realloc(slots, max * sizeof(*slots));
+	if (!tmp)
+		return -1;
+
+	memset(&tmp[slot_max], 0, (max - slot_max) * sizeof(*slots));
+	slots = tmp;
+
+	for (i = slot_max ? slot_max : 1; i < max; i++)
+		slot_put(i);
+	slot_max = max;
+
+	return 0;
+}
+
+/*
+ * Claim a slot for a new event, returns its id
+ */
+static int slot_alloc(struct pev *entry)
+{
+	int i;
+
+	if (!slot_head && slot_grow())
+		return -1;
+
+	i = slot_head;
+	slot_head = slots[i].next;
+	if (!slot_head)
+		slot_tail = 0;
+
+	slots[i].entry = entry;
+
+	return (slots[i].gen << PEV_IDX_BITS) | i;
+}
+
+static void slot_free(int id)
+{
+	int i = id & PEV_IDX_MASK;
+
+	slots[i].entry = NULL;
+	if (slots[i].gen == PEV_GEN_MASK)
+		return;		/* Retired, all its ids have been used */
+
+	slots[i].gen++;
+	slot_put(i);
+}
+
+/*
+ * Look up a live event by id, in constant time
+ */
+static struct pev *pev_get(int id)
+{
+	struct pev *entry;
+	int i = id & PEV_IDX_MASK;
+
+	if (id <= 0 || i >= slot_max)
+		goto fail;
+
+	entry = slots[i].entry;
+	if (!entry || entry->id != id)
+		goto fail;
+
+	return entry;
+fail:
+	errno = ENOENT;
+	return NULL;
+}
+
 static struct pev *pev_new(int type, void (*cb)(int, void *), void *arg)
 {
 	struct pev *entry;
@@ -455,11 +864,21 @@ static struct pev *pev_new(int type, void (*cb)(int, void *), void *arg)
 		return NULL;
 	}
 
-	entry = calloc(1, sizeof(*entry));
+	if (!pev_pool) {
+		pev_pool = pool_create("events", sizeof(*entry), 64, 0);
+		if (!pev_pool)
+			return NULL;
+	}
+
+	entry = pool_get(pev_pool);
 	if (!entry)
 		return NULL;
 
-	entry->id = id++;
+	entry->id = slot_alloc(entry);
+	if (entry->id < 0) {
+		pool_put(pev_pool, entry);
+		return NULL;
+	}
 	entry->type = type;
 	entry->active = 1;
 
@@ -480,7 +899,7 @@ static struct pev *pev_find(int type, int signo)
 	struct pev *entry;
 
 	for (entry = pl; entry; entry = entry->next) {
-		if (entry->type != type)
+		if (entry->type != type || !entry->active)
 			continue;
 
 		if (entry->signo != signo)
@@ -493,17 +912,29 @@ static struct pev *pev_find(int type, int signo)
 	return NULL;
 }
 
+/*
+ * Mark event for deletion.  Its id is released at once, the record
+ * itself in pev_cleanup(), it may still be referenced by the event
+ * loop in this iteration.
+ */
+static void pev_del(struct pev *entry)
+{
+	entry->active = 0;
+	slot_free(entry->id);
+
+	entry->dnext = dead;
+	dead = entry;
+}
+
 static void pev_cleanup(void)
 {
 	struct pev *entry, *next, *prev;
 
-	for (entry = pl; entry; entry = next) {
+	while ((entry = dead)) {
+		dead = entry->dnext;
+
 		next = entry->next;
 		prev = entry->prev;
-
-		if (entry->active)
-			continue;
-
 		if (next)
 			next->prev = prev;
 		if (prev)
@@ -511,7 +942,7 @@ static void pev_cleanup(void)
 		else
 			pl = next;
 
-		free(entry);
+		pool_put(pev_pool, entry);
 	}
 }
 
@@ -538,6 +969,8 @@ static void pev_event(int sd, void *arg)
 
 int pev_init(void)
 {
+	if (sock_init())
+		return -1;
 	if (pipe(events))
 		return -1;
 	if (pev_sock_add(events[0], pev_event, NULL) < 0)
@@ -548,68 +981,61 @@ int pev_init(void)
 	return timer_init();
 }
 
+int pev_hook_set(void (*cb)(void *), void *arg)
+{
+	hook_cb  = cb;
+	hook_arg = arg;
+
+	return 0;
+}
+
+void pev_hook_again(void)
+{
+	hook_again = 1;
+}
+
 int pev_exit(int rc)
 {
 	struct pev *entry;
 
 	pev_sock_close(events[0]);
 	pev_sock_close(events[1]);
+	timer_exit();
 
-	for (entry = pl; entry; entry = entry->next)
-		entry->active = 0;
+	for (entry = pl; entry; entry = entry->next) {
+		if (entry->active)
+			pev_del(entry);
+	}
 
 	running = 0;
 	status = rc;
+	sock_exit();
 
-	return timer_exit();
+	return 0;
 }
 
-static void pev_check(fd_set *fds)
+static void pev_check(void)
 {
-	struct pev *entry;
-	int trestart = 0;
-
-	sock_run(fds);
 	pev_cleanup();
-
-	for (entry = pl; entry; entry = entry->next) {
-		if (entry->type == PEV_TIMER && entry->active > 1) {
-			entry->active = 1;
-			trestart = 1;
-		}
-	}
-
-	if (trestart)
-		timer_run(0, NULL);
+	timer_start();
 }
 
 int pev_run(void)
 {
-	struct pev *entry, *next;
-	fd_set fds;
-
 	while (running) {
-		int num;
+		int num, fired;
 
-		pev_check(&fds);
+		pev_check();
 
 		errno = 0;
-		num = select(nfds(), &fds, NULL, NULL, NULL);
-		if (num <= 0)
+		num = sock_wait(hook_again ? 0 : timer_wait());
+		fired = timer_poll();
+		if ((num < 0 || (num == 0 && !hook_again)) && !fired)
 			continue;
 
-		for (entry = pl; entry; entry = next) {
-			next = entry->next;
-
-			if (entry->type != PEV_SOCK)
-				continue;
-
-			if (!FD_ISSET(entry->sd, &fds))
-				continue;
-
-			if (entry->cb)
-				entry->cb(entry->sd, entry->arg);
-		}
+		hook_again = 0;
+		if (hook_cb)
+			hook_cb(hook_arg);
 	}
 	pev_cleanup();
 
@@ -38,10 +38,25 @@ int pev_exit       (int status);
  */
 int pev_run        (void);
 
+/*
+ * Optional callback run at the end of every event loop iteration, after
+ * the socket, signal, and timer callbacks of that iteration.  Useful for
+ * committing work batched up by those callbacks.  There is only one, set
+ * cb to NULL to remove it.
+ */
+int pev_hook_set   (void (*cb)(void *), void *arg);
+
+/*
+ * Call from the hook, or any callback, to have the hook run again at
+ * the end of the next event loop iteration without waiting for events.
+ * For work done in bounded batches, e.g. to not starve the sockets.
+ */
+void pev_hook_again(void);
+
 /*
  * Signal callbacks are identified by signal number, only one callback
- * per signal.  Signals are serialized like timers, which use SIGALRM,
- * using a pipe.  Delete by giving id returned from pev_sig_add()
+ * per signal.  Signals are serialized to the event loop using a pipe.
+ * Delete by giving id returned from pev_sig_add()
  */
 int pev_sig_add    (int signo, void (*cb)(int, void *), void *arg);
 int pev_sig_del    (int id);
@@ -80,9 +95,10 @@ int pev_sock_set_cb_del  (int id, void (*cb)(void *));
  * The scheduling granularity of timers is subject to limits in your
  * operating system timer resolution.
  *
- * Periodic timers use SIGALRM via the POSIX setitimer() API, which
- * may affect the use of sleep(), usleep(), and alarm() APIs in your
- * application.  See your respective OS for details.
+ * Timers are kept in a min-heap, ordered by expiry.  On Linux the event
+ * loop is woken up by a timerfd set to the earliest expiry, elsewhere
+ * it sleeps until then.  No signals are used, so sleep(),
+ * usleep(), and alarm() are not affected.
  */
 
 /*
@@ -104,8 +120,10 @@ int pev_timer_add  (int timeout, int period, void (*cb)(int, void *), void *arg)
 int pev_timer_del  (int id);
 
 /*
- * Reset timeout of one-shot timer.  When a one-shot timer has fired
- * it goes inert.  Calling pev_timer_set() rearms the timer.
+ * Reset timeout of one-shot timer.  Calling pev_timer_set() from the
+ * callback of a one-shot timer rearms it.  Otherwise the timer is
+ * deleted when its callback returns, like with pev_timer_del(), and
+ * its id is no longer valid.
  *
  * Remember, the timeout argument is in microseconds.
  *
@@ -0,0 +1,170 @@
+/*
+ * The mrouted program is covered by the license in the accompanying file
+ * named "LICENSE".  Use of the mrouted program represents acceptance of
+ * the terms and conditions listed in that file.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/*
+ * Objects, and the first object after the slab header, are aligned to
+ * POOL_ALIGN bytes.  The slab header is only a link to the next slab;
+ * free objects use their first bytes as the free list link.
+ */
+#define POOL_ALIGN	8
+#define POOL_ROUND(n)	(((n) + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1))
+#define POOL_HDRLEN	POOL_ROUND(sizeof(void *))
+
+static TAILQ_HEAD(, pool) pools = TAILQ_HEAD_INITIALIZER(pools);
+
+static int pool_grow(struct pool *p);
+
+
+/*
+ * Create a new pool of 'size' byte objects, allocated 'nper' at a time.
+ * At most 'max' objects are handed out, or no limit if 'max' is zero.
+ * Returns NULL and sets errno on failure.
+ */
+struct pool *pool_create(const char *name, size_t size, size_t nper, size_t max)
+{
+    struct pool *p;
+
+    if (size < sizeof(void *))
+	size = sizeof(void *);
+    if (nper == 0)
+	nper = 1;
+
+    p = calloc(1, sizeof(struct pool));
+    if (!p)
+	return NULL;
+
+    p->p_name = name;
+    p->p_size = POOL_ROUND(size);
+    p->p_nper = nper;
+    p->p_max  = max;
+    TAILQ_INSERT_TAIL(&pools, p, p_link);
+
+    return p;
+}
+
+
+/*
+ * Release all slabs of a pool, and the pool itself.  Any objects still
+ * handed out are invalid after this call.
+ */
+void pool_destroy(struct pool *p)
+{
+    void *slab, *next;
+
+    if (!p)
+	return;
+
+    for (slab = p->p_slabs; slab; slab = next) {
+	next = *(void **)slab;
+	free(slab);
+    }
+
+    TAILQ_REMOVE(&pools, p, p_link);
+    free(p);
+}
+
+
+/*
+ * Allocate one more slab for pool 'p' and put its objects on the free
+ * list.  The last slab may be cut short to stay within p_max.
+ */
+static int pool_grow(struct pool *p)
+{
+    size_t i, n = p->p_nper;
+    char *slab, *obj;
+
+    if (p->p_max) {
+	if (p->p_total >= p->p_max) {
+	    errno = ENOMEM;
+	    return 1;
+	}
+	if (n > p->p_max - p->p_total)
+	    n = p->p_max - p->p_total;
+    }
+
+    slab = malloc(POOL_HDRLEN + n * p->p_size);
+    if (!slab)
+	return 1;
+
+    *(void **)slab = p->p_slabs;
+    p->p_slabs = slab;
+    p->p_nslabs++;
+    p->p_total += n;
+
+    /* Link in reverse, so objects are handed out in address order */
+    obj = slab + POOL_HDRLEN + n * p->p_size;
+    for (i = 0; i < n; i++) {
+	obj -= p->p_size;
+	*(void **)obj = p->p_free;
+	p->p_free = obj;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Get a zeroed object from pool 'p'.  Returns NULL and sets errno if
+ * the pool is at its limit or out of memory.
+ */
+void *pool_get(struct pool *p)
+{
+    void *obj;
+
+    if (!p->p_free && pool_grow(p)) {
+	p->p_fails++;
+	return NULL;
+    }
+
+    obj = p->p_free;
+    p->p_free = *(void **)obj;
+    memset(obj, 0, p->p_size);
+
+    if (++p->p_inuse > p->p_hiwat)
+	p->p_hiwat = p->p_inuse;
+
+    return obj;
+}
+
+
+/*
+ * Return object 'obj' to pool 'p'.
+ */
+void pool_put(struct pool *p, void *obj)
+{
+    if (!obj)
+	return;
+
+    *(void **)obj = p->p_free;
+    p->p_free = obj;
+    p->p_inuse--;
+}
+
+
+/*
+ * Iterate over all pools, start with *p == NULL.
+ */
+struct pool *pool_iter(struct pool **p)
+{
+    if (!*p)
+	*p = TAILQ_FIRST(&pools);
+    else
+	*p = TAILQ_NEXT(*p, p_link);
+
+    return *p;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "cc-mode"
+ * End:
+ */
@@ -0,0 +1,39 @@
+/*
+ * The mrouted program is covered by the license in the accompanying file
+ * named "LICENSE".  Use of the mrouted program represents acceptance of
+ * the terms and conditions listed in that file.
+ */
+#ifndef MROUTED_POOL_H_
+#define MROUTED_POOL_H_
+
+#include <stddef.h>
+#include "queue.h"
+
+/*
+ * Fixed-size object pool.  Objects are carved out of slabs of p_nper
+ * objects each, allocated on demand, and recycled through a free list.
+ * Slabs are only returned to the system by pool_destroy().  All pools
+ * are kept on a list, see pool_iter(), for occupancy reporting.
+ */
+struct pool {
+    TAILQ_ENTRY(pool) p_link;		/* link in list of all pools        */
+    const char	     *p_name;		/* name, for show/dump output       */
+    size_t	      p_size;		/* object size, incl. padding       */
+    size_t	      p_nper;		/* objects per slab                 */
+    size_t	      p_max;		/* max objects, 0 for no limit      */
+    size_t	      p_nslabs;		/* slabs allocated                  */
+    size_t	      p_total;		/* objects in all slabs             */
+    size_t	      p_inuse;		/* objects handed out               */
+    size_t	      p_hiwat;		/* high watermark of p_inuse        */
+    size_t	      p_fails;		/* failed pool_get() calls          */
+    void	     *p_free;		/* free list of objects             */
+    void	     *p_slabs;		/* list of slabs                    */
+};
+
+extern struct pool *pool_create  (const char *name, size_t size, size_t nper, size_t max);
+extern void         pool_destroy (struct pool *p);
+extern void        *pool_get     (struct pool *p);
+extern void         pool_put     (struct pool *p, void *obj);
+extern struct pool *pool_iter    (struct pool **p);
+
+#endif /* MROUTED_POOL_H_ */
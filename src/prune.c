@@ -8,6 +8,7 @@
  */
 
 #include "defs.h"
+#include "pool.h"
 
 extern int cache_lifetime;
 extern int prune_lifetime;
@@ -22,10 +23,130 @@ extern int allow_black_holes;
 #define JITTERED_VALUE(x) ((x) / 2 + ((int)random() % (x)))
 #define	CACHE_LIFETIME(x) JITTERED_VALUE(x) /* XXX */
 
+#define GTHASH_SIZE	4096		/* must be a power of two */
+#define CACHE_POOL_NPER	256		/* cache entries per pool slab */
+
+/*
+ * Sources in a group entry before its source list is hashed, and the
+ * initial and maximum hash size.  The hash doubles when the number of
+ * sources is more than twice the number of buckets.
+ */
+#define SRCHASH_MIN	32
+#define SRCHASH_BITS	6
+#define SRCHASH_MAXBITS	16
+#define SRCHASH_IDX(gt, o) ((ntohl(o) * 2654435761U) >> (32 - (gt)->gt_srcbits))
+
+/*
+ * NOCACHE upcall intake, see accept_upcall().  At most UPCALL_QLEN
+ * upcalls are pending, UPCALL_BATCH are handled per event loop turn.
+ */
+#define UPCALL_QLEN	1024
+#define UPCALL_BATCH	64
+#define UPCALL_HASH	256		/* pending (S,G) hash, power of two */
+#define UPRATE_SIZE	1024		/* source hash buckets, power of two */
+#define CTWHEEL_SIZE	256		/* slots of TIMER_INTERVAL, power of two */
+#define CTWHEEL_SLOT(t)	(&ctwheel[((t) / TIMER_INTERVAL) & (CTWHEEL_SIZE - 1)])
+#define RXWHEEL_SIZE	64		/* slots of one second, power of two */
+#define RXWHEEL_SLOT(t)	(&rxwheel[(t) & (RXWHEEL_SIZE - 1)])
+
+/* Seconds left until forwarding cache time 't', <= 0 when passed */
+#define CT_LEFT(t)	((int32_t)((t) - ctclock))
+
+/* Max seconds between membership sanity checks, see schedule_cache() */
+#define CT_SANITY	(6 * TIMER_INTERVAL)
+
+/*
+ * Number of per-(S,G) SIOCGETSGCNT calls in one sg_begin()/sg_end()
+ * pass before switching to reading all counters in one go.
+ */
+#define SG_BULK_MIN	32
+
+struct sgcnt {
+    uint32_t	  sc_src;
+    uint32_t	  sc_grp;		/* 0 for an unused slot */
+    unsigned long sc_pktcnt;
+};
+
+struct upcall {
+    TAILQ_ENTRY(upcall) uc_link;	/* on upqueue, or upfree */
+    struct upcall	*uc_hnext;	/* next in uphash bucket */
+    uint32_t		 uc_src;
+    uint32_t		 uc_grp;
+};
+
+/* Prune or graft waiting for its upstream neighbor's rate, see send_upstream() */
+struct txmsg {
+    TAILQ_ENTRY(txmsg) tx_link;
+    struct gtable     *tx_gt;		/* entry it was sent for, or NULL    */
+    struct txnbr      *tx_nbr;		/* queue it is on		     */
+    uint32_t	       tx_dst;
+    uint32_t	       tx_origin;
+    uint32_t	       tx_grp;
+    uint32_t	       tx_lifetime;	/* prune lifetime, unused for grafts */
+    struct timespec    tx_queued;	/* when queued, for latency stats    */
+    vifi_t	       tx_vifi;
+    int		       tx_code;		/* DVMRP_PRUNE or DVMRP_GRAFT	     */
+};
+
+/* Prune/graft transmit state per upstream neighbor, by neighbor index */
+struct txnbr {
+    TAILQ_HEAD(, txmsg) tn_queue;
+    uint32_t	       tn_last;		/* rexmit wheel time of last refill  */
+    int		       tn_tokens;	/* left to send in second tn_last    */
+};
+
+/* Token bucket, shared by sources that hash to the same slot */
+struct uprate {
+    uint32_t ur_tokens;
+    time_t   ur_last;			/* last refill, monotonic seconds */
+};
+
 struct gtable *kernel_table;		/* ptr to list of kernel grp entries*/
 struct gtable *kernel_no_route;		/* list of grp entries w/o routes   */
-struct gtable *gtp;			/* pointer for kernel rt entries    */
 unsigned int kroutes;			/* current number of cache entries  */
+unsigned long mfc_updates;		/* (S,G) adds/changes sent to kernel*/
+unsigned long mfc_suppressed;		/* ... skipped, kernel up to date   */
+unsigned long upcalls_received;		/* NOCACHE upcalls from kernel      */
+unsigned long upcalls_merged;		/* ... for an already pending (S,G) */
+unsigned long upcalls_limited;		/* ... over the source's rate       */
+unsigned long upcalls_dropped;		/* ... with the queue full          */
+unsigned long prunes_sent;		/* prunes and grafts sent upstream  */
+unsigned long prunes_delayed;		/* ... of which waited in a queue   */
+unsigned long prunes_merged;		/* replaced or cancelled in queue   */
+unsigned long prunes_flushed;		/* dropped with their neighbor      */
+unsigned int  prune_qlen;		/* prunes and grafts queued now     */
+unsigned int  prune_qmax;		/* ... peak			    */
+unsigned long prune_delay_sum;		/* total queueing delay, msec	    */
+unsigned long prune_delay_max;		/* longest queueing delay, msec     */
+
+static LIST_HEAD(, gtable) gthash[GTHASH_SIZE];	/* (origin, mask, grp) */
+static LIST_HEAD(, gtable) gtgroup[GTHASH_SIZE];	/* first entry of grp  */
+
+static struct pool *gtpool;		/* struct gtable */
+static struct pool *stpool;		/* struct stable */
+static struct pool *ptpool;		/* struct ptable */
+static struct pool *txpool;		/* struct txmsg  */
+
+static struct upcall upcalls[UPCALL_QLEN];
+static TAILQ_HEAD(, upcall) upqueue = TAILQ_HEAD_INITIALIZER(upqueue);
+static TAILQ_HEAD(, upcall) upfree  = TAILQ_HEAD_INITIALIZER(upfree);
+static struct upcall *uphash[UPCALL_HASH];
+static struct uprate uprates[UPRATE_SIZE];
+
+static uint32_t ctclock;		/* forwarding cache time, in seconds */
+static LIST_HEAD(ctwheelhead, gtable) ctwheel[CTWHEEL_SIZE];
+
+static LIST_HEAD(, gtable) nbrgroups[MAXNBRS];	/* by upstream neighbor */
+static LIST_HEAD(, ptable) nbrprunes[MAXNBRS];	/* by pruning neighbor  */
+static struct txnbr txnbrs[MAXNBRS];		/* by upstream neighbor */
+
+static uint32_t rxclock;		/* prune rexmit wheel time, seconds */
+static LIST_HEAD(, gtable) rxwheel[RXWHEEL_SIZE];
+
+static struct sgcnt *sgtbl;		/* snapshot of kernel counters  */
+static size_t	     sgsize;		/* slots in sgtbl, power of two */
+static int	     sgvalid;		/* 1=>snapshot, -1=>failed      */
+static int	     sgcalls;		/* counter lookups this pass    */
 
 /****************************************************************************
                        Functions that are local to prune.c
@@ -36,12 +157,52 @@ static int		pruning_neighbor(vifi_t vifi, uint32_t addr);
 static int		can_mtrace(vifi_t vifi, uint32_t addr);
 static struct ptable *	find_prune_entry(uint32_t vr, struct ptable *pt);
 static void		remove_sources(struct gtable *gt);
-static void		rexmit_prune(int id, void *arg);
+static void		rexmit_prune(struct gtable *gt);
+static void		schedule_rexmit(struct gtable *gt, int secs);
+static void		unschedule_rexmit(struct gtable *gt);
+static void		xmit_upstream(struct gtable *gt, vifi_t vifi, uint32_t dst, int code,
+				      uint32_t origin, uint32_t grp, uint32_t lifetime);
+static int		send_upstream(struct gtable *gt, uint32_t dst, int code, uint32_t lifetime);
+static unsigned long	msec_since(struct timespec *then, struct timespec *now);
+static void		drain_upstream(struct txnbr *tn);
+static void		drop_upstream(struct txmsg *tx);
+static void		flush_upstream(struct txnbr *tn, vifi_t vifi, uint32_t addr);
 static void		expire_prune(vifi_t vifi, struct gtable *gt);
 static void		send_prune(struct gtable *gt);
 static void		send_graft(struct gtable *gt);
 static void		send_graft_ack(uint32_t src, uint32_t dst, uint32_t origin, uint32_t grp, vifi_t vifi);
+static void		add_kernel(struct gtable *g, struct stable *st);
 static void		update_kernel(struct gtable *g);
+static size_t		gthash_idx(uint32_t origin, uint32_t mask, uint32_t grp);
+static struct gtable *	find_group(uint32_t grp);
+static int		compare_gtable(struct gtable *g1, struct gtable *g2);
+static void		link_gtable(struct gtable *gt);
+static void		unlink_gtable(struct gtable *gt);
+static void		link_upstream(struct gtable *gt);
+static void		unlink_upstream(struct gtable *gt);
+static void		free_prune(struct ptable *pt);
+static void *		cache_get(struct pool **pp, const char *name, size_t size, int max);
+static struct gtable *	alloc_gtable(void);
+static void		free_gtable(struct gtable *gt);
+static struct stable *	find_source(struct gtable *gt, uint32_t origin);
+static int		hash_sources(struct gtable *gt, int bits);
+static void		insert_source(struct gtable *gt, struct stable *st);
+static void		free_source(struct gtable *gt, struct stable *st);
+static int		compare_source(const void *a, const void *b);
+static void		sort_sources(struct gtable *gt);
+static size_t		upcall_idx(uint32_t src, uint32_t grp);
+static int		upcall_allowed(uint32_t src);
+static size_t		sg_idx(uint32_t src, uint32_t grp);
+static void		sg_insert(uint32_t src, uint32_t grp, unsigned long pktcnt);
+static int		sg_snapshot(void);
+static void		sg_begin(void);
+static void		sg_end(void);
+static int		get_sg_pktcnt(uint32_t src, uint32_t grp, unsigned long *pktcnt);
+static uint32_t		graft_due(struct gtable *gt);
+static void		schedule_cache(struct gtable *gt);
+static void		unschedule_cache(struct gtable *gt);
+static void		age_cache_entry(struct gtable *gt);
+static void		age_no_route_entry(struct gtable *gt);
 
 /*
  * Updates the ttl values for each vif.
@@ -127,7 +288,7 @@ void send_prune_or_graft(struct gtable *gt)
 {
     if (VIFM_ISEMPTY(gt->gt_grpmems))
 	send_prune(gt);
-    else if (gt->gt_prsent_timer)
+    else if (gt->gt_prsent)
 	send_graft(gt);
 }
 
@@ -148,43 +309,424 @@ int grplst_mem(vifi_t vifi, uint32_t mcastgrp)
     return 0;
 }
 
+static size_t gthash_idx(uint32_t origin, uint32_t mask, uint32_t grp)
+{
+    uint32_t key = ntohl(grp) ^ (ntohl(origin) * 2654435761U) ^ ntohl(mask);
+
+    return ((key * 2654435761U) >> 20) & (GTHASH_SIZE - 1);
+}
+
+/*
+ * Find the first entry for group 'grp' on kernel_table, the rest of
+ * the entries for the group follow it on the gt_gnext list.
+ */
+static struct gtable *find_group(uint32_t grp)
+{
+    struct gtable *gt;
+
+    LIST_FOREACH(gt, &gtgroup[gthash_idx(0, 0, grp)], gt_ghash) {
+	if (gt->gt_mcastgrp == grp)
+	    return gt;
+    }
+
+    return NULL;
+}
+
+/*
+ * Order of entries for the same group on kernel_table, and in the
+ * sorted view: decreasing route mask, then increasing origin.
+ */
+static int compare_gtable(struct gtable *g1, struct gtable *g2)
+{
+    struct rtentry *r1 = g1->gt_route;
+    struct rtentry *r2 = g2->gt_route;
+
+    if (g1->gt_mcastgrp != g2->gt_mcastgrp)
+	return ntohl(g1->gt_mcastgrp) < ntohl(g2->gt_mcastgrp) ? -1 : 1;
+    if (r1->rt_originmask != r2->rt_originmask)
+	return ntohl(r1->rt_originmask) > ntohl(r2->rt_originmask) ? -1 : 1;
+    if (r1->rt_origin != r2->rt_origin)
+	return ntohl(r1->rt_origin) < ntohl(r2->rt_origin) ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * Link entry 'gt' into kernel_table, next to the other entries for its
+ * group, and into the hash indexes.  A new group goes first in the list.
+ */
+static void link_gtable(struct gtable *gt)
+{
+    struct gtable *first, *prev, *next;
+
+    first = find_group(gt->gt_mcastgrp);
+    if (!first) {
+	prev = NULL;
+	next = kernel_table;
+    } else {
+	prev = first->gt_gprev;
+	next = first;
+	while (next && next->gt_mcastgrp == gt->gt_mcastgrp && compare_gtable(next, gt) < 0) {
+	    prev = next;
+	    next = next->gt_gnext;
+	}
+    }
+
+    gt->gt_gprev = prev;
+    gt->gt_gnext = next;
+    if (prev)
+	prev->gt_gnext = gt;
+    else
+	kernel_table = gt;
+    if (next)
+	next->gt_gprev = gt;
+
+    if (!first || next == first) {
+	if (first)
+	    LIST_REMOVE(first, gt_ghash);
+	LIST_INSERT_HEAD(&gtgroup[gthash_idx(0, 0, gt->gt_mcastgrp)], gt, gt_ghash);
+    }
+    LIST_INSERT_HEAD(&gthash[gthash_idx(gt->gt_route->rt_origin, gt->gt_route->rt_originmask,
+					gt->gt_mcastgrp)], gt, gt_hash);
+    link_upstream(gt);
+}
+
+/*
+ * Unlink entry 'gt' from kernel_table and the hash indexes, if it is
+ * on the table.  The next entry for the group, if any, becomes first.
+ */
+static void unlink_gtable(struct gtable *gt)
+{
+    struct gtable *next = gt->gt_gnext;
+
+    if (!gt->gt_gprev && kernel_table != gt)
+	return;
+
+    if (!gt->gt_gprev || gt->gt_gprev->gt_mcastgrp != gt->gt_mcastgrp) {
+	LIST_REMOVE(gt, gt_ghash);
+	if (next && next->gt_mcastgrp == gt->gt_mcastgrp)
+	    LIST_INSERT_HEAD(&gtgroup[gthash_idx(0, 0, gt->gt_mcastgrp)], next, gt_ghash);
+    }
+    LIST_REMOVE(gt, gt_hash);
+    unlink_upstream(gt);
+
+    if (next)
+	next->gt_gprev = gt->gt_gprev;
+    if (gt->gt_gprev)
+	gt->gt_gprev->gt_gnext = next;
+    else
+	kernel_table = next;
+    gt->gt_gnext = gt->gt_gprev = NULL;
+}
+
+/*
+ * Put entry 'gt' on the list of its upstream router, if the route's
+ * gateway is a known neighbor.  Moves it when the gateway has changed.
+ */
+static void link_upstream(struct gtable *gt)
+{
+    struct rtentry *r = gt->gt_route;
+    struct listaddr *n;
+
+    unlink_upstream(gt);
+    if (r->rt_parent == NO_VIF || r->rt_gateway == 0)
+	return;
+
+    n = neighbor_info(r->rt_parent, r->rt_gateway);
+    if (n)
+	LIST_INSERT_HEAD(&nbrgroups[n->al_index], gt, gt_nlink);
+}
+
+static void unlink_upstream(struct gtable *gt)
+{
+    if (!gt->gt_nlink.le_prev)
+	return;
+
+    LIST_REMOVE(gt, gt_nlink);
+    gt->gt_nlink.le_prev = NULL;
+}
+
+/*
+ * Get a zeroed group, source or prune entry from pool '*pp'.  The pool
+ * is created on first use, after the configuration has been read, with
+ * 'max' entries at most, or no limit if zero.  When the limit is hit
+ * new state is dropped, the first time with a warning.
+ */
+static void *cache_get(struct pool **pp, const char *name, size_t size, int max)
+{
+    struct pool *p = *pp;
+    void *obj;
+
+    if (!p) {
+	p = pool_create(name, size, CACHE_POOL_NPER, max);
+	if (!p) {
+	    logit(LOG_ERR, errno, "Failed allocating %s pool in %s:%s()", name, __FILE__, __func__);
+	    return NULL;
+	}
+	*pp = p;
+    }
+
+    obj = pool_get(p);
+    if (!obj) {
+	if (p->p_max && p->p_total >= p->p_max) {
+	    if (p->p_fails == 1)
+		logit(LOG_WARNING, 0, "Forwarding cache %s limit %zu reached, dropping new entries",
+		      p->p_name, p->p_max);
+	} else {
+	    logit(LOG_ERR, errno, "Failed allocating %s entry in %s:%s()", p->p_name, __FILE__, __func__);
+	}
+    }
+
+    return obj;
+}
+
+/*
+ * Get a zeroed group entry
+ */
+static struct gtable *alloc_gtable(void)
+{
+    return cache_get(&gtpool, "groups", sizeof(struct gtable), cache_max_groups);
+}
+
+static void free_gtable(struct gtable *gt)
+{
+    if (gt->gt_txmsg)
+	gt->gt_txmsg->tx_gt = NULL;	/* Still sent, as before */
+    free(gt->gt_srchash);
+    pool_put(gtpool, gt);
+}
+
+/*
+ * Find source 'origin' in the source list of group entry 'gt'.
+ */
+static struct stable *find_source(struct gtable *gt, uint32_t origin)
+{
+    struct stable *st;
+
+    if (gt->gt_srchash) {
+	for (st = gt->gt_srchash[SRCHASH_IDX(gt, origin)]; st; st = st->st_hnext) {
+	    if (st->st_origin == origin)
+		return st;
+	}
+	return NULL;
+    }
+
+    for (st = gt->gt_srctbl; st; st = st->st_next) {
+	if (st->st_origin == origin)
+	    return st;
+	if (!gt->gt_srcunsorted && ntohl(st->st_origin) > ntohl(origin))
+	    break;
+    }
+
+    return NULL;
+}
+
+/*
+ * (Re)build the source hash of 'gt' with 2^bits buckets from its source
+ * list.  Returns -1, with any old hash still in place, on failure.
+ */
+static int hash_sources(struct gtable *gt, int bits)
+{
+    struct stable **tbl, *st;
+    size_t i;
+
+    tbl = calloc((size_t)1 << bits, sizeof(*tbl));
+    if (!tbl) {
+	logit(LOG_ERR, errno, "Failed allocating source hash in %s:%s()", __FILE__, __func__);
+	return -1;
+    }
+
+    free(gt->gt_srchash);
+    gt->gt_srchash = tbl;
+    gt->gt_srcbits = bits;
+    for (st = gt->gt_srctbl; st; st = st->st_next) {
+	i = SRCHASH_IDX(gt, st->st_origin);
+	st->st_hnext = tbl[i];
+	tbl[i] = st;
+    }
+
+    return 0;
+}
+
+/*
+ * Add new source 'st' to group entry 'gt'.  A short source list is kept
+ * sorted, on a long one 'st' goes first and is found using the hash.
+ */
+static void insert_source(struct gtable *gt, struct stable *st)
+{
+    struct stable **stnp;
+    size_t i;
+
+    gt->gt_nsrcs++;
+    if (!gt->gt_srchash && gt->gt_nsrcs <= SRCHASH_MIN) {
+	stnp = &gt->gt_srctbl;
+	while (*stnp && ntohl((*stnp)->st_origin) < ntohl(st->st_origin))
+	    stnp = &(*stnp)->st_next;
+	st->st_next = *stnp;
+	*stnp = st;
+	return;
+    }
+
+    st->st_next = gt->gt_srctbl;
+    gt->gt_srctbl = st;
+    if (st->st_next && ntohl(st->st_next->st_origin) < ntohl(st->st_origin))
+	gt->gt_srcunsorted = 1;
+
+    if (!gt->gt_srchash ||
+	(gt->gt_nsrcs > (2U << gt->gt_srcbits) && gt->gt_srcbits < SRCHASH_MAXBITS)) {
+	/* A new hash picks up 'st' from the list */
+	if (!hash_sources(gt, gt->gt_srchash ? gt->gt_srcbits + 1 : SRCHASH_BITS))
+	    return;
+	if (!gt->gt_srchash)
+	    return;
+    }
+
+    i = SRCHASH_IDX(gt, st->st_origin);
+    st->st_hnext = gt->gt_srchash[i];
+    gt->gt_srchash[i] = st;
+}
+
+/*
+ * Free source entry 'st', already unlinked from the source list of 'gt'.
+ */
+static void free_source(struct gtable *gt, struct stable *st)
+{
+    struct stable **stnp;
+
+    if (gt->gt_srchash) {
+	stnp = &gt->gt_srchash[SRCHASH_IDX(gt, st->st_origin)];
+	while (*stnp != st)
+	    stnp = &(*stnp)->st_hnext;
+	*stnp = st->st_hnext;
+    }
+
+    gt->gt_nsrcs--;
+    pool_put(stpool, st);
+}
+
+static int compare_source(const void *a, const void *b)
+{
+    const struct stable *s1 = *(const struct stable **)a;
+    const struct stable *s2 = *(const struct stable **)b;
+
+    if (s1->st_origin == s2->st_origin)
+	return 0;
+
+    return ntohl(s1->st_origin) < ntohl(s2->st_origin) ? -1 : 1;
+}
+
+/*
+ * Put the source list of 'gt' back in origin order, see insert_source().
+ */
+static void sort_sources(struct gtable *gt)
+{
+    struct stable **arr, **stnp, *st;
+    size_t i, num = 0;
+
+    if (!gt->gt_srcunsorted)
+	return;
+
+    for (st = gt->gt_srctbl; st; st = st->st_next)
+	num++;
+
+    arr = malloc(num * sizeof(*arr));
+    if (!arr) {
+	logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
+	return;
+    }
+
+    i = 0;
+    for (st = gt->gt_srctbl; st; st = st->st_next)
+	arr[i++] = st;
+    qsort(arr, num, sizeof(*arr), compare_source);
+
+    stnp = &gt->gt_srctbl;
+    for (i = 0; i < num; i++) {
+	*stnp = arr[i];
+	stnp = &arr[i]->st_next;
+    }
+    *stnp = NULL;
+    gt->gt_srcunsorted = 0;
+
+    free(arr);
+}
+
+/*
+ * Free prune entry 'pt', already unlinked from its group entry.
+ */
+static void free_prune(struct ptable *pt)
+{
+    LIST_REMOVE(pt, pt_nlink);
+    pool_put(ptpool, pt);
+}
+
 /*
  * Finds the group entry with the specified source and netmask.
- * If netmask is 0, it uses the route's netmask.
+ * If netmask is 0, it uses the route's netmask, i.e., it returns the
+ * entry with the longest route mask that covers the source.
  *
- * Returns TRUE if found a match, and the global variable gtp is left
- * pointing to entry before the found entry.
- * Returns FALSE if no exact match found, gtp is left pointing to before
- * the entry in question belongs, or is NULL if the it belongs at the
- * head of the list.
+ * Returns the entry found, or NULL if no match.
  */
-int find_src_grp(uint32_t src, uint32_t mask, uint32_t grp)
+struct gtable *find_src_grp(uint32_t src, uint32_t mask, uint32_t grp)
 {
     struct gtable *gt;
 
-    gtp = NULL;
-    gt = kernel_table;
-    while (gt != NULL) {
-	if (grp == gt->gt_mcastgrp &&
-	    (mask
-	     ? (gt->gt_route->rt_origin     == src  &&
+    if (mask) {
+	LIST_FOREACH(gt, &gthash[gthash_idx(src, mask, grp)], gt_hash) {
+	    if (gt->gt_mcastgrp == grp &&
+		gt->gt_route->rt_origin == src &&
 		gt->gt_route->rt_originmask == mask)
-	     :
-	     ((src & gt->gt_route->rt_originmask) ==
-		     gt->gt_route->rt_origin)))
-	    return TRUE;
-	if (ntohl(grp) > ntohl(gt->gt_mcastgrp) ||
-	    (grp == gt->gt_mcastgrp &&
-	     (ntohl(mask) < ntohl(gt->gt_route->rt_originmask) ||
-	      (mask == gt->gt_route->rt_originmask &&
-	       (ntohl(src) > ntohl(gt->gt_route->rt_origin)))))) {
-	    gtp = gt;
-	    gt = gt->gt_gnext;
+		return gt;
 	}
-	else
-	    break;
+
+	return NULL;
+    }
+
+    for (gt = find_group(grp); gt && gt->gt_mcastgrp == grp; gt = gt->gt_gnext) {
+	if ((src & gt->gt_route->rt_originmask) == gt->gt_route->rt_origin)
+	    return gt;
     }
-    return FALSE;
+
+    return NULL;
+}
+
+static int compare_sorted(const void *p1, const void *p2)
+{
+    return compare_gtable(*(struct gtable **)p1, *(struct gtable **)p2);
+}
+
+/*
+ * Return an array with all entries on kernel_table, sorted by group,
+ * decreasing route mask and origin, for show and dump output.  The
+ * source list of each entry is sorted as well.  The number of entries
+ * is returned in 'num'.  Caller must free() the array.
+ */
+struct gtable **sort_kernel_table(size_t *num)
+{
+    struct gtable **arr, *gt;
+    size_t i = 0;
+
+    *num = 0;
+    for (gt = kernel_table; gt; gt = gt->gt_gnext)
+	i++;
+    if (!i)
+	return NULL;
+
+    arr = malloc(i * sizeof(*arr));
+    if (!arr) {
+	logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
+	return NULL;
+    }
+
+    i = 0;
+    for (gt = kernel_table; gt; gt = gt->gt_gnext) {
+	sort_sources(gt);
+	arr[i++] = gt;
+    }
+    qsort(arr, i, sizeof(*arr), compare_sorted);
+    *num = i;
+
+    return arr;
 }
 
 /*
@@ -268,6 +810,7 @@ static void remove_sources(struct gtable *gt)
 
 	k_del_rg(st->st_origin, gt);
 	st->st_ctime = 0;	/* flag that it's not in the kernel any more */
+	st->st_kparent = NO_VIF;
 	st->st_savpkt += sg_req.pktcnt;
 	kroutes--;
     }
@@ -278,12 +821,11 @@ static void remove_sources(struct gtable *gt)
 }
 
 /*
- * Prepare for possible prune retransmission
+ * Prepare for possible prune retransmission, called from prune_tick()
+ * when the entry is due on the prune rexmit wheel.
  */
-static void rexmit_prune(int id, void *arg)
+static void rexmit_prune(struct gtable *gt)
 {
-    struct gtable *gt = *(struct gtable **)arg;
-
     /* Make sure we're still not forwarding traffic */
     if (!VIFM_ISEMPTY(gt->gt_grpmems)) {
 	IF_DEBUG(DEBUG_PRUNE) {
@@ -292,9 +834,234 @@ static void rexmit_prune(int id, void *arg)
 	}
     } else
 	remove_sources(gt);
+}
+
+/*
+ * Check entry 'gt' for prune retransmission in 'secs' seconds.  All
+ * entries due in the same second are handled by one prune_tick().
+ */
+static void schedule_rexmit(struct gtable *gt, int secs)
+{
+    if (secs < 1)
+	secs = 1;
+
+    if (gt->gt_rxdue)
+	LIST_REMOVE(gt, gt_rxlink);
+    gt->gt_rxdue = rxclock + secs;
+    LIST_INSERT_HEAD(RXWHEEL_SLOT(gt->gt_rxdue), gt, gt_rxlink);
+}
 
-    gt->gt_rexmit_timer = pev_timer_del(id);
-    free(arg);
+/*
+ * Cancel prune retransmission check of entry 'gt', e.g., before freeing it
+ */
+static void unschedule_rexmit(struct gtable *gt)
+{
+    if (!gt->gt_rxdue)
+	return;
+
+    LIST_REMOVE(gt, gt_rxlink);
+    gt->gt_rxdue = 0;
+}
+
+/*
+ * Milliseconds from 'then' until 'now'
+ */
+static unsigned long msec_since(struct timespec *then, struct timespec *now)
+{
+    long ms;
+
+    ms = (now->tv_sec - then->tv_sec) * 1000 + (now->tv_nsec - then->tv_nsec) / 1000000;
+    if (ms < 0)
+	return 0;
+
+    return ms;
+}
+
+/*
+ * Build and send a prune or graft for (origin, grp) on vif to dst.
+ * A prune sent for gt is recorded, send_graft() must then annul it.
+ */
+static void xmit_upstream(struct gtable *gt, vifi_t vifi, uint32_t dst, int code,
+			  uint32_t origin, uint32_t grp, uint32_t lifetime)
+{
+    struct uvif *uv;
+    uint8_t *p;
+    int datalen;
+
+    uv = find_uvif(vifi);
+    p = send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN;
+
+    memcpy(p, &origin, sizeof(origin));
+    memcpy(p + 4, &grp, sizeof(grp));
+    datalen = 8;
+    if (code == DVMRP_PRUNE) {
+	uint32_t tmp = htonl(lifetime);
+
+	memcpy(p + 8, &tmp, sizeof(tmp));
+	datalen += 4;
+    }
+
+    send_on_vif(uv, dst, code, datalen);
+    prunes_sent++;
+
+    if (gt && code == DVMRP_PRUNE)
+	gt->gt_prxmit = 1;
+}
+
+/*
+ * Send a prune or graft upstream, paced per neighbor.  Each neighbor
+ * is sent at most prune_rate prunes and grafts per second, in order.
+ * The rest are queued, and sent by prune_tick() in the next seconds.
+ * This keeps a topology change, which can prune or graft thousands of
+ * entries at once, from flooding the neighbor.
+ *
+ * Returns 1 if sent right away, 0 if queued.
+ */
+static int send_upstream(struct gtable *gt, uint32_t dst, int code, uint32_t lifetime)
+{
+    vifi_t vifi = gt->gt_route->rt_parent;
+    uint32_t origin = gt->gt_route->rt_origin;
+    uint32_t grp = gt->gt_mcastgrp;
+    struct listaddr *n;
+    struct txnbr *tn;
+    struct txmsg *tx;
+
+    /* Still queued, send the latest prune or graft in its place instead */
+    if ((tx = gt->gt_txmsg) && tx->tx_vifi == vifi && tx->tx_dst == dst) {
+	tx->tx_code     = code;
+	tx->tx_lifetime = lifetime;
+	prunes_merged++;
+	return 0;
+    }
+
+    n = neighbor_info(vifi, dst);
+    if (!n || prune_rate <= 0) {
+	xmit_upstream(gt, vifi, dst, code, origin, grp, lifetime);
+	return 1;
+    }
+
+    tn = &txnbrs[n->al_index];
+    if (tn->tn_last != rxclock) {
+	tn->tn_last   = rxclock;
+	tn->tn_tokens = prune_rate;
+    }
+
+    if (TAILQ_EMPTY(&tn->tn_queue) && tn->tn_tokens > 0) {
+	tn->tn_tokens--;
+	xmit_upstream(gt, vifi, dst, code, origin, grp, lifetime);
+	return 1;
+    }
+
+    tx = cache_get(&txpool, "prune-queue", sizeof(*tx), 0);
+    if (!tx) {
+	xmit_upstream(gt, vifi, dst, code, origin, grp, lifetime);
+	return 1;
+    }
+
+    if (gt->gt_txmsg)
+	gt->gt_txmsg->tx_gt = NULL;	/* Route changed, let it go */
+    gt->gt_txmsg    = tx;
+
+    tx->tx_gt       = gt;
+    tx->tx_nbr      = tn;
+    tx->tx_dst      = dst;
+    tx->tx_origin   = origin;
+    tx->tx_grp      = grp;
+    tx->tx_lifetime = lifetime;
+    tx->tx_vifi     = vifi;
+    tx->tx_code     = code;
+    clock_gettime(CLOCK_MONOTONIC, &tx->tx_queued);
+    TAILQ_INSERT_TAIL(&tn->tn_queue, tx, tx_link);
+
+    if (++prune_qlen > prune_qmax)
+	prune_qmax = prune_qlen;
+
+    IF_DEBUG(DEBUG_PRUNE) {
+	logit(LOG_DEBUG, 0, "Queued %s for (%s %s) to %s on vif %u, %u pending",
+	      code == DVMRP_PRUNE ? "prune" : "graft",
+	      inet_fmt(origin, s1, sizeof(s1)), inet_fmt(grp, s2, sizeof(s2)),
+	      inet_fmt(dst, s3, sizeof(s3)), vifi, prune_qlen);
+    }
+
+    return 0;
+}
+
+/*
+ * Send what the rate allows this second from a neighbor's queue
+ */
+static void drain_upstream(struct txnbr *tn)
+{
+    struct timespec now;
+    struct gtable *gt;
+    struct txmsg *tx;
+    unsigned long ms;
+
+    if (TAILQ_EMPTY(&tn->tn_queue))
+	return;
+
+    if (tn->tn_last != rxclock) {
+	tn->tn_last   = rxclock;
+	tn->tn_tokens = prune_rate;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((tx = TAILQ_FIRST(&tn->tn_queue))) {
+	if (prune_rate > 0 && tn->tn_tokens <= 0)
+	    break;
+
+	TAILQ_REMOVE(&tn->tn_queue, tx, tx_link);
+	tn->tn_tokens--;
+	prune_qlen--;
+	if ((gt = tx->tx_gt))
+	    gt->gt_txmsg = NULL;
+
+	ms = msec_since(&tx->tx_queued, &now);
+	prune_delay_sum += ms;
+	if (ms > prune_delay_max)
+	    prune_delay_max = ms;
+	prunes_delayed++;
+
+	/* Don't outlive the prune sent state, which started when queued */
+	if (tx->tx_code == DVMRP_PRUNE && tx->tx_lifetime > ms / 1000)
+	    tx->tx_lifetime -= ms / 1000;
+
+	xmit_upstream(gt, tx->tx_vifi, tx->tx_dst, tx->tx_code, tx->tx_origin, tx->tx_grp, tx->tx_lifetime);
+
+	pool_put(txpool, tx);
+    }
+}
+
+/*
+ * Take a queued prune or graft off its neighbor's queue, unsent
+ */
+static void drop_upstream(struct txmsg *tx)
+{
+    TAILQ_REMOVE(&tx->tx_nbr->tn_queue, tx, tx_link);
+    if (tx->tx_gt)
+	tx->tx_gt->gt_txmsg = NULL;
+
+    pool_put(txpool, tx);
+    prune_qlen--;
+}
+
+/*
+ * Drop prunes and grafts queued for neighbor 'addr' on vif
+ */
+static void flush_upstream(struct txnbr *tn, vifi_t vifi, uint32_t addr)
+{
+    struct txmsg *tx, *tmp;
+
+    TAILQ_FOREACH_SAFE(tx, &tn->tn_queue, tx_link, tmp) {
+	if (tx->tx_vifi != vifi || tx->tx_dst != addr)
+	    continue;
+
+	TAILQ_REMOVE(&tn->tn_queue, tx, tx_link);
+	if (tx->tx_gt)
+	    tx->tx_gt->gt_txmsg = NULL;
+	pool_put(txpool, tx);
+	prune_qlen--;
+	prunes_flushed++;
+    }
 }
 
 /*
@@ -305,13 +1072,11 @@ static void rexmit_prune(int id, void *arg)
  */
 static void send_prune(struct gtable *gt)
 {
-    int rexmitting = 0;
+    int rexmitting = 0, sent;
     struct ptable *pt;
     struct uvif *uv;
-    uint8_t *p;
-    int i, datalen;
+    int left;
     uint32_t dst;
-    uint32_t tmp;
 
     /*
      * Can't process a prune if we don't have an associated route
@@ -334,30 +1099,32 @@ static void send_prune(struct gtable *gt)
     dst = gt->gt_route->rt_gateway;
 #endif
 
-    p = send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN;
-    datalen = 0;
-
     /*
      * determine prune lifetime, if this isn't a retransmission.
      *
      * Use interface-specified lifetime if there is one.
      */
-    if (gt->gt_prsent_timer == 0) {
+    if (gt->gt_prsent == 0) {
 	int l = prune_lifetime;
 
 	if (uv->uv_prune_lifetime != 0)
 	    l = uv->uv_prune_lifetime;
 
-	gt->gt_prsent_timer = JITTERED_VALUE(l);
+	left = JITTERED_VALUE(l);
 	for (pt = gt->gt_pruntbl; pt; pt = pt->pt_next) {
-	    if (pt->pt_timer < gt->gt_prsent_timer)
-		gt->gt_prsent_timer = pt->pt_timer;
+	    if (CT_LEFT(pt->pt_expire) < left)
+		left = CT_LEFT(pt->pt_expire);
+	}
+	if (left > 0) {
+	    gt->gt_prsent = ctclock + left;
+	    gt->gt_prxmit = 0;
+	    schedule_cache(gt);
 	}
-    } else if (gt->gt_prsent_timer < 0) {
+    } else if ((left = CT_LEFT(gt->gt_prsent)) <= 0) {
 	IF_DEBUG(DEBUG_PRUNE) {
 	    logit(LOG_DEBUG, 0, "Asked to rexmit? (%s,%s)/%d on vif %u to %s with negative time",
 		  RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-		  gt->gt_prsent_timer, gt->gt_route->rt_parent,
+		  left, gt->gt_route->rt_parent,
 		  inet_fmt(gt->gt_route->rt_gateway, s3, sizeof(s3)));
 	}
 	return;
@@ -369,17 +1136,17 @@ static void send_prune(struct gtable *gt)
 	IF_DEBUG(DEBUG_PRUNE) {
 	    logit(LOG_DEBUG, 0, "Not rexmitting prune for (%s %s)/%d on vif %u to %s",
 		  RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-		  gt->gt_prsent_timer, gt->gt_route->rt_parent,
+		  left, gt->gt_route->rt_parent,
 		  inet_fmt(gt->gt_route->rt_gateway, s3, sizeof(s3)));
 	}
 	return;
     }
 
-    if (gt->gt_prsent_timer <= MIN_PRUNE_LIFE) {
+    if (left <= MIN_PRUNE_LIFE) {
 	IF_DEBUG(DEBUG_PRUNE) {
 	    logit(LOG_DEBUG, 0, "Not bothering to send prune for (%s,%s)/%d on vif %u to %s because it's too short",
 		  RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-		  gt->gt_prsent_timer, gt->gt_route->rt_parent,
+		  left, gt->gt_route->rt_parent,
 		  inet_fmt(gt->gt_route->rt_gateway, s3, sizeof(s3)));
 	}
 	return;
@@ -390,38 +1157,19 @@ static void send_prune(struct gtable *gt)
      */
     gt->gt_grftsnt = 0;
 
-    for (i = 0; i < 4; i++)
-	*p++ = ((char *)&(gt->gt_route->rt_origin))[i];
-    for (i = 0; i < 4; i++)
-	*p++ = ((char *)&(gt->gt_mcastgrp))[i];
-    tmp = htonl(gt->gt_prsent_timer);
-    for (i = 0; i < 4; i++)
-	*p++ = ((char *)&(tmp))[i];
-    datalen += 12;
-
-    send_on_vif(uv, dst, DVMRP_PRUNE, datalen);
+    sent = send_upstream(gt, dst, DVMRP_PRUNE, left);
 
     IF_DEBUG(DEBUG_PRUNE) {
-	logit(LOG_DEBUG, 0, "%s prune for (%s %s)/%d on vif %u to %s",
-	      rexmitting ? "rexmitted" : "sent",
+	logit(LOG_DEBUG, 0, "%s %s prune for (%s %s)/%d on vif %u to %s",
+	      sent ? "Sent" : "Queued", rexmitting ? "rexmitted" : "new",
 	      RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-	      gt->gt_prsent_timer, gt->gt_route->rt_parent,
+	      left, gt->gt_route->rt_parent,
 	      inet_fmt(gt->gt_route->rt_gateway, s3, sizeof(s3)));
     }
 
-    if ((uv->uv_flags & VIFF_REXMIT_PRUNES) && gt->gt_rexmit_timer == 0 &&
-	gt->gt_prsent_timer > gt->gt_prune_rexmit) {
-	struct gtable **arg;
-
-	arg = malloc(sizeof(struct gtable *));
-	if (!arg) {
-	    logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
-	    return;
-	}
-
-	*arg = gt;
-	gt->gt_rexmit_timer = pev_timer_add(JITTERED_VALUE(gt->gt_prune_rexmit) * 1000000,
-					    0, rexmit_prune, arg);
+    if ((uv->uv_flags & VIFF_REXMIT_PRUNES) && gt->gt_rxdue == 0 &&
+	left > gt->gt_prune_rexmit) {
+	schedule_rexmit(gt, JITTERED_VALUE(gt->gt_prune_rexmit));
 	gt->gt_prune_rexmit *= 2;
     }
 }
@@ -435,10 +1183,8 @@ static void send_prune(struct gtable *gt)
  */
 static void send_graft(struct gtable *gt)
 {
-    struct uvif *uv;
-    int i, datalen;
     uint32_t dst;
-    uint8_t *p;
+    int sent;
 
     /* Can't send a graft without an associated route */
     if (gt->gt_route == NULL || gt->gt_route->rt_parent == NO_VIF) {
@@ -446,15 +1192,30 @@ static void send_graft(struct gtable *gt)
 	return;
     }
 
-    uv = find_uvif(gt->gt_route->rt_parent);
-
-    gt->gt_prsent_timer = 0;
+    gt->gt_prsent = 0;
     gt->gt_prune_rexmit = PRUNE_REXMIT_VAL;
-    if (gt->gt_rexmit_timer > 0)
-	gt->gt_rexmit_timer = pev_timer_del(gt->gt_rexmit_timer);
+    unschedule_rexmit(gt);
+
+    /*
+     * The prune is still queued, drop it.  If no prune has gone out
+     * yet there is nothing to graft, but a queued retransmission means
+     * the neighbor holds an earlier one, so graft it anyway.
+     */
+    if (gt->gt_txmsg && gt->gt_txmsg->tx_code == DVMRP_PRUNE) {
+	drop_upstream(gt->gt_txmsg);
+	prunes_merged++;
+	if (!gt->gt_prxmit) {
+	    gt->gt_grftsnt = 0;
+	    return;
+	}
+    }
+    gt->gt_prxmit = 0;
 
-    if (gt->gt_grftsnt == 0)
+    if (gt->gt_grftsnt == 0) {
 	gt->gt_grftsnt = 1;
+	gt->gt_grftbase = ctclock;
+	schedule_cache(gt);
+    }
 
 #if 0
     dst = uv->uv_flags & VIFF_TUNNEL
@@ -464,18 +1225,10 @@ static void send_graft(struct gtable *gt)
     dst = gt->gt_route->rt_gateway;
 #endif
 
-    p = send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN;
-    datalen = 0;
-
-    for (i = 0; i < 4; i++)
-	*p++ = ((char *)&(gt->gt_route->rt_origin))[i];
-    for (i = 0; i < 4; i++)
-	*p++ = ((char *)&(gt->gt_mcastgrp))[i];
-    datalen += 8;
-
-    send_on_vif(uv, dst, DVMRP_GRAFT, datalen);
+    sent = send_upstream(gt, dst, DVMRP_GRAFT, 0);
     IF_DEBUG(DEBUG_PRUNE) {
-	logit(LOG_DEBUG, 0, "Sent graft for (%s %s) to %s on vif %u",
+	logit(LOG_DEBUG, 0, "%s graft for (%s %s) to %s on vif %u",
+	      sent ? "Sent" : "Queued",
 	      RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
 	      inet_fmt(gt->gt_route->rt_gateway, s3, sizeof(s3)),
 	      gt->gt_route->rt_parent);
@@ -524,6 +1277,26 @@ static void send_graft_ack(uint32_t src, uint32_t dst, uint32_t origin, uint32_t
     }
 }
 
+/*
+ * Install (S,G) in the kernel, unless the inbound vif and ttl vector
+ * are the same as what was last sent to the kernel for it.
+ */
+static void add_kernel(struct gtable *g, struct stable *st)
+{
+    vifi_t parent = g->gt_route ? g->gt_route->rt_parent : NO_VIF;
+
+    if (parent != NO_VIF && parent == st->st_kparent &&
+	!memcmp(st->st_kttls, g->gt_ttls, numvifs)) {
+	mfc_suppressed++;
+	return;
+    }
+
+    k_add_rg(st->st_origin, g);
+    st->st_kparent = parent;
+    memcpy(st->st_kttls, g->gt_ttls, numvifs);
+    mfc_updates++;
+}
+
 /*
  * Update the kernel cache with all the routes hanging off the group entry
  */
@@ -533,7 +1306,7 @@ static void update_kernel(struct gtable *g)
 
     for (st = g->gt_srctbl; st; st = st->st_next)
 	if (st->st_ctime != 0)
-	    k_add_rg(st->st_origin, g);
+	    add_kernel(g, st);
 }
 
 /****************************************************************************
@@ -545,9 +1318,156 @@ static void update_kernel(struct gtable *g)
  */
 void init_ktable(void)
 {
+    size_t i;
+
+    for (i = 0; i < GTHASH_SIZE; i++) {
+	LIST_INIT(&gthash[i]);
+	LIST_INIT(&gtgroup[i]);
+    }
+    for (i = 0; i < CTWHEEL_SIZE; i++)
+	LIST_INIT(&ctwheel[i]);
+    for (i = 0; i < RXWHEEL_SIZE; i++)
+	LIST_INIT(&rxwheel[i]);
+    for (i = 0; i < MAXNBRS; i++) {
+	LIST_INIT(&nbrgroups[i]);
+	LIST_INIT(&nbrprunes[i]);
+	TAILQ_INIT(&txnbrs[i].tn_queue);
+	txnbrs[i].tn_last = 0;
+    }
+    TAILQ_INIT(&upqueue);
+    TAILQ_INIT(&upfree);
+    for (i = 0; i < UPCALL_QLEN; i++)
+	TAILQ_INSERT_TAIL(&upfree, &upcalls[i], uc_link);
+    memset(uphash, 0, sizeof(uphash));
+    memset(uprates, 0, sizeof(uprates));
+
+    ctclock		= 0;
+    rxclock		= 0;
     kernel_table 	= NULL;
     kernel_no_route	= NULL;
     kroutes		= 0;
+    mfc_updates		= 0;
+    mfc_suppressed	= 0;
+    upcalls_received	= 0;
+    upcalls_merged	= 0;
+    upcalls_limited	= 0;
+    upcalls_dropped	= 0;
+    prunes_sent		= 0;
+    prunes_delayed	= 0;
+    prunes_merged	= 0;
+    prunes_flushed	= 0;
+    prune_qlen		= 0;
+    prune_qmax		= 0;
+    prune_delay_sum	= 0;
+    prune_delay_max	= 0;
+}
+
+static size_t upcall_idx(uint32_t src, uint32_t grp)
+{
+    uint32_t key = ntohl(grp) ^ (ntohl(src) * 2654435761U);
+
+    return ((key * 2654435761U) >> 24) & (UPCALL_HASH - 1);
+}
+
+/*
+ * Per-source upcall limit.  Sources are hashed onto UPRATE_SIZE token
+ * buckets, refilled with upcall-rate tokens a second up to upcall-burst.
+ * Sources sharing a bucket share its tokens, so a flood from any number
+ * of sources is limited to at most UPRATE_SIZE x upcall-rate.
+ */
+static int upcall_allowed(uint32_t src)
+{
+    struct timespec now;
+    struct uprate *ur;
+    uint64_t tokens;
+    uint32_t burst;
+
+    if (!upcall_rate)
+	return 1;
+
+    burst = upcall_burst ? upcall_burst : upcall_rate;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ur = &uprates[((ntohl(src) * 2654435761U) >> 22) & (UPRATE_SIZE - 1)];
+    if (!ur->ur_last) {
+	ur->ur_tokens = burst;	/* First use */
+	ur->ur_last   = now.tv_sec;
+    } else if (now.tv_sec > ur->ur_last) {
+	tokens = ur->ur_tokens + (uint64_t)(now.tv_sec - ur->ur_last) * upcall_rate;
+	ur->ur_tokens = tokens < burst ? tokens : burst;
+	ur->ur_last   = now.tv_sec;
+    }
+
+    if (!ur->ur_tokens)
+	return 0;
+    ur->ur_tokens--;
+
+    return 1;
+}
+
+/*
+ * Kernel NOCACHE upcall for (src, grp).  Queued for run_upcalls(), an
+ * (S,G) already in the queue is only counted, and sources over their
+ * upcall-rate are dropped.  The kernel asks again for a dropped (S,G)
+ * once its unresolved entry has timed out.
+ */
+void accept_upcall(uint32_t src, uint32_t grp)
+{
+    struct upcall *uc;
+    size_t i = upcall_idx(src, grp);
+
+    upcalls_received++;
+    for (uc = uphash[i]; uc; uc = uc->uc_hnext) {
+	if (uc->uc_src == src && uc->uc_grp == grp) {
+	    upcalls_merged++;
+	    return;
+	}
+    }
+
+    if (!upcall_allowed(src)) {
+	upcalls_limited++;
+	IF_DEBUG(DEBUG_CACHE) {
+	    logit(LOG_DEBUG, 0, "Upcall for (%s %s) over rate limit, dropped",
+		  inet_fmt(src, s1, sizeof(s1)), inet_fmt(grp, s2, sizeof(s2)));
+	}
+	return;
+    }
+
+    uc = TAILQ_FIRST(&upfree);
+    if (!uc) {
+	upcalls_dropped++;
+	return;
+    }
+    TAILQ_REMOVE(&upfree, uc, uc_link);
+
+    uc->uc_src   = src;
+    uc->uc_grp   = grp;
+    uc->uc_hnext = uphash[i];
+    uphash[i]    = uc;
+    TAILQ_INSERT_TAIL(&upqueue, uc, uc_link);
+}
+
+/*
+ * Add table entries for a batch of queued upcalls, called at the end of
+ * each event loop iteration.  Asks for another turn if any are left.
+ */
+void run_upcalls(void)
+{
+    struct upcall *uc, **ucp;
+    int num = 0;
+
+    while (num++ < UPCALL_BATCH && (uc = TAILQ_FIRST(&upqueue))) {
+	TAILQ_REMOVE(&upqueue, uc, uc_link);
+	for (ucp = &uphash[upcall_idx(uc->uc_src, uc->uc_grp)]; *ucp != uc; ucp = &(*ucp)->uc_hnext)
+	    ;
+	*ucp = uc->uc_hnext;
+	TAILQ_INSERT_TAIL(&upfree, uc, uc_link);
+
+	add_table_entry(uc->uc_src, uc->uc_grp);
+    }
+
+    if (!TAILQ_EMPTY(&upqueue))
+	pev_hook_again();
 }
 
 /* 
@@ -600,21 +1520,20 @@ void add_table_entry(uint32_t origin, uint32_t mcastgrp)
     }
 
     if (!gt || gt->gt_mcastgrp != mcastgrp) {
-	gt = calloc(1, sizeof(struct gtable));
-	if (!gt) {
-	    logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
+	gt = alloc_gtable();
+	if (!gt)
 	    return;
-	}
 
 	gt->gt_mcastgrp	    = mcastgrp;
-	gt->gt_timer   	    = CACHE_LIFETIME(cache_lifetime);
+	gt->gt_expire	    = ctclock + CACHE_LIFETIME(cache_lifetime);
 	time(&gt->gt_ctime);
-	gt->gt_prsent_timer = 0;
+	gt->gt_prsent	    = 0;
 	gt->gt_grftsnt	    = 0;
+	gt->gt_prxmit	    = 0;
 	gt->gt_srctbl	    = NULL;
 	gt->gt_pruntbl	    = NULL;
 	gt->gt_route	    = r;
-	gt->gt_rexmit_timer = 0;
+	gt->gt_rxdue	    = 0;
 	NBRM_CLRALL(gt->gt_prunes);
 	gt->gt_prune_rexmit = PRUNE_REXMIT_VAL;
 
@@ -631,50 +1550,33 @@ void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 	gt->gt_prev = prev_gt;
 
 	if (r) {
-	    if (find_src_grp(r->rt_origin, r->rt_originmask, gt->gt_mcastgrp)) {
-		struct gtable *g = gtp ? gtp->gt_gnext : kernel_table;
+	    struct gtable *g = find_src_grp(r->rt_origin, r->rt_originmask, gt->gt_mcastgrp);
 
+	    if (g) {
 		logit(LOG_WARNING, 0, "Entry for (%s %s) (rt:%p) exists (rt:%p)",
 		      RT_FMT(r, s1), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)),
 		      r, g->gt_route);
 	    } else {
-		if (gtp) {
-		    gt->gt_gnext = gtp->gt_gnext;
-		    gt->gt_gprev = gtp;
-		    gtp->gt_gnext = gt;
-		} else {
-		    gt->gt_gnext = kernel_table;
-		    gt->gt_gprev = NULL;
-		    kernel_table = gt;
-		}
-		if (gt->gt_gnext)
-		    gt->gt_gnext->gt_gprev = gt;
+		link_gtable(gt);
 	    }
 	} else {
 	    gt->gt_gnext = gt->gt_gprev = NULL;
 	}
+	schedule_cache(gt);
     }
 
-    stnp = &gt->gt_srctbl;
-    while ((st = *stnp) != NULL) {
-	if (ntohl(st->st_origin) >= ntohl(origin))
-	    break;
-	stnp = &st->st_next;
-    }
-
-    if (!st || st->st_origin != origin) {
-	st = calloc(1, sizeof(struct stable));
-	if (!st) {
-	    logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
+    st = find_source(gt, origin);
+    if (!st) {
+	st = cache_get(&stpool, "sources", sizeof(struct stable), cache_max_sources);
+	if (!st)
 	    return;
-	}
 
 	st->st_origin = origin;
 	st->st_pktcnt = 0;
 	st->st_savpkt = 0;
+	st->st_kparent = NO_VIF;
 	time(&st->st_ctime);
-	st->st_next = *stnp;
-	*stnp = st;
+	insert_source(gt, st);
     } else {
 	if (st->st_ctime == 0) {
 	    /* An old source which we're keeping around for statistics */
@@ -684,13 +1586,16 @@ void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 	    if (time(0) - st->st_ctime > 5)
 		logit(LOG_WARNING, 0, "Kernel entry already exists for (%s %s)",
 		      inet_fmt(origin, s1, sizeof(s1)), inet_fmt(mcastgrp, s2, sizeof(s2)));
-	    k_add_rg(origin, gt);
+
+	    /* The kernel asked, so it does not have it after all */
+	    st->st_kparent = NO_VIF;
+	    add_kernel(gt, st);
 	    return;
 	}
     }
 
     kroutes++;
-    k_add_rg(origin, gt);
+    add_kernel(gt, st);
 
     IF_DEBUG(DEBUG_CACHE) {
 	logit(LOG_DEBUG, 0, "Add cache entry (%s %s) gm:%lx, parent-vif:%d",
@@ -708,78 +1613,87 @@ void add_table_entry(uint32_t origin, uint32_t mcastgrp)
 }
 
 /*
- * A router has gone down.  Remove prune state pertinent to that router.
+ * A router has gone down.  Remove prune state pertinent to that router,
+ * 'index' is its neighbor index.  Only the group entries that have the
+ * router upstream, or hold a prune from it, are visited.
  */
-void reset_neighbor_state(vifi_t vifi, uint32_t addr)
+void reset_neighbor_state(vifi_t vifi, uint32_t addr, uint32_t index)
 {
     struct rtentry *r;
-    struct gtable *g;
-    struct ptable *pt, **ptnp;
+    struct gtable *g, *gtmp;
+    struct ptable *pt, *pttmp, **ptnp;
     struct stable *st;
 
-    for (g = kernel_table; g; g = g->gt_gnext) {
+    /* Prunes and grafts not yet sent are moot */
+    flush_upstream(&txnbrs[index], vifi, addr);
+
+    /*
+     * If neighbor was the parent, remove the prune sent state
+     * and all of the source cache info so that prunes get
+     * regenerated.
+     */
+    LIST_FOREACH_SAFE(g, &nbrgroups[index], gt_nlink, gtmp) {
 	r = g->gt_route;
+	if (vifi != r->rt_parent || addr != r->rt_gateway)
+	    continue;
+
+	IF_DEBUG(DEBUG_PEER) {
+	    logit(LOG_DEBUG, 0, "reset_neighbor_state() parent reset (%s %s)",
+		  RT_FMT(r, s1), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)));
+	}
+
+	g->gt_prsent = 0;
+	g->gt_grftsnt = 0;
+	while ((st = g->gt_srctbl) != NULL) {
+	    g->gt_srctbl = st->st_next;
+	    if (st->st_ctime != 0) {
+		k_del_rg(st->st_origin, g);
+		kroutes--;
+	    }
+	    free_source(g, st);
+	}
+    }
+
+    /*
+     * Remove any prunes that this router has sent us.
+     */
+    LIST_FOREACH_SAFE(pt, &nbrprunes[index], pt_nlink, pttmp) {
+	if (pt->pt_vifi != vifi || pt->pt_router != addr)
+	    continue;
+
+	g = pt->pt_gt;
+	r = g->gt_route;
+	if (vifi == r->rt_parent)
+	    continue;
+
+	for (ptnp = &g->gt_pruntbl; *ptnp != pt; ptnp = &(*ptnp)->pt_next)
+	    ;
+	NBRM_CLR(pt->pt_index, g->gt_prunes);
+	*ptnp = pt->pt_next;
+	free_prune(pt);
 
 	/*
-	 * If neighbor was the parent, remove the prune sent state
-	 * and all of the source cache info so that prunes get
-	 * regenerated.
+	 * And see if we want to forward again.
 	 */
-	if (vifi == r->rt_parent) {
-	    if (addr == r->rt_gateway) {
-		IF_DEBUG(DEBUG_PEER) {
-		    logit(LOG_DEBUG, 0, "reset_neighbor_state() parent reset (%s %s)",
-			  RT_FMT(r, s1), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)));
-		}
+	if (!VIFM_ISSET(vifi, g->gt_grpmems)) {
+	    GET_MEMBERSHIP(g, vifi);
+	    APPLY_SCOPE(g);
+	    prun_add_ttls(g);
 
-		g->gt_prsent_timer = 0;
-		g->gt_grftsnt = 0;
-		while ((st = g->gt_srctbl) != NULL) {
-		    g->gt_srctbl = st->st_next;
-		    if (st->st_ctime != 0) {
-			k_del_rg(st->st_origin, g);
-			kroutes--;
-		    }
-		    free(st);
-		}
-	    }
-	} else {
-	    /*
-	     * Remove any prunes that this router has sent us.
-	     */
-	    ptnp = &g->gt_pruntbl;
-	    while ((pt = *ptnp) != NULL) {
-		if (pt->pt_vifi == vifi && pt->pt_router == addr) {
-		    NBRM_CLR(pt->pt_index, g->gt_prunes);
-		    *ptnp = pt->pt_next;
-		    free(pt);
-		} else
-		    ptnp = &pt->pt_next;
-	    }
+	    /* Update kernel state */
+	    update_kernel(g);
 
 	    /*
-	     * And see if we want to forward again.
+	     * If removing this prune causes us to start forwarding
+	     * (e.g. the neighbor rebooted), and we sent a prune upstream,
+	     * send a graft to cancel the prune.
 	     */
-	    if (!VIFM_ISSET(vifi, g->gt_grpmems)) {
-		GET_MEMBERSHIP(g, vifi);
-		APPLY_SCOPE(g);
-		prun_add_ttls(g);
-
-		/* Update kernel state */
-		update_kernel(g);
-
-		/*
-		 * If removing this prune causes us to start forwarding
-		 * (e.g. the neighbor rebooted), and we sent a prune upstream,
-		 * send a graft to cancel the prune.
-		 */
-		if (!VIFM_ISEMPTY(g->gt_grpmems) && g->gt_prsent_timer)
-		    send_graft(g);
+	    if (!VIFM_ISEMPTY(g->gt_grpmems) && g->gt_prsent)
+		send_graft(g);
 
-		IF_DEBUG(DEBUG_PEER) {
-		    logit(LOG_DEBUG, 0, "Reset neighbor state (%s %s) gm:%lx",
-			  RT_FMT(r, s1), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)), g->gt_grpmems);
-		}
+	    IF_DEBUG(DEBUG_PEER) {
+		logit(LOG_DEBUG, 0, "Reset neighbor state (%s %s) gm:%lx",
+		      RT_FMT(r, s1), inet_fmt(g->gt_mcastgrp, s2, sizeof(s2)), g->gt_grpmems);
 	    }
 	}
     }
@@ -815,7 +1729,7 @@ void del_table_entry(struct rtentry *r, uint32_t mcastgrp, uint32_t del_flag)
 		}
 		prev_st = st;
 		st = st->st_next;
-		free(prev_st);
+		pool_put(stpool, prev_st);
 	    }
 	    g->gt_srctbl = NULL;
 
@@ -823,23 +1737,18 @@ void del_table_entry(struct rtentry *r, uint32_t mcastgrp, uint32_t del_flag)
 	    while (pt) {
 		prev_pt = pt;
 		pt = pt->pt_next;
-		free(prev_pt);
+		free_prune(prev_pt);
 	    }
 	    g->gt_pruntbl = NULL;
 
-	    if (g->gt_gnext)
-		g->gt_gnext->gt_gprev = g->gt_gprev;
-	    if (g->gt_gprev)
-		g->gt_gprev->gt_gnext = g->gt_gnext;
-	    else
-		kernel_table = g->gt_gnext;
+	    unlink_gtable(g);
+	    unschedule_cache(g);
 
-	    if (g->gt_rexmit_timer > 0)
-		g->gt_rexmit_timer = pev_timer_del(g->gt_rexmit_timer);
+	    unschedule_rexmit(g);
 
 	    prev_g = g;
 	    g = g->gt_next;
-	    free(prev_g);
+	    free_gtable(prev_g);
 	}
 	r->rt_groups = NULL;
     }
@@ -868,7 +1777,7 @@ void del_table_entry(struct rtentry *r, uint32_t mcastgrp, uint32_t del_flag)
 		    }
 		    prev_st = st;
 		    st = st->st_next;
-		    free(prev_st);
+		    pool_put(stpool, prev_st);
 		}
 		g->gt_srctbl = NULL;
 
@@ -876,16 +1785,12 @@ void del_table_entry(struct rtentry *r, uint32_t mcastgrp, uint32_t del_flag)
 		while (pt) {
 		    prev_pt = pt;
 		    pt = pt->pt_next;
-		    free(prev_pt);
+		    free_prune(prev_pt);
 		}
 		g->gt_pruntbl = NULL;
 
-		if (g->gt_gnext)
-		    g->gt_gnext->gt_gprev = g->gt_gprev;
-		if (g->gt_gprev)
-		    g->gt_gprev->gt_gnext = g->gt_gnext;
-		else
-		    kernel_table = g->gt_gnext;
+		unlink_gtable(g);
+		unschedule_cache(g);
 
 		if (prev_g != (struct gtable *)&r->rt_groups)
 		    g->gt_next->gt_prev = prev_g;
@@ -893,10 +1798,9 @@ void del_table_entry(struct rtentry *r, uint32_t mcastgrp, uint32_t del_flag)
 		    g->gt_next->gt_prev = NULL;
 		prev_g->gt_next = g->gt_next;
 
-		if (g->gt_rexmit_timer > 0)
-		    g->gt_rexmit_timer = pev_timer_del(g->gt_rexmit_timer);
+		unschedule_rexmit(g);
 
-		free(g);
+		free_gtable(g);
 		g = prev_g;
 	    } else {
 		prev_g = g;
@@ -938,7 +1842,7 @@ void update_table_entry(struct rtentry *r, uint32_t old_parent_gw)
 
 		NBRM_CLR(pt->pt_index, g->gt_prunes);
 		*ptnp = pt->pt_next;
-		free(pt);
+		free_prune(pt);
 		continue;
 	    }
 	    ptnp = &((*ptnp)->pt_next);
@@ -956,8 +1860,10 @@ void update_table_entry(struct rtentry *r, uint32_t old_parent_gw)
 	 * old parent will forget any prune state it is keeping for us.
 	 */
 	if (old_parent_gw != r->rt_gateway) {
-	    g->gt_prsent_timer = 0;
+	    g->gt_prsent = 0;
 	    g->gt_grftsnt = 0;
+	    if (g->gt_gprev || kernel_table == g)
+		link_upstream(g);
 	}
 
 	/* Recalculate membership */
@@ -987,13 +1893,9 @@ void update_lclgrp(vifi_t vifi, uint32_t mcastgrp)
     IF_DEBUG(DEBUG_MEMBER)
 	logit(LOG_DEBUG, 0, "Group %s joined on vif %u", inet_fmt(mcastgrp, s1, sizeof(s1)), vifi);
 
-    for (g = kernel_table; g; g = g->gt_gnext) {
-	if (ntohl(mcastgrp) < ntohl(g->gt_mcastgrp))
-	    break;
-
+    for (g = find_group(mcastgrp); g && g->gt_mcastgrp == mcastgrp; g = g->gt_gnext) {
 	r = g->gt_route;
-	if (g->gt_mcastgrp == mcastgrp &&
-	    VIFM_ISSET(vifi, r->rt_children)) {
+	if (VIFM_ISSET(vifi, r->rt_children)) {
 
 	    VIFM_SET(vifi, g->gt_grpmems);
 	    APPLY_SCOPE(g);
@@ -1021,13 +1923,10 @@ void delete_lclgrp(vifi_t vifi, uint32_t mcastgrp)
 
     uv = find_uvif(vifi);
     IF_DEBUG(DEBUG_MEMBER)
-	logit(LOG_DEBUG, 0, "Group %s left on vif %u", inet_fmt(mcastgrp, s1, sizeof(s1)), vifi);
-
-    for (g = kernel_table; g; g = g->gt_gnext) {
-	if (ntohl(mcastgrp) < ntohl(g->gt_mcastgrp))
-	    break;
+	logit(LOG_DEBUG, 0, "Group %s left on vif %u", inet_fmt(mcastgrp, s1, sizeof(s1)), vifi);
 
-	if (g->gt_mcastgrp == mcastgrp && VIFM_ISSET(vifi, g->gt_grpmems)) {
+    for (g = find_group(mcastgrp); g && g->gt_mcastgrp == mcastgrp; g = g->gt_gnext) {
+	if (VIFM_ISSET(vifi, g->gt_grpmems)) {
 	    if (g->gt_route == NULL ||
 		SUBS_ARE_PRUNED(g->gt_route->rt_subordinates, uv->uv_nbrmap, g->gt_prunes)) {
 		VIFM_CLR(vifi, g->gt_grpmems);
@@ -1116,8 +2015,8 @@ void accept_prune(uint32_t src, uint32_t dst, char *p, size_t datalen)
     /*
      * Find the subnet for the prune
      */
-    if (find_src_grp(prun_src, 0, prun_grp)) {
-	g = gtp ? gtp->gt_gnext : kernel_table;
+    g = find_src_grp(prun_src, 0, prun_grp);
+    if (g) {
     	r = g->gt_route;
 
 	IF_DEBUG(DEBUG_PRUNE) {
@@ -1144,9 +2043,9 @@ void accept_prune(uint32_t src, uint32_t dst, char *p, size_t datalen)
 	    IF_DEBUG(DEBUG_PRUNE) {
 		logit(LOG_DEBUG, 0, "Duplicate prune received on vif %u from %s for (%s %s)/%d old timer: %d cur gm: %lx",
 		      vifi, inet_fmt(src, s1, sizeof(s1)), inet_fmt(prun_src, s2, sizeof(s2)),
-		      inet_fmt(prun_grp, s3, sizeof(s3)), prun_tmr, pt->pt_timer, g->gt_grpmems);
+		      inet_fmt(prun_grp, s3, sizeof(s3)), prun_tmr, CT_LEFT(pt->pt_expire), g->gt_grpmems);
 	    }
-	    pt->pt_timer = prun_tmr;
+	    pt->pt_expire = ctclock + prun_tmr;
 	} else {
 	    struct listaddr *n = neighbor_info(vifi, src);
 
@@ -1157,24 +2056,22 @@ void accept_prune(uint32_t src, uint32_t dst, char *p, size_t datalen)
 	    }
 
 	    /* allocate space for the prune structure */
-	    pt = calloc(1, sizeof(struct ptable));
-	    if (!pt) {
-		logit(LOG_ERR, errno, "Failed allocating memory in %s:%s()", __FILE__, __func__);
+	    pt = cache_get(&ptpool, "prunes", sizeof(struct ptable), cache_max_prunes);
+	    if (!pt)
 		return;
-	    }
 
 	    pt->pt_vifi = vifi;
 	    pt->pt_router = src;
-	    pt->pt_timer = prun_tmr;
+	    pt->pt_expire = ctclock + prun_tmr;
 
 	    pt->pt_next = g->gt_pruntbl;
 	    g->gt_pruntbl = pt;
-
-	    if (n) {
-		pt->pt_index = n->al_index;
-		NBRM_SET(n->al_index, g->gt_prunes);
-	    }
+	    pt->pt_gt = g;
+	    pt->pt_index = n->al_index;
+	    LIST_INSERT_HEAD(&nbrprunes[n->al_index], pt, pt_nlink);
+	    NBRM_SET(n->al_index, g->gt_prunes);
 	}
+	schedule_cache(g);
 
 	/*
 	 * check if any more packets need to be sent on the 
@@ -1240,13 +2137,10 @@ void chkgrp_graft(vifi_t vifi, uint32_t mcastgrp)
     struct rtentry *r;
     struct gtable *g;
 
-    for (g = kernel_table; g; g = g->gt_gnext) {
-	if (ntohl(mcastgrp) < ntohl(g->gt_mcastgrp))
-	    break;
-
+    for (g = find_group(mcastgrp); g && g->gt_mcastgrp == mcastgrp; g = g->gt_gnext) {
 	r = g->gt_route;
-	if (g->gt_mcastgrp == mcastgrp && VIFM_ISSET(vifi, r->rt_children))
-	    if (g->gt_prsent_timer) {
+	if (VIFM_ISSET(vifi, r->rt_children))
+	    if (g->gt_prsent) {
 		VIFM_SET(vifi, g->gt_grpmems);
 
 		/*
@@ -1261,7 +2155,7 @@ void chkgrp_graft(vifi_t vifi, uint32_t mcastgrp)
 		send_graft(g);
 
 		/* update cache timer*/
-		g->gt_timer = CACHE_LIFETIME(cache_lifetime);
+		g->gt_expire = ctclock + CACHE_LIFETIME(cache_lifetime);
 
 		IF_DEBUG(DEBUG_PRUNE|DEBUG_CACHE) {
 		    logit(LOG_DEBUG, 0, "chkgrp graft (%s %s) gm:%lx",
@@ -1323,8 +2217,8 @@ void accept_graft(uint32_t src, uint32_t dst, char *p, size_t datalen)
     /*
      * Find the subnet for the graft
      */
-    if (find_src_grp(graft_src, 0, graft_grp)) {
-	g = gtp ? gtp->gt_gnext : kernel_table;
+    g = find_src_grp(graft_src, 0, graft_grp);
+    if (g) {
 	r = g->gt_route;
 
 	if (VIFM_ISSET(vifi, g->gt_scope)) {
@@ -1339,7 +2233,7 @@ void accept_graft(uint32_t src, uint32_t dst, char *p, size_t datalen)
 	    if ((pt->pt_vifi == vifi) && (pt->pt_router == src)) {
 		NBRM_CLR(pt->pt_index, g->gt_prunes);
 		*ptnp = pt->pt_next;
-		free(pt);
+		free_prune(pt);
 
 		VIFM_SET(vifi, g->gt_grpmems);
 		IF_DEBUG(DEBUG_PRUNE|DEBUG_CACHE) {
@@ -1355,8 +2249,8 @@ void accept_graft(uint32_t src, uint32_t dst, char *p, size_t datalen)
 	    }
 	}
 
-	g->gt_timer = CACHE_LIFETIME(cache_lifetime);
-	if (g->gt_prsent_timer)
+	g->gt_expire = ctclock + CACHE_LIFETIME(cache_lifetime);
+	if (g->gt_prsent)
 	    /* send graft upwards */
 	    send_graft(g);
     } else {
@@ -1413,8 +2307,8 @@ void accept_g_ack(uint32_t src, uint32_t dst, char *p, size_t datalen)
     /*
      * Find the subnet for the graft ack
      */
-    if (find_src_grp(grft_src, 0, grft_grp)) {
-	g = gtp ? gtp->gt_gnext : kernel_table;
+    g = find_src_grp(grft_src, 0, grft_grp);
+    if (g) {
 	g->gt_grftsnt = 0;
     } else {
 	logit(LOG_WARNING, 0, "Received graft ACK with no kernel entry for (%s, %s) from %s",
@@ -1437,6 +2331,7 @@ void free_all_prunes(void)
     struct stable *s, *prev_s;
     struct ptable *p, *prev_p;
     struct rtentry *r = NULL;
+    size_t i;
 
     while (route_iter(&r)) {
 	g = r->rt_groups;
@@ -1445,38 +2340,58 @@ void free_all_prunes(void)
 	    while (s) {
 		prev_s = s;
 		s = s->st_next;
-		free(prev_s);
+		pool_put(stpool, prev_s);
 	    }
 
 	    p = g->gt_pruntbl;
 	    while (p) {
 		prev_p = p;
 		p = p->pt_next;
-		free(prev_p);
+		pool_put(ptpool, prev_p);
 	    }
 
 	    prev_g = g;
 	    g = g->gt_next;
-	    if (prev_g->gt_rexmit_timer > 0)
-		prev_g->gt_rexmit_timer = pev_timer_del(prev_g->gt_rexmit_timer);
-	    free(prev_g);
+	    unschedule_rexmit(prev_g);
+	    free_gtable(prev_g);
 	}
 	r->rt_groups = NULL;
     }
+    for (i = 0; i < GTHASH_SIZE; i++) {
+	LIST_INIT(&gthash[i]);
+	LIST_INIT(&gtgroup[i]);
+    }
+    for (i = 0; i < CTWHEEL_SIZE; i++)
+	LIST_INIT(&ctwheel[i]);
+    for (i = 0; i < RXWHEEL_SIZE; i++)
+	LIST_INIT(&rxwheel[i]);
+    for (i = 0; i < MAXNBRS; i++) {
+	LIST_INIT(&nbrgroups[i]);
+	LIST_INIT(&nbrprunes[i]);
+	TAILQ_INIT(&txnbrs[i].tn_queue);	/* Entries freed with txpool */
+    }
+    prune_qlen = 0;
     kernel_table = NULL;
 
     g = kernel_no_route;
     while (g) {
 	if (g->gt_srctbl)
-	    free(g->gt_srctbl);
+	    pool_put(stpool, g->gt_srctbl);
 
 	prev_g = g;
 	g = g->gt_next;
-	if (prev_g->gt_rexmit_timer > 0)
-	    prev_g->gt_rexmit_timer = pev_timer_del(prev_g->gt_rexmit_timer);
-	free(prev_g);
+	unschedule_rexmit(prev_g);
+	free_gtable(prev_g);
     }
     kernel_no_route = NULL;
+
+    /* Recreated on first use, with the limits from the new config */
+    pool_destroy(gtpool);
+    pool_destroy(stpool);
+    pool_destroy(ptpool);
+    pool_destroy(txpool);
+    gtpool = stpool = ptpool = NULL;
+    txpool = NULL;
 }
 
 /*
@@ -1522,7 +2437,7 @@ void steal_sources(struct rtentry *rt)
 			    kroutes--;
 			}
 			*stnp = st->st_next;
-			free(st);
+			free_source(gt, st);
 		    } else {
 			stnp = &st->st_next;
 		    }
@@ -1549,247 +2464,508 @@ void steal_sources(struct rtentry *rt)
 		}
 		kroutes--;
 	    }
-	    free(gt->gt_srctbl);
+	    pool_put(stpool, gt->gt_srctbl);
 	    *gtnp = gt->gt_next;
 	    if (gt->gt_next)
 		gt->gt_next->gt_prev = gt->gt_prev;
-	    if (gt->gt_rexmit_timer > 0)
-		gt->gt_rexmit_timer = pev_timer_del(gt->gt_rexmit_timer);
-	    free(gt);
+	    unschedule_cache(gt);
+	    unschedule_rexmit(gt);
+	    free_gtable(gt);
 	} else {
 	    gtnp = &gt->gt_next;
 	}
     }
 }
 
+static size_t sg_idx(uint32_t src, uint32_t grp)
+{
+    uint32_t key = (src ^ (grp * 2654435761U)) * 2654435761U;
+
+    return (key ^ (key >> 16)) & (sgsize - 1);
+}
+
+static void sg_insert(uint32_t src, uint32_t grp, unsigned long pktcnt)
+{
+    struct sgcnt *sc;
+    size_t i;
+
+    for (i = sg_idx(src, grp); sgtbl[i].sc_grp; i = (i + 1) & (sgsize - 1)) {
+	if (sgtbl[i].sc_src == src && sgtbl[i].sc_grp == grp)
+	    break;
+    }
+
+    sc = &sgtbl[i];
+    sc->sc_src    = src;
+    sc->sc_grp    = grp;
+    sc->sc_pktcnt = pktcnt;
+}
+
 /*
- * Advance the timers on all the cache entries.
- * If there are any entries whose timers have expired,
- * remove these entries from the kernel cache.
+ * Read the packet counters of all kernel (S,G) entries into sgtbl.
+ * Only the default multicast routing table is listed in /proc, so
+ * with another table, or on other systems, we keep using the ioctl.
  */
-void age_table_entry(void)
+static int sg_snapshot(void)
+{
+#ifdef _PATH_MROUTE_CACHE
+    unsigned long pktcnt, bytecnt, wrong_if;
+    uint32_t grp, src;
+    size_t num = 0;
+    char buf[256];
+    FILE *fp;
+    int iif;
+
+    if (mrt_table_id != 0)
+	return -1;
+
+    /* At most half full, grow if the kernel has more entries than we know of */
+    if (sgsize < 2 * (size_t)kroutes || !sgtbl) {
+	struct sgcnt *tbl;
+	size_t size = 64;
+
+	while (size < 2 * (size_t)kroutes)
+	    size <<= 1;
+	tbl = realloc(sgtbl, size * sizeof(struct sgcnt));
+	if (!tbl) {
+	    logit(LOG_WARNING, errno, "Failed allocating (S,G) counter snapshot");
+	    return -1;
+	}
+	sgtbl  = tbl;
+	sgsize = size;
+    }
+    memset(sgtbl, 0, sgsize * sizeof(struct sgcnt));
+
+    fp = fopen(_PATH_MROUTE_CACHE, "r");
+    if (!fp)
+	return -1;
+
+    /* Skip heading: Group Origin Iif Pkts Bytes Wrong Oifs */
+    if (!fgets(buf, sizeof(buf), fp)) {
+	fclose(fp);
+	return -1;
+    }
+
+    /* Addresses are printed as hex of the raw, network order, value */
+    while (fgets(buf, sizeof(buf), fp)) {
+	if (sscanf(buf, "%x %x %d %lu %lu %lu", &grp, &src, &iif, &pktcnt, &bytecnt, &wrong_if) != 6)
+	    continue;
+	if (!grp || iif < 0)
+	    continue;		/* unresolved entry */
+	if (num >= sgsize / 2)
+	    break;		/* rest falls back to the ioctl */
+
+	sg_insert(src, grp, pktcnt);
+	num++;
+    }
+    fclose(fp);
+
+    IF_DEBUG(DEBUG_CACHE)
+	logit(LOG_DEBUG, 0, "Read %zu kernel (S,G) counters from %s", num, _PATH_MROUTE_CACHE);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Start a pass of (S,G) packet counter lookups, see get_sg_pktcnt().
+ */
+static void sg_begin(void)
+{
+    k_flush_rg();
+    sgvalid = 0;
+    sgcalls = 0;
+}
+
+/*
+ * End a pass of (S,G) packet counter lookups, drop the snapshot.
+ */
+static void sg_end(void)
+{
+    sgvalid = 0;
+    sgcalls = 0;
+}
+
+/*
+ * Get the packet count of (S,G) entry (src, grp) in the kernel.  The
+ * first lookups in a pass use SIOCGETSGCNT, after SG_BULK_MIN of them
+ * all kernel counters are read at once and the rest are looked up in
+ * that snapshot.  Entries not in the snapshot use the ioctl as well.
+ * Returns -1 and sets errno on failure.
+ */
+static int get_sg_pktcnt(uint32_t src, uint32_t grp, unsigned long *pktcnt)
 {
     struct sioc_sg_req sg_req = { 0 };
-    struct gtable *gt, **gtnptr;
-    struct stable *st, **stnp;
-    struct ptable *pt, **ptnp;
-    struct rtentry *r;
-    
-    IF_DEBUG(DEBUG_PRUNE|DEBUG_CACHE)
-	logit(LOG_DEBUG, 0, "Aging forwarding cache entries");
-    
-    gtnptr = &kernel_table;
-    while ((gt = *gtnptr) != NULL) {
-	vifi_t i; /* XXX Debugging */
-	int fixit = 0; /* XXX Debugging */
 
-	r = gt->gt_route;
+    if (!sgvalid && ++sgcalls > SG_BULK_MIN)
+	sgvalid = sg_snapshot() ? -1 : 1;
 
-	/* XXX Debugging... */
-	for (i = 0; i < numvifs; i++) {
-	    struct uvif *uv = find_uvif(i);
+    if (sgvalid > 0) {
+	size_t i;
 
-	    /*
-	     * If we're not sending on this vif,
-	     * And this group isn't scoped on this vif,
-	     * And I'm the parent for this route on this vif,
-	     * And there are subordinates on this vif,
-	     * And all of the subordinates haven't pruned,
-	     *		YELL LOUDLY
-	     *		and remember to fix it up later
-	     */
-	    if (!VIFM_ISSET(i, gt->gt_grpmems) &&
-		!VIFM_ISSET(i, gt->gt_scope) &&
-		VIFM_ISSET(i, r->rt_children) &&
-		NBRM_ISSETMASK(uv->uv_nbrmap, r->rt_subordinates) &&
-		!SUBS_ARE_PRUNED(r->rt_subordinates, uv->uv_nbrmap, gt->gt_prunes)) {
-		logit(LOG_WARNING, 0, "(%s %s) is blackholing on vif %u",
-		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), i);
-		fixit = 1;
+	for (i = sg_idx(src, grp); sgtbl[i].sc_grp; i = (i + 1) & (sgsize - 1)) {
+	    if (sgtbl[i].sc_src == src && sgtbl[i].sc_grp == grp) {
+		*pktcnt = sgtbl[i].sc_pktcnt;
+		return 0;
 	    }
 	}
-	if (fixit) {
-	    logit(LOG_WARNING, 0, "Fixing membership for (%s %s) gm:%lx",
-		  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), gt->gt_grpmems);
-	    determine_forwvifs(gt);
-	    send_prune_or_graft(gt);
-	    logit(LOG_WARNING, 0, "Fixed  membership for (%s %s) gm:%lx",
-		  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), gt->gt_grpmems);
-	}
-	/*DEBUG2*/
-	/* If there are group members,
-	 * and there are recent sources,
-	 * and we have a route,
-	 * and it's not directly connected,
-	 * and we haven't sent a prune,
-	 *	if there are any cache entries in the kernel
-	 *	 [if there aren't we're probably waiting to rexmit],
-	 *		YELL LOUDLY
-	 *		and send a prune
-	 */
-	if (VIFM_ISEMPTY(gt->gt_grpmems) && gt->gt_srctbl && r && r->rt_gateway && gt->gt_prsent_timer == 0) {
-	    for (st = gt->gt_srctbl; st; st = st->st_next) {
-		if (st->st_ctime != 0)
-		    break;
-	    }
+    }
 
-	    if (st != NULL) {
-		logit(LOG_WARNING, 0, "Group members for (%s %s) is empty but no prune state!",
-		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		send_prune_or_graft(gt);
-	    }
-	}
-	/* XXX ...Debugging */
+    sg_req.src.s_addr = src;
+    sg_req.grp.s_addr = grp;
+    if (ioctl(udp_socket, SIOCGETSGCNT, &sg_req) < 0)
+	return -1;
 
-	/* advance the timer for the kernel entry */
-	gt->gt_timer -= TIMER_INTERVAL;
+    *pktcnt = sg_req.pktcnt;
 
-	/* decrement prune timer if need be */
-	if (gt->gt_prsent_timer > 0) {
-	    gt->gt_prsent_timer -= TIMER_INTERVAL;
-	    if (gt->gt_prsent_timer <= 0) {
-		IF_DEBUG(DEBUG_PRUNE) {
-		    logit(LOG_DEBUG, 0, "Upstream prune tmo (%s %s)", RT_FMT(r, s1),
-			  inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		}
+    return 0;
+}
 
-		/* Reset the prune retransmission timer to its initial value */
-		gt->gt_prune_rexmit = PRUNE_REXMIT_VAL;
-		gt->gt_prsent_timer = -1;
-	    }
-	}
+/*
+ * Forwarding cache time when the next graft retransmission is due, or
+ * when retransmission gives up.  Grafts are retransmitted with an
+ * exponential backoff: when gt_grftsnt, bumped once per TIMER_INTERVAL
+ * since the first graft was sent, reaches a power of two.
+ */
+static uint32_t graft_due(struct gtable *gt)
+{
+    uint32_t n = (ctclock - gt->gt_grftbase) / TIMER_INTERVAL + 1;
+    uint32_t next = 2;
 
-	/* retransmit graft with exponential backoff */
-	if (gt->gt_grftsnt) {
-	    int y;
+    while (next <= n)
+	next <<= 1;
 
-	    y = ++gt->gt_grftsnt;
-	    while (y && !(y & 1))
-		y >>= 1;
-	    if (y == 1)
-		send_graft(gt);
-	}
+    return gt->gt_grftbase + (next - 1) * TIMER_INTERVAL;
+}
 
-	/*
-	 * Age prunes
-	 *
-	 * If a prune expires, forward again on that vif.
-	 */
-	ptnp = &gt->gt_pruntbl;
-	while ((pt = *ptnp) != NULL) {
-	    if ((pt->pt_timer -= TIMER_INTERVAL) <= 0) {
-		IF_DEBUG(DEBUG_PRUNE) {
-		    logit(LOG_DEBUG, 0, "Expire prune (%s %s) from %s on vif %u", 
-			  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-			  inet_fmt(pt->pt_router, s3, sizeof(s3)), pt->pt_vifi);
-		}
+/*
+ * Move cache entry 'gt' to the timing wheel slot for the earliest of its
+ * timers, rounded up to the next TIMER_INTERVAL tick.  Must be called
+ * whenever one of its timers is set to an earlier time than before;
+ * later times are picked up by age_cache_entry() when it is next due.
+ *
+ * Entries with an upstream router or downstream subordinates are due at
+ * least every CT_SANITY seconds, so the blackhole and missing prune
+ * checks in age_cache_entry() repair broken membership within that time
+ * rather than when the entry next times out.
+ */
+static void schedule_cache(struct gtable *gt)
+{
+    struct rtentry *r = gt->gt_route;
+    struct ptable *pt;
+    uint32_t when;
+    int32_t left;
+
+    when = gt->gt_expire;
+    if (!gt->gt_route)
+	when++;			/* No-route entries time out one tick later */
+    if (gt->gt_prsent && CT_LEFT(gt->gt_prsent) < CT_LEFT(when))
+	when = gt->gt_prsent;
+    if (gt->gt_grftsnt && CT_LEFT(graft_due(gt)) < CT_LEFT(when))
+	when = graft_due(gt);
+    for (pt = gt->gt_pruntbl; pt; pt = pt->pt_next) {
+	if (CT_LEFT(pt->pt_expire) < CT_LEFT(when))
+	    when = pt->pt_expire;
+    }
+    if (r && (r->rt_gateway || !NBRM_ISEMPTY(r->rt_subordinates)) && CT_LEFT(when) > CT_SANITY)
+	when = ctclock + CT_SANITY;
+
+    left = CT_LEFT(when);
+    if (left <= 0)
+	left = TIMER_INTERVAL;
+    when = ctclock + (left + TIMER_INTERVAL - 1) / TIMER_INTERVAL * TIMER_INTERVAL;
+
+    if (gt->gt_due)
+	LIST_REMOVE(gt, gt_wlink);
+    gt->gt_due = when;
+    LIST_INSERT_HEAD(CTWHEEL_SLOT(when), gt, gt_wlink);
+}
 
-		if (gt->gt_prsent_timer > 0) {
-		    logit(LOG_WARNING, 0, "Prune (%s %s) from %s on vif %u expires with %d left on prsent timer",
-			  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
-			  inet_fmt(pt->pt_router, s3, sizeof(s3)), pt->pt_vifi, gt->gt_prsent_timer);
+/*
+ * Take cache entry 'gt' off the timing wheel, before freeing it.
+ */
+static void unschedule_cache(struct gtable *gt)
+{
+    if (!gt->gt_due)
+	return;
 
-		    /* Send a graft to heal the tree. */
-		    send_graft(gt);
-		}
+    LIST_REMOVE(gt, gt_wlink);
+    gt->gt_due = 0;
+}
+
+/*
+ * Seconds left until cache entry 'gt' times out, for show/dump output.
+ */
+int cache_timer(struct gtable *gt)
+{
+    return CT_LEFT(gt->gt_expire);
+}
+
+/*
+ * Advance the forwarding cache time, and handle the cache entries with
+ * a timer that has expired.  Only entries in the current slot of the
+ * timing wheel are visited.  Any entries whose cache timer has expired,
+ * and have no traffic, are removed from the kernel cache.
+ */
+void age_table_entry(void)
+{
+    struct ctwheelhead due;
+    struct gtable *gt;
 
-		NBRM_CLR(pt->pt_index, gt->gt_prunes);
-		expire_prune(pt->pt_vifi, gt);
+    IF_DEBUG(DEBUG_PRUNE|DEBUG_CACHE)
+	logit(LOG_DEBUG, 0, "Aging forwarding cache entries");
 
-		/* remove the router's prune entry and await new one */
-		*ptnp = pt->pt_next;
-		free(pt);
-	    } else {
-		ptnp = &pt->pt_next;
-	    }
+    ctclock += TIMER_INTERVAL;
+
+    /* Entries may be rescheduled to this slot while we're at it */
+    LIST_INIT(&due);
+    while ((gt = LIST_FIRST(CTWHEEL_SLOT(ctclock)))) {
+	LIST_REMOVE(gt, gt_wlink);
+	LIST_INSERT_HEAD(&due, gt, gt_wlink);
+    }
+
+    sg_begin();
+    while ((gt = LIST_FIRST(&due))) {
+	LIST_REMOVE(gt, gt_wlink);
+	if (gt->gt_due != ctclock) {
+	    /* Not yet, next turn of the wheel */
+	    LIST_INSERT_HEAD(CTWHEEL_SLOT(gt->gt_due), gt, gt_wlink);
+	    continue;
 	}
 
+	gt->gt_due = 0;
+	if (gt->gt_route)
+	    age_cache_entry(gt);
+	else
+	    age_no_route_entry(gt);
+    }
+    sg_end();
+}
+
+/*
+ * Called once a second.  Advance the prune rexmit wheel, check the
+ * entries due for prune retransmission, and send what the rate allows
+ * of the prunes and grafts queued for each upstream neighbor.
+ */
+void prune_tick(void)
+{
+    struct gtable *gt, *tmp;
+    size_t i;
+
+    rxclock++;
+    LIST_FOREACH_SAFE(gt, RXWHEEL_SLOT(rxclock), gt_rxlink, tmp) {
+	if (gt->gt_rxdue != rxclock)
+	    continue;	/* Next turn of the wheel */
+
+	LIST_REMOVE(gt, gt_rxlink);
+	gt->gt_rxdue = 0;
+	rexmit_prune(gt);
+    }
+
+    if (!prune_qlen)
+	return;
+
+    for (i = 0; i < MAXNBRS; i++)
+	drain_upstream(&txnbrs[i]);
+}
+
+/*
+ * Handle the expired timers of cache entry 'gt', on kernel_table.
+ */
+static void age_cache_entry(struct gtable *gt)
+{
+    struct stable *st, **stnp;
+    struct ptable *pt, **ptnp;
+    struct rtentry *r;
+    vifi_t i; /* XXX Debugging */
+    int fixit = 0; /* XXX Debugging */
+
+    r = gt->gt_route;
+
+    /* XXX Debugging... */
+    for (i = 0; i < numvifs; i++) {
+	struct uvif *uv = find_uvif(i);
+
 	/*
-	 * If the cache entry has expired, delete source table entries for
-	 * silent sources.  If there are no source entries left, and there
-	 * are no downstream prunes, then the entry is deleted.
-	 * Otherwise, the cache entry's timer is refreshed.
+	 * If we're not sending on this vif,
+	 * And this group isn't scoped on this vif,
+	 * And I'm the parent for this route on this vif,
+	 * And there are subordinates on this vif,
+	 * And all of the subordinates haven't pruned,
+	 *		YELL LOUDLY
+	 *		and remember to fix it up later
 	 */
-	if (gt->gt_timer <= 0) {
-	    IF_DEBUG(DEBUG_CACHE) {
-		logit(LOG_DEBUG, 0, "(%s %s) timed out, checking for traffic",
-		      RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	if (!VIFM_ISSET(i, gt->gt_grpmems) &&
+	    !VIFM_ISSET(i, gt->gt_scope) &&
+	    VIFM_ISSET(i, r->rt_children) &&
+	    NBRM_ISSETMASK(uv->uv_nbrmap, r->rt_subordinates) &&
+	    !SUBS_ARE_PRUNED(r->rt_subordinates, uv->uv_nbrmap, gt->gt_prunes)) {
+	    logit(LOG_WARNING, 0, "(%s %s) is blackholing on vif %u",
+		  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), i);
+	    fixit = 1;
+	}
+    }
+    if (fixit) {
+	logit(LOG_WARNING, 0, "Fixing membership for (%s %s) gm:%lx",
+	      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), gt->gt_grpmems);
+	determine_forwvifs(gt);
+	send_prune_or_graft(gt);
+	logit(LOG_WARNING, 0, "Fixed  membership for (%s %s) gm:%lx",
+	      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), gt->gt_grpmems);
+    }
+    /*DEBUG2*/
+    /* If there are group members,
+     * and there are recent sources,
+     * and we have a route,
+     * and it's not directly connected,
+     * and we haven't sent a prune,
+     *	if there are any cache entries in the kernel
+     *	 [if there aren't we're probably waiting to rexmit],
+     *		YELL LOUDLY
+     *		and send a prune
+     */
+    if (VIFM_ISEMPTY(gt->gt_grpmems) && gt->gt_srctbl && r && r->rt_gateway && gt->gt_prsent == 0) {
+	for (st = gt->gt_srctbl; st; st = st->st_next) {
+	    if (st->st_ctime != 0)
+		break;
+	}
+
+	if (st != NULL) {
+	    logit(LOG_WARNING, 0, "Group members for (%s %s) is empty but no prune state!",
+		  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	    send_prune_or_graft(gt);
+	}
+    }
+    /* XXX ...Debugging */
+
+    /*
+     * Upstream prune timed out, kernel state is removed below.  Until
+     * then gt_prsent remains set, but with no time left.
+     */
+    if (gt->gt_prsent && CT_LEFT(gt->gt_prsent) <= 0) {
+	IF_DEBUG(DEBUG_PRUNE) {
+	    logit(LOG_DEBUG, 0, "Upstream prune tmo (%s %s)", RT_FMT(r, s1),
+		  inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	}
+
+	/* Reset the prune retransmission timer to its initial value */
+	gt->gt_prune_rexmit = PRUNE_REXMIT_VAL;
+    }
+
+    /* retransmit graft with exponential backoff */
+    if (gt->gt_grftsnt) {
+	uint32_t n = (ctclock - gt->gt_grftbase) / TIMER_INTERVAL + 1;
+
+	gt->gt_grftsnt = n < 256 ? n : 0;	/* Give up, like the old uint8_t wrap */
+	if (n < 256 && !(n & (n - 1)))
+	    send_graft(gt);
+    }
+
+    /*
+     * Age prunes
+     *
+     * If a prune expires, forward again on that vif.
+     */
+    ptnp = &gt->gt_pruntbl;
+    while ((pt = *ptnp) != NULL) {
+	if (CT_LEFT(pt->pt_expire) <= 0) {
+	    IF_DEBUG(DEBUG_PRUNE) {
+		logit(LOG_DEBUG, 0, "Expire prune (%s %s) from %s on vif %u", 
+		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
+		      inet_fmt(pt->pt_router, s3, sizeof(s3)), pt->pt_vifi);
 	    }
-	    /* Check for traffic before deleting source entries */
-	    sg_req.grp.s_addr = gt->gt_mcastgrp;
-	    stnp = &gt->gt_srctbl;
-	    while ((st = *stnp) != NULL) {
-		/*
-		 * Source entries with no ctime are not actually in the
-		 * kernel; they have been removed by rexmit_prune() so
-		 * are safe to remove from the list at this point.
-		 */
-		sg_req.pktcnt     = st->st_pktcnt;
-		sg_req.src.s_addr = st->st_origin;
 
-		if (st->st_ctime) {
-		    if (ioctl(udp_socket, SIOCGETSGCNT, &sg_req) < 0) {
-			logit(LOG_WARNING, errno, "%s() Failed ioctl SIOCGETSGCNT for (%s %s)",
-			      __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
-			      inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		    }
-		}
+	    if (gt->gt_prsent && CT_LEFT(gt->gt_prsent) > 0) {
+		logit(LOG_WARNING, 0, "Prune (%s %s) from %s on vif %u expires with %d left on prsent timer",
+		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)),
+		      inet_fmt(pt->pt_router, s3, sizeof(s3)), pt->pt_vifi, CT_LEFT(gt->gt_prsent));
 
-		if (sg_req.pktcnt == st->st_pktcnt) {
-		    *stnp = st->st_next;
-		    IF_DEBUG(DEBUG_CACHE) {
-			logit(LOG_DEBUG, 0, "%s() deleting (%s %s)",
-			      __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
-			      inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		    }
-		    if (st->st_ctime != 0) {
-			if (k_del_rg(st->st_origin, gt) < 0) {
-			    logit(LOG_WARNING, errno, "%s() trying to delete (%s, %s)",
-				  __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
-				  inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-			}
-			kroutes--;
-		    }
-		    free(st);
-		} else {
-		    st->st_pktcnt = sg_req.pktcnt;
-		    stnp = &st->st_next;
-		}
+		/* Send a graft to heal the tree. */
+		send_graft(gt);
 	    }
 
+	    NBRM_CLR(pt->pt_index, gt->gt_prunes);
+	    expire_prune(pt->pt_vifi, gt);
+
+	    /* remove the router's prune entry and await new one */
+	    *ptnp = pt->pt_next;
+	    free_prune(pt);
+	} else {
+	    ptnp = &pt->pt_next;
+	}
+    }
+
+    /*
+     * If the cache entry has expired, delete source table entries for
+     * silent sources.  If there are no source entries left, and there
+     * are no downstream prunes, then the entry is deleted.
+     * Otherwise, the cache entry's timer is refreshed.
+     */
+    if (CT_LEFT(gt->gt_expire) <= 0) {
+	IF_DEBUG(DEBUG_CACHE) {
+	    logit(LOG_DEBUG, 0, "(%s %s) timed out, checking for traffic",
+		  RT_FMT(gt->gt_route, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	}
+	/* Check for traffic before deleting source entries */
+	stnp = &gt->gt_srctbl;
+	while ((st = *stnp) != NULL) {
+	    unsigned long pktcnt = st->st_pktcnt;
+
 	    /*
-	     * Retain the group entry if we have downstream prunes or if
-	     * there is at least one source in the list that still has
-	     * traffic, or if our upstream prune timer or graft
-	     * retransmission timer is running.
+	     * Source entries with no ctime are not actually in the
+	     * kernel; they have been removed by rexmit_prune() so
+	     * are safe to remove from the list at this point.
 	     */
-	    if (gt->gt_pruntbl != NULL || gt->gt_srctbl != NULL ||
-		gt->gt_prsent_timer > 0 || gt->gt_grftsnt > 0) {
+	    if (st->st_ctime) {
+		if (get_sg_pktcnt(st->st_origin, gt->gt_mcastgrp, &pktcnt) < 0) {
+		    logit(LOG_WARNING, errno, "%s() Failed ioctl SIOCGETSGCNT for (%s %s)",
+			  __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
+			  inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+		    pktcnt = st->st_pktcnt;
+		}
+	    }
+
+	    if (pktcnt == st->st_pktcnt) {
+		*stnp = st->st_next;
 		IF_DEBUG(DEBUG_CACHE) {
-		    logit(LOG_DEBUG, 0, "Refresh lifetime of cache entry %s%s%s%s(%s, %s)",
-			  gt->gt_pruntbl          ? "(dstrm prunes) " : "",
-			  gt->gt_srctbl           ? "(trfc flow) "    : "",
-			  gt->gt_prsent_timer > 0 ? "(upstrm prune) " : "",
-			  gt->gt_grftsnt > 0      ? "(grft rexmit) "  : "",
-			  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+		    logit(LOG_DEBUG, 0, "%s() deleting (%s %s)",
+			  __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
+			  inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
 		}
-		gt->gt_timer = CACHE_LIFETIME(cache_lifetime);
-		if (gt->gt_prsent_timer == -1) {
-		    /*
-		     * The upstream prune timed out.  Remove any kernel
-		     * state.
-		     */
-		    gt->gt_prsent_timer = 0;
-		    if (gt->gt_pruntbl) {
-			logit(LOG_WARNING, 0, "Upstream prune for (%s %s) expires with downstream prunes active",
-			      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+		if (st->st_ctime != 0) {
+		    if (k_del_rg(st->st_origin, gt) < 0) {
+			logit(LOG_WARNING, errno, "%s() trying to delete (%s, %s)",
+			      __func__, inet_fmt(st->st_origin, s1, sizeof(s1)),
+			      inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
 		    }
-		    remove_sources(gt);
+		    kroutes--;
 		}
-		gtnptr = &gt->gt_gnext;
-		continue;
+		free_source(gt, st);
+	    } else {
+		st->st_pktcnt = pktcnt;
+		stnp = &st->st_next;
 	    }
+	}
 
+	/*
+	 * Retain the group entry if we have downstream prunes or if
+	 * there is at least one source in the list that still has
+	 * traffic, or if our upstream prune timer or graft
+	 * retransmission timer is running.
+	 */
+	if (gt->gt_pruntbl != NULL || gt->gt_srctbl != NULL ||
+	    (gt->gt_prsent && CT_LEFT(gt->gt_prsent) > 0) || gt->gt_grftsnt > 0) {
+	    IF_DEBUG(DEBUG_CACHE) {
+		logit(LOG_DEBUG, 0, "Refresh lifetime of cache entry %s%s%s%s(%s, %s)",
+		      gt->gt_pruntbl          ? "(dstrm prunes) " : "",
+		      gt->gt_srctbl           ? "(trfc flow) "    : "",
+		      gt->gt_prsent && CT_LEFT(gt->gt_prsent) > 0 ? "(upstrm prune) " : "",
+		      gt->gt_grftsnt > 0      ? "(grft rexmit) "  : "",
+		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	    }
+	    gt->gt_expire = ctclock + CACHE_LIFETIME(cache_lifetime);
+	} else {
 	    IF_DEBUG(DEBUG_CACHE){
 		logit(LOG_DEBUG, 0, "Timeout cache entry (%s, %s)",
 		      RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
@@ -1802,70 +2978,67 @@ void age_table_entry(void)
 	    if (gt->gt_next)
 		gt->gt_next->gt_prev = gt->gt_prev;
 
-	    if (gt->gt_gprev) {
-		gt->gt_gprev->gt_gnext = gt->gt_gnext;
-		gtnptr = &gt->gt_gprev->gt_gnext;
-	    } else {
-		kernel_table = gt->gt_gnext;
-		gtnptr = &kernel_table;
-	    }
-	    if (gt->gt_gnext)
-		gt->gt_gnext->gt_gprev = gt->gt_gprev;
+	    unlink_gtable(gt);
+	    unschedule_cache(gt);
 
-	    if (gt->gt_rexmit_timer > 0)
-		gt->gt_rexmit_timer = pev_timer_del(gt->gt_rexmit_timer);
+	    unschedule_rexmit(gt);
 
-	    free(gt);
-	} else {
-	    if (gt->gt_prsent_timer == -1) {
-		/*
-		 * The upstream prune timed out.  Remove any kernel
-		 * state.
-		 */
-		gt->gt_prsent_timer = 0;
-		if (gt->gt_pruntbl) {
-		    logit(LOG_WARNING, 0, "Upstream prune for (%s %s) expires with downstream prunes active",
-			  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		}
-		remove_sources(gt);
-	    }
-	    gtnptr = &gt->gt_gnext;
+	    free_gtable(gt);
+	    return;
 	}
     }
 
-    /*
-     * When traversing the no_route table, the decision is much easier.
-     * Just delete it if it has timed out.
-     */
-    gtnptr = &kernel_no_route;
-    while ((gt = *gtnptr) != NULL) {
-	/* advance the timer for the kernel entry */
-	gt->gt_timer -= TIMER_INTERVAL;
-
-	if (gt->gt_timer < 0) {
-	    if (gt->gt_srctbl) {
-		if (gt->gt_srctbl->st_ctime != 0) {
-		    if (k_del_rg(gt->gt_srctbl->st_origin, gt) < 0) {
-			logit(LOG_WARNING, errno, "age_table_entry() trying to delete no-route (%s, %s)",
-			      inet_fmt(gt->gt_srctbl->st_origin, s1, sizeof(s1)),
-			      inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
-		    }
-		    kroutes--;
-		}
-		free(gt->gt_srctbl);
-	    }
-	    *gtnptr = gt->gt_next;
-	    if (gt->gt_next)
-		gt->gt_next->gt_prev = gt->gt_prev;
+    if (gt->gt_prsent && CT_LEFT(gt->gt_prsent) <= 0) {
+	/*
+	 * The upstream prune timed out.  Remove any kernel state, on
+	 * the tick it timed out, whether the cache timer expired or not.
+	 * New traffic then causes an upcall and is pruned again if it
+	 * is still not wanted.
+	 */
+	gt->gt_prsent = 0;
+	if (gt->gt_pruntbl) {
+	    logit(LOG_WARNING, 0, "Upstream prune for (%s %s) expires with downstream prunes active",
+		  RT_FMT(r, s1), inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	}
+	remove_sources(gt);
+    }
 
-	    if (gt->gt_rexmit_timer > 0)
-		gt->gt_rexmit_timer = pev_timer_del(gt->gt_rexmit_timer);
+    schedule_cache(gt);
+}
 
-	    free(gt);
-	} else {
-	    gtnptr = &gt->gt_next;
+/*
+ * When aging the no_route table, the decision is much easier.
+ * Just delete it if it has timed out.
+ */
+static void age_no_route_entry(struct gtable *gt)
+{
+    if (CT_LEFT(gt->gt_expire) >= 0) {
+	schedule_cache(gt);
+	return;
+    }
+
+    if (gt->gt_srctbl) {
+	if (gt->gt_srctbl->st_ctime != 0) {
+	    if (k_del_rg(gt->gt_srctbl->st_origin, gt) < 0) {
+		logit(LOG_WARNING, errno, "age_table_entry() trying to delete no-route (%s, %s)",
+		      inet_fmt(gt->gt_srctbl->st_origin, s1, sizeof(s1)),
+		      inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
+	    }
+	    kroutes--;
 	}
+	pool_put(stpool, gt->gt_srctbl);
     }
+
+    if (gt->gt_prev)
+	gt->gt_prev->gt_next = gt->gt_next;
+    else
+	kernel_no_route = gt->gt_next;
+    if (gt->gt_next)
+	gt->gt_next->gt_prev = gt->gt_prev;
+
+    unschedule_rexmit(gt);
+
+    free_gtable(gt);
 }
 
 /*
@@ -1881,11 +3054,11 @@ static void expire_prune(vifi_t vifi, struct gtable *gt)
      * However, in the case that we did make a mistake,
      * send a graft to compensate.
      */
-    if (gt->gt_prsent_timer >= MIN_PRUNE_LIFE) {
+    if (gt->gt_prsent && CT_LEFT(gt->gt_prsent) >= MIN_PRUNE_LIFE) {
 	IF_DEBUG(DEBUG_PRUNE)
-	    logit(LOG_DEBUG, 0, "Prune expired with %d left on prsent_timer", gt->gt_prsent_timer);
+	    logit(LOG_DEBUG, 0, "Prune expired with %d left on prsent_timer", CT_LEFT(gt->gt_prsent));
 
-        gt->gt_prsent_timer = 0;
+        gt->gt_prsent = 0;
 	send_graft(gt);
     }
 
@@ -1910,13 +3083,15 @@ static void expire_prune(vifi_t vifi, struct gtable *gt)
 void dump_cache(FILE *fp, int detail)
 {
     struct rtentry *r;
-    struct gtable *gt;
+    struct gtable *gt, **tbl;
     struct stable *st;
     struct ptable *pt;
+    size_t j, num;
     vifi_t i;
     char c;
     time_t thyme = time(NULL);
 
+    k_flush_rg();		/* for the kernel's packet counters */
     if (detail)
 	fprintf(fp, "Multicast Routing Cache Table (%d entries)\n", kroutes);
     fprintf(fp,
@@ -1929,23 +3104,25 @@ void dump_cache(FILE *fp, int detail)
 	if (gt->gt_srctbl) {
 	    fprintf(fp, " %-18s %-15s %-8s %-8s        - -1 (no route)\n",
 		inet_fmts(gt->gt_srctbl->st_origin, 0xffffffff, s1, sizeof(s1)),
-		inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), scaletime(gt->gt_timer),
+		inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)), scaletime(cache_timer(gt)),
 		scaletime(thyme - gt->gt_ctime));
 	    fprintf(fp, ">%s\n", inet_fmt(gt->gt_srctbl->st_origin, s1, sizeof(s1)));
 	}
     }
 
-    for (gt = kernel_table; gt; gt = gt->gt_gnext) {
+    tbl = sort_kernel_table(&num);
+    for (j = 0; j < num; j++) {
+	gt = tbl[j];
 	r = gt->gt_route;
 	fprintf(fp, " %-18s %-15s",
 	    RT_FMT(r, s1),
 	    inet_fmt(gt->gt_mcastgrp, s2, sizeof(s2)));
 
-	fprintf(fp, " %-8s", scaletime(gt->gt_timer));
+	fprintf(fp, " %-8s", scaletime(cache_timer(gt)));
 
 	fprintf(fp, " %-8s %-8s ", scaletime(thyme - gt->gt_ctime),
-		gt->gt_prsent_timer
-		? scaletime(gt->gt_prsent_timer)
+		gt->gt_prsent
+		? scaletime(CT_LEFT(gt->gt_prsent))
 		: "       -");
 
 	if (gt->gt_prune_rexmit) {
@@ -1956,7 +3133,7 @@ void dump_cache(FILE *fp, int detail)
 		n++;
 		i /= 2;
 	    }
-	    if (n == 0 && gt->gt_prsent_timer == 0)
+	    if (n == 0 && gt->gt_prsent == 0)
 		fprintf(fp, " -");
 	    else
 		fprintf(fp, "%2d", n);
@@ -1965,7 +3142,7 @@ void dump_cache(FILE *fp, int detail)
 	}
 
 	fprintf(fp, " %2u%c%c", r->rt_parent,
-	    gt->gt_prsent_timer ? 'P' :
+	    gt->gt_prsent ? 'P' :
 	   			  gt->gt_grftsnt ? 'G' : ' ',
 	    VIFM_ISSET(r->rt_parent, gt->gt_scope) ? 'B' : ' ');
 
@@ -1987,7 +3164,7 @@ void dump_cache(FILE *fp, int detail)
 	    c = '(';
 	    for (pt = gt->gt_pruntbl; pt; pt = pt->pt_next) {
 		fprintf(fp, "%c%s:%d[%d]/%d", c, inet_fmt(pt->pt_router, s1, sizeof(s1)),
-		    pt->pt_vifi, pt->pt_index, pt->pt_timer);
+		    pt->pt_vifi, pt->pt_index, CT_LEFT(pt->pt_expire));
 		c = ',';
 	    }
 	    fprintf(fp, ")");
@@ -2014,6 +3191,7 @@ void dump_cache(FILE *fp, int detail)
 	    fprintf(fp, "\n");
 	}
     }
+    free(tbl);
 }
 
 /*
@@ -2232,12 +3410,7 @@ void accept_mtrace(uint32_t src, uint32_t dst, uint32_t group, char *data, uint8
     }
 
     if (gt && gt->gt_mcastgrp == group) {
-	struct stable *st;
-
-	for (st = gt->gt_srctbl; st; st = st->st_next) {
-	    if (qry->tr_src == st->st_origin)
-		break;
-	}
+	struct stable *st = find_source(gt, qry->tr_src);
 
 	sg_req.src.s_addr = qry->tr_src;
 	sg_req.grp.s_addr = group;
@@ -2248,7 +3421,7 @@ void accept_mtrace(uint32_t src, uint32_t dst, uint32_t group, char *data, uint8
 
 	if (vifi != NO_VIF && VIFM_ISSET(vifi, gt->gt_scope)) {
 	    resp->tr_rflags = TR_SCOPED;
-	} else if (gt->gt_prsent_timer) {
+	} else if (gt->gt_prsent) {
 	    resp->tr_rflags = TR_PRUNED;
 	} else if (vifi != NO_VIF && !VIFM_ISSET(vifi, gt->gt_grpmems)) {
 	    struct uvif *uv = find_uvif(vifi);
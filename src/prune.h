@@ -13,33 +13,70 @@
 /*
  * Group table
  *
+ * All timers are deadlines in forwarding cache time, which advances by
+ * TIMER_INTERVAL in age_table_entry().  Each entry is on a timing wheel
+ * slot for the earliest of them, see schedule_cache() in prune.c.
+ *
  * Each group entry is a member of two doubly-linked lists:
  *
  * a) A list hanging off of the routing table entry for this source (rt_groups)
  *	sorted by group address under the routing entry (gt_next, gt_prev)
  * b) An independent list pointed to by kernel_table, which is a list of
- *	active source,group's (gt_gnext, gt_gprev).
+ *	active source,group's (gt_gnext, gt_gprev).  All entries for the same
+ *	group are kept together, sorted by decreasing route mask and then by
+ *	origin, but the groups themselves are in no particular order.
+ *
+ * Entries on kernel_table are also indexed by a hash on (route origin,
+ * mask, group), and the first entry of each group by a hash on the group,
+ * see prune.c.  Use sort_kernel_table() when a fully sorted view is needed.
+ * They are also on a per-neighbor list for their upstream router, and
+ * prunes on a per-neighbor list for the router that sent them, so
+ * reset_neighbor_state() only visits state held for that neighbor.
+ *
+ * The source list, gt_srctbl, is sorted by origin while short.  Past
+ * SRCHASH_MIN sources it is also hashed on origin and new sources are
+ * added first in the list, sort_kernel_table() restores the order.
  *
+ * Prunes are retransmitted from a second wheel with one second slots,
+ * ticked by prune_tick(), so entries due at the same time share a tick.
  */
 struct gtable {
+    /* Used by the ageing pass, keep within the first cache line */
+    LIST_ENTRY(gtable) gt_wlink;	/* link in timing wheel slot        */
+    uint32_t	    gt_due;		/* cache time next due in wheel,
+					   0 if not scheduled		    */
+    uint32_t	    gt_expire;		/* when this group entry times out  */
+    uint32_t	    gt_prsent;		/* when prune sent upstream expires,
+					   0 if no prune sent		    */
+    uint32_t	    gt_grftbase;	/* when graft retransmission began  */
+    struct stable  *gt_srctbl;		/* source table			    */
+    struct ptable  *gt_pruntbl;		/* prune table			    */
+    struct rtentry *gt_route;		/* parent route			    */
+    uint8_t	    gt_grftsnt;		/* graft sent/retransmit timer	    */
+    uint8_t	    gt_prxmit;		/* prune for gt_prsent has gone out */
+
+    vifbitmap_t	    gt_grpmems;		/* forw. vifs for src, grp          */
+    uint32_t	    gt_mcastgrp;	/* multicast group associated       */
+    nbrbitmap_t	    gt_prunes;		/* bitmap of neighbors who pruned   */
+    uint32_t	    gt_rxdue;		/* prune rexmit check due, in rexmit
+					   wheel time, 0 if not scheduled   */
+    int		    gt_prune_rexmit;	/* time til prune retransmission    */
+    uint32_t	    gt_nsrcs;		/* number of entries in gt_srctbl   */
+    uint8_t	    gt_srcbits;		/* log2 of gt_srchash buckets       */
+    uint8_t	    gt_srcunsorted;	/* gt_srctbl not in origin order    */
+    struct stable **gt_srchash;		/* source hash, or NULL if few      */
+    struct txmsg   *gt_txmsg;		/* prune or graft queued upstream   */
     struct gtable  *gt_next;		/* pointer to the next entry	    */
     struct gtable  *gt_prev;		/* back pointer for linked list	    */
     struct gtable  *gt_gnext;		/* fwd pointer for group list	    */
     struct gtable  *gt_gprev;		/* rev pointer for group list	    */
-    uint32_t	    gt_mcastgrp;	/* multicast group associated       */
-    vifbitmap_t     gt_scope;		/* scoped interfaces                */
+    LIST_ENTRY(gtable) gt_hash;		/* link in (origin, mask, grp) hash */
+    LIST_ENTRY(gtable) gt_ghash;	/* link in group hash, if first     */
+    LIST_ENTRY(gtable) gt_nlink;	/* link in upstream neighbor list   */
+    LIST_ENTRY(gtable) gt_rxlink;	/* link in prune rexmit wheel slot  */
     uint8_t	    gt_ttls[MAXVIFS];	/* ttl vector for forwarding        */
-    vifbitmap_t	    gt_grpmems;		/* forw. vifs for src, grp          */
-    int		    gt_prsent_timer;	/* prune timer for this group	    */
-    int  	    gt_timer;		/* timer for this group entry	    */
-    time_t 	    gt_ctime;		/* time of entry creation	    */
-    uint8_t	    gt_grftsnt;		/* graft sent/retransmit timer	    */
-    nbrbitmap_t	    gt_prunes;		/* bitmap of neighbors who pruned   */
-    struct stable  *gt_srctbl;		/* source table			    */
-    struct ptable  *gt_pruntbl;		/* prune table			    */
-    struct rtentry *gt_route;		/* parent route			    */
-    int		    gt_rexmit_timer;	/* timer for prune retransmission   */
-    int		    gt_prune_rexmit;	/* time til prune retransmission    */
+    vifbitmap_t     gt_scope;		/* scoped interfaces                */
+    time_t	    gt_ctime;		/* time of entry creation	    */
 };
 
 /*
@@ -50,10 +87,14 @@ struct gtable {
 struct stable 
 {
     struct stable  *st_next;       	/* pointer to the next entry        */
+    struct stable  *st_hnext;		/* next in gt_srchash bucket        */
     uint32_t	    st_origin;		/* host origin of multicasts        */
     uint32_t	    st_pktcnt;		/* packet count for src-grp entry   */
     uint32_t	    st_savpkt;		/* saved pkt cnt when no krnl entry */
     time_t	    st_ctime;		/* kernel entry creation time	    */
+    vifi_t	    st_kparent;		/* inbound vif last sent to kernel,
+					   or NO_VIF if not in the kernel   */
+    uint8_t	    st_kttls[MAXVIFS];	/* ttl vector last sent to kernel   */
 };
 
 /*
@@ -62,10 +103,12 @@ struct stable
 struct ptable 
 {
     struct ptable  *pt_next;		/* pointer to the next entry	    */
+    LIST_ENTRY(ptable) pt_nlink;	/* link in neighbor's prune list    */
+    struct gtable  *pt_gt;		/* group entry holding this prune   */
     uint32_t	    pt_router;		/* router that sent this prune	    */
     vifi_t	    pt_vifi;		/* vif prune received on	    */
     uint32_t	    pt_index;		/* neighbor index of router	    */
-    int		    pt_timer;		/* timer for prune		    */
+    uint32_t	    pt_expire;		/* when this prune expires	    */
 };
 
 #define MIN_PRUNE_LIFE	TIMER_INTERVAL	/* min prune lifetime to bother with */
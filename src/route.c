@@ -13,6 +13,12 @@
  * Private macros.
  */
 #define MAX_NUM_RT   4096
+#define RTHASH_SIZE  4096		/* must be a power of two */
+#define RTCACHE_MIN  64		/* initial chunks per vif cache */
+#define RTCACHE_SLACK 32		/* bytes left free in new chunks */
+#define RTWHEEL_SIZE 128		/* slots of TIMER_INTERVAL, power of two */
+#define RTWHEEL_SLOT(t) (&rtwheel[((t) / TIMER_INTERVAL) & (RTWHEEL_SIZE - 1)])
+#define RTPOOL_NPER  256		/* route entries per pool slab */
 
 /*
  * Private types.
@@ -24,6 +30,52 @@ struct newrt {
     int32_t	pad;
 };
 
+/*
+ * Node in the path-compressed binary (Patricia) trie used for longest
+ * prefix match lookups by determine_route().  Keys and prefix lengths
+ * are kept in HOST order.  Nodes without a route entry are glue nodes,
+ * they only exist to join two subtrees that diverge at rn_plen.
+ */
+struct rtnode {
+    uint32_t	    rn_key;		/* prefix, masked to rn_plen bits  */
+    uint8_t	    rn_plen;		/* prefix length, 0-32             */
+    struct rtentry *rn_rt;		/* route entry, or NULL for glue   */
+    struct rtnode  *rn_parent;
+    struct rtnode  *rn_child[2];
+};
+
+/*
+ * Cached, encoded, route report chunk for a vif.  A chunk covers the
+ * routes from its start up to, but not including, its end in report
+ * order.  Both are kept as (origin, mask) so they survive the routes
+ * themselves being removed.  A chunk is invalidated when any route in
+ * its range is added, removed or changed, but is kept as a hint of
+ * where to end the rebuilt chunk.  New chunks leave RTCACHE_SLACK bytes
+ * unused, so a rebuilt chunk can take a few more routes and still end
+ * where it did, keeping the chunks after it valid.  See report_chunk().
+ */
+struct rtchunk {
+    uint32_t	    rc_origin;		/* first route in chunk            */
+    uint32_t	    rc_mask;
+    uint32_t	    rc_endorigin;	/* first route after chunk, unless */
+    uint32_t	    rc_endmask;
+    int		    rc_last;		/* ... chunk runs to end of table  */
+    int		    rc_valid;		/* 0=>only good as boundary hint   */
+    int		    rc_nrt;		/* # routes covered, incl. skipped */
+    int		    rc_datalen;
+    uint8_t	    rc_data[MAX_DVMRP_DATA_LEN];
+};
+
+/*
+ * Per-vif report cache: chunks sorted in report order, not overlapping.
+ * Grows with the number of chunks the routing table needs.
+ */
+struct rtcache {
+    struct rtchunk **rc_chunks;
+    size_t	     rc_num;
+    size_t	     rc_max;
+};
+
 struct blaster_hdr {
     uint32_t	bh_src;
     uint32_t	bh_dst;
@@ -43,16 +95,46 @@ unsigned int nroutes;			/* number of routes            */
  */
 static TAILQ_HEAD(rthead, rtentry) rtable;
 static struct rtentry *rtp;		/* pointer to a route entry    */
+static struct rtnode  *rttrie;		/* root of the LPM trie        */
+static LIST_HEAD(rthashhead, rtentry) rthash[RTHASH_SIZE];
+static TAILQ_HEAD(rtdirtyhead, rtentry) rtdirty;	/* changed routes */
+static int rtdirty_sorted;		/* 1=>rtdirty in report order  */
+static struct rtentry *rtcursor;	/* next route report_next_chunk() */
+static struct rtcache rtcache[MAXVIFS];	/* per-vif report cache    */
+static uint32_t rtclock;		/* route time, in seconds          */
+static TAILQ_HEAD(rtwheelhead, rtentry) rtwheel[RTWHEEL_SIZE];
+static struct pool *rtpool;		/* route entries, incl. dominants  */
 
 /*
  * Private functions.
  */
 static int  init_children_and_leaves (struct rtentry *r, vifi_t parent, int first);
 static int  find_route               (uint32_t origin, uint32_t mask);
+static int  merge_route              (uint32_t origin, uint32_t mask);
+static struct rtentry *hash_route    (uint32_t origin, uint32_t mask);
 static void create_route             (uint32_t origin, uint32_t mask);
 static void discard_route            (struct rtentry *rt);
+static void mark_route_changed       (struct rtentry *rt);
+static int  compare_changed          (const void *p1, const void *p2);
+static void sort_changed_routes      (void);
+static int  trie_insert              (struct rtentry *rt);
+static void trie_remove              (struct rtentry *rt);
 static int  compare_rts              (const void *rt1, const void *rt2);
-static struct rtentry *report_chunk  (int, struct rtentry *, vifi_t, uint32_t, int *);
+static void sort_rts                 (struct newrt *rt, size_t nrt);
+static void update_route_at          (int found, uint32_t origin, uint32_t mask, uint32_t metric,
+				      uint32_t src, vifi_t vifi, struct listaddr *n);
+static struct rtentry *report_chunk  (int, struct rtentry *, vifi_t, uint32_t, int, int *);
+static int  route_cmp                (uint32_t o1, uint32_t m1, uint32_t o2, uint32_t m2);
+static size_t chunk_find             (struct rtcache *c, uint32_t origin, uint32_t mask);
+static struct rtchunk *chunk_lookup  (vifi_t vifi, struct rtentry *rt, struct rtentry **next,
+				      struct rtchunk **hint);
+static void chunk_store              (vifi_t vifi, struct rtentry *rt, struct rtentry *next,
+				      int nrt, uint8_t *data, int datalen);
+static void chunk_invalidate         (struct rtentry *rt);
+static void chunk_flush              (void);
+static int  route_filter             (struct rtentry *r, vifi_t vifi, struct uvif *uv);
+static void route_schedule           (struct rtentry *r, uint32_t when);
+static void route_set_timer          (struct rtentry *r, uint32_t timer);
 static void queue_blaster_report     (vifi_t vifi, uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t level);
 static void process_blaster_report   (int id, void *vifip);
 
@@ -62,7 +144,18 @@ static void process_blaster_report   (int id, void *vifip);
  */
 void init_routes(void)
 {
+    size_t i;
+
     TAILQ_INIT(&rtable);
+    TAILQ_INIT(&rtdirty);
+    rtdirty_sorted	 = TRUE;
+    rtcursor		 = NULL;
+    for (i = 0; i < RTHASH_SIZE; i++)
+	LIST_INIT(&rthash[i]);
+    for (i = 0; i < RTWHEEL_SIZE; i++)
+	TAILQ_INIT(&rtwheel[i]);
+    rtclock		 = 0;
+    rttrie		 = NULL;
     nroutes		 = 0;
     routes_changed       = FALSE;
     delay_change_reports = FALSE;
@@ -120,6 +213,7 @@ void add_vif_to_routes(vifi_t vifi)
     struct uvif *uv;
 
     uv = find_uvif(vifi);
+    chunk_flush();		/* drop all cached reports */
     TAILQ_FOREACH(r, &rtable, rt_link) {
 	if (r->rt_metric != UNREACHABLE && !VIFM_ISSET(vifi, r->rt_children)) {
 	    VIFM_SET(vifi, r->rt_children);
@@ -143,14 +237,14 @@ void delete_vif_from_routes(vifi_t vifi)
     struct uvif *uv;
 
     uv = find_uvif(vifi);
+    chunk_flush();		/* drop all cached reports */
     TAILQ_FOREACH(r, &rtable, rt_link) {
 	if (r->rt_metric != UNREACHABLE) {
 	    if (vifi == r->rt_parent) {
 		del_table_entry(r, 0, DEL_ALL_ROUTES);
-		r->rt_timer    = ROUTE_EXPIRE_TIME;
+		route_set_timer(r, ROUTE_EXPIRE_TIME);
 		r->rt_metric   = UNREACHABLE;
-		r->rt_flags   |= RTF_CHANGED;
-		routes_changed = TRUE;
+		mark_route_changed(r);
 	    } else if (VIFM_ISSET(vifi, r->rt_children)) {
 		VIFM_CLR(vifi, r->rt_children);
 		NBRM_CLRMASK(r->rt_subordinates, uv->uv_nbrmap);
@@ -202,10 +296,9 @@ void delete_neighbor_from_routes(uint32_t addr, vifi_t vifi, uint32_t index)
 	if (r->rt_metric != UNREACHABLE) {
 	    if (r->rt_parent == vifi && r->rt_gateway == addr) {
 		del_table_entry(r, 0, DEL_ALL_ROUTES);
-		r->rt_timer    = ROUTE_EXPIRE_TIME;
+		route_set_timer(r, ROUTE_EXPIRE_TIME);
 		r->rt_metric   = UNREACHABLE;
-		r->rt_flags   |= RTF_CHANGED;
-		routes_changed = TRUE;
+		mark_route_changed(r);
 	    } else if (r->rt_dominants[vifi] == addr) {
 		VIFM_SET(vifi, r->rt_children);
 		r->rt_dominants[vifi] = 0;
@@ -241,24 +334,99 @@ void start_route_updates(void)
 }
 
 
+static size_t rthash_idx(uint32_t origin, uint32_t mask)
+{
+    uint32_t key = ntohl(origin) ^ ntohl(mask);
+
+    return ((key * 2654435761U) >> 20) & (RTHASH_SIZE - 1);
+}
+
 /*
- * Starting at the route entry following the one to which 'rtp' points,
- * look for a route entry matching the specified origin and mask.  If a
+ * Look up the route entry for the specified origin and mask in the
+ * auxiliary hash table.  Returns NULL if there is no such entry.
+ */
+static struct rtentry *hash_route(uint32_t origin, uint32_t mask)
+{
+    struct rtentry *r;
+
+    LIST_FOREACH(r, &rthash[rthash_idx(origin, mask)], rt_hash) {
+	if (r->rt_origin == origin && r->rt_originmask == mask)
+	    return r;
+    }
+
+    return NULL;
+}
+
+/*
+ * Look for a route entry matching the specified origin and mask.  If a
  * match is found, return TRUE and leave 'rtp' pointing at the found entry.
  * If no match is found, return FALSE and leave 'rtp' pointing to the route
  * entry preceding the point at which the new origin should be inserted.
- * This code is optimized for the normal case in which the first entry to
- * be examined is the matching entry.
+ *
+ * This code is optimized for the normal case in which the entry 'rtp'
+ * points to, or the one following it, is the matching entry.  When the
+ * cursor misses, e.g. for scattered partial reports, the hash table is
+ * used instead.  Only when inserting a new origin do we need to walk the
+ * table, from the cursor if possible, otherwise from the start.
  */
 static int find_route(uint32_t origin, uint32_t mask)
 {
     struct rtentry *r;
+    int i;
 
     /*
      * If rtp is NULL, we are preceding rtable, so our first search
      * candidate should be the rtable.
      */
     r = rtp ? rtp : TAILQ_FIRST(&rtable);
+    for (i = 0; r && i < 2; i++, r = TAILQ_NEXT(r, rt_link)) {
+	if (origin == r->rt_origin && mask == r->rt_originmask) {
+	    rtp = r;
+	    return TRUE;
+	}
+    }
+
+    r = hash_route(origin, mask);
+    if (r) {
+	rtp = r;
+	return TRUE;
+    }
+
+    /*
+     * Not found, locate the insertion point.  If the cursor is already
+     * past it we have to start over from the head of the table.
+     */
+    if (rtp && !(ntohl(mask) < ntohl(rtp->rt_originmask) ||
+		 (mask == rtp->rt_originmask &&
+		  ntohl(origin) < ntohl(rtp->rt_origin))))
+	rtp = NULL;
+
+    r = rtp ? TAILQ_NEXT(rtp, rt_link) : TAILQ_FIRST(&rtable);
+    while (r != NULL) {
+	if (ntohl(mask) < ntohl(r->rt_originmask) ||
+	    (mask == r->rt_originmask &&
+	     ntohl(origin) < ntohl(r->rt_origin))) {
+	    rtp = r;
+	    r = TAILQ_NEXT(r, rt_link);
+	} else
+	    break;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Merge step for a sorted batch of route updates, see accept_report().
+ * Like find_route(), but since both the batch and the routing table are
+ * in the same order we only ever need to advance 'rtp' forward from the
+ * previous update.  A full report is thus merged into the table in one
+ * linear walk.
+ */
+static int merge_route(uint32_t origin, uint32_t mask)
+{
+    struct rtentry *r;
+
+    r = rtp ? TAILQ_NEXT(rtp, rt_link) : TAILQ_FIRST(&rtable);
     while (r != NULL) {
 	if (origin == r->rt_origin && mask == r->rt_originmask) {
 	    rtp = r;
@@ -290,16 +458,23 @@ static void create_route(uint32_t origin, uint32_t mask)
 {
     struct rtentry *rt;
 
-    rt = calloc(1, sizeof(struct rtentry));
-    if (!rt) {
-	logit(LOG_ERR, errno, "Failed allocating 'struct rtentry' in %s:%s()", __FILE__, __func__);
-	return;
+    /*
+     * The dominants array is stored inline, so the entry size depends
+     * on numvifs.  The pool is (re)created on the first route after
+     * init_vifs(), when numvifs is known and stays fixed until restart.
+     */
+    if (!rtpool) {
+	rtpool = pool_create("routes", sizeof(struct rtentry) + numvifs * sizeof(uint32_t),
+			     RTPOOL_NPER, 0);
+	if (!rtpool) {
+	    logit(LOG_ERR, errno, "Failed allocating route pool in %s:%s()", __FILE__, __func__);
+	    return;
+	}
     }
 
-    rt->rt_dominants = calloc(1, numvifs * sizeof(uint32_t));
-    if (!rt->rt_dominants) {
-	free(rt);
-	logit(LOG_ERR, errno, "Failed allocating 'rt_dominants' in %s:%s()", __FILE__, __func__);
+    rt = pool_get(rtpool);
+    if (!rt) {
+	logit(LOG_ERR, errno, "Failed allocating 'struct rtentry' in %s:%s()", __FILE__, __func__);
 	return;
     }
 
@@ -313,13 +488,26 @@ static void create_route(uint32_t origin, uint32_t mask)
     rt->rt_groups = NULL;
 
     VIFM_CLRALL(rt->rt_children);
+    VIFM_CLRALL(rt->rt_filtvalid);
     NBRM_CLRALL(rt->rt_subordinates);
     NBRM_CLRALL(rt->rt_subordadv);
 
+    if (trie_insert(rt)) {
+	pool_put(rtpool, rt);
+	logit(LOG_ERR, errno, "Failed allocating 'struct rtnode' in %s:%s()", __FILE__, __func__);
+	return;
+    }
+
     if (rtp)
 	TAILQ_INSERT_AFTER(&rtable, rtp, rt, rt_link);
     else
 	TAILQ_INSERT_HEAD(&rtable, rt, rt_link);
+    LIST_INSERT_HEAD(&rthash[rthash_idx(origin, mask)], rt, rt_hash);
+    chunk_invalidate(rt);
+
+    rt->rt_tstamp = rtclock;
+    rt->rt_expire = rtclock + ROUTE_EXPIRE_TIME;
+    TAILQ_INSERT_TAIL(RTWHEEL_SLOT(rt->rt_expire), rt, rt_wlink);
 
     rtp = rt;
     ++nroutes;
@@ -340,8 +528,16 @@ static void discard_route(struct rtentry *rt)
     /* Update meta pointers */
     if (rtp == rt)
 	rtp = TAILQ_NEXT(rt, rt_link);
+    if (rtcursor == rt)
+	rtcursor = TAILQ_PREV(rt, rthead, rt_link);
 
     TAILQ_REMOVE(&rtable, rt, rt_link);
+    LIST_REMOVE(rt, rt_hash);
+    if (rt->rt_flags & RTF_CHANGED)
+	TAILQ_REMOVE(&rtdirty, rt, rt_dirty);
+    TAILQ_REMOVE(RTWHEEL_SLOT(rt->rt_expire), rt, rt_wlink);
+    chunk_invalidate(rt);
+    trie_remove(rt);
 
     /* Update the books */
     uv = find_uvif(rt->rt_parent);
@@ -349,8 +545,243 @@ static void discard_route(struct rtentry *rt)
     /*???nbr???.al_nroutes--;*/
     --nroutes;
 
-    free(rt->rt_dominants);
-    free(rt);
+    pool_put(rtpool, rt);
+}
+
+
+/*
+ * Flag route entry 'rt' as changed, to be included in the next triggered
+ * update.  Changed routes are also kept on the rtdirty list, so sending
+ * those updates and clearing the flags is O(changed) rather than a walk
+ * of the whole routing table.  The cached report chunks covering the
+ * route are invalidated as it goes on the list.
+ */
+static void mark_route_changed(struct rtentry *rt)
+{
+    chunk_invalidate(rt);
+    if (!(rt->rt_flags & RTF_CHANGED)) {
+	rt->rt_flags |= RTF_CHANGED;
+	TAILQ_INSERT_TAIL(&rtdirty, rt, rt_dirty);
+	rtdirty_sorted = FALSE;
+    }
+    routes_changed = TRUE;
+}
+
+/*
+ * Compare two routes in report order, which is the reverse of table
+ * order, see report(): increasing mask, then increasing origin.
+ */
+static int route_cmp(uint32_t o1, uint32_t m1, uint32_t o2, uint32_t m2)
+{
+    uint32_t v1, v2;
+
+    v1 = ntohl(m1);
+    v2 = ntohl(m2);
+    if (v1 == v2) {
+	v1 = ntohl(o1);
+	v2 = ntohl(o2);
+    }
+
+    if (v1 < v2)
+	return -1;
+    if (v1 > v2)
+	return 1;
+
+    return 0;
+}
+
+static int compare_changed(const void *p1, const void *p2)
+{
+    const struct rtentry *r1 = *(const struct rtentry **)p1;
+    const struct rtentry *r2 = *(const struct rtentry **)p2;
+
+    return route_cmp(r1->rt_origin, r1->rt_originmask, r2->rt_origin, r2->rt_originmask);
+}
+
+/*
+ * Put the list of changed routes in report order, i.e., increasing
+ * mask and origin, so it can be encoded as compactly as a full report.
+ */
+static void sort_changed_routes(void)
+{
+    struct rtentry **arr, *r;
+    size_t i, num = 0;
+
+    if (rtdirty_sorted)
+	return;
+
+    TAILQ_FOREACH(r, &rtdirty, rt_dirty)
+	num++;
+
+    arr = malloc(num * sizeof(*arr));
+    if (!arr) {
+	logit(LOG_ERR, errno, "Failed sorting changed routes in %s:%s()", __FILE__, __func__);
+	return;			/* Unsorted is still correct, only bigger */
+    }
+
+    i = 0;
+    TAILQ_FOREACH(r, &rtdirty, rt_dirty)
+	arr[i++] = r;
+    qsort(arr, num, sizeof(*arr), compare_changed);
+
+    TAILQ_INIT(&rtdirty);
+    for (i = 0; i < num; i++)
+	TAILQ_INSERT_TAIL(&rtdirty, arr[i], rt_dirty);
+
+    free(arr);
+    rtdirty_sorted = TRUE;
+}
+
+/*
+ * Helpers for the LPM trie.  Bit 0 is the most significant bit of the
+ * (host order) key, so a prefix of length 'len' is tested by bit 'len'.
+ */
+static uint32_t trie_mask(int len)
+{
+    return len ? 0xffffffffU << (32 - len) : 0;
+}
+
+static int trie_bit(uint32_t key, int pos)
+{
+    return (key >> (31 - pos)) & 1;
+}
+
+static int trie_plen(uint32_t mask)
+{
+    uint32_t m = ntohl(mask);
+    int len = 0;
+
+    while (m & 0x80000000U) {
+	m <<= 1;
+	len++;
+    }
+
+    return len;
+}
+
+static struct rtnode *trie_node(uint32_t key, int plen, struct rtentry *rt)
+{
+    struct rtnode *rn;
+
+    rn = calloc(1, sizeof(struct rtnode));
+    if (!rn)
+	return NULL;
+
+    rn->rn_key  = key & trie_mask(plen);
+    rn->rn_plen = plen;
+    rn->rn_rt   = rt;
+
+    return rn;
+}
+
+/* Hook 'rn' into the slot of 'parent' where 'old' used to be. */
+static void trie_replace(struct rtnode *parent, struct rtnode *old, struct rtnode *rn)
+{
+    if (rn)
+	rn->rn_parent = parent;
+
+    if (!parent)
+	rttrie = rn;
+    else if (parent->rn_child[0] == old)
+	parent->rn_child[0] = rn;
+    else
+	parent->rn_child[1] = rn;
+}
+
+/*
+ * Link route entry 'rt' into the LPM trie.  Returns non-zero, with errno
+ * set, if a new trie node could not be allocated.
+ */
+static int trie_insert(struct rtentry *rt)
+{
+    struct rtnode *rn, *parent = NULL, *n, *glue;
+    uint32_t key = ntohl(rt->rt_origin);
+    int plen = trie_plen(rt->rt_originmask);
+    int common, i;
+
+    rn = rttrie;
+    while (rn && rn->rn_plen <= plen && (key & trie_mask(rn->rn_plen)) == rn->rn_key) {
+	if (rn->rn_plen == plen) {
+	    rn->rn_rt = rt;	/* glue node becomes a real one */
+	    return 0;
+	}
+	parent = rn;
+	rn = rn->rn_child[trie_bit(key, rn->rn_plen)];
+    }
+
+    n = trie_node(key, plen, rt);
+    if (!n)
+	return 1;
+
+    if (!rn) {
+	n->rn_parent = parent;
+	if (parent)
+	    parent->rn_child[trie_bit(key, parent->rn_plen)] = n;
+	else
+	    rttrie = n;
+	return 0;
+    }
+
+    /* Find where the new prefix and the existing subtree diverge */
+    common = plen < rn->rn_plen ? plen : rn->rn_plen;
+    for (i = 0; i < common; i++) {
+	if (trie_bit(key, i) != trie_bit(rn->rn_key, i)) {
+	    common = i;
+	    break;
+	}
+    }
+
+    if (common == plen) {
+	/* New prefix covers the existing subtree */
+	trie_replace(parent, rn, n);
+	n->rn_child[trie_bit(rn->rn_key, plen)] = rn;
+	rn->rn_parent = n;
+	return 0;
+    }
+
+    glue = trie_node(key, common, NULL);
+    if (!glue) {
+	free(n);
+	return 1;
+    }
+
+    trie_replace(parent, rn, glue);
+    glue->rn_child[trie_bit(key, common)] = n;
+    glue->rn_child[trie_bit(rn->rn_key, common)] = rn;
+    n->rn_parent  = glue;
+    rn->rn_parent = glue;
+
+    return 0;
+}
+
+/*
+ * Unlink route entry 'rt' from the LPM trie, pruning any node and glue
+ * that is no longer needed to keep the trie path compressed.
+ */
+static void trie_remove(struct rtentry *rt)
+{
+    struct rtnode *rn, *parent, *child;
+    uint32_t key = ntohl(rt->rt_origin);
+    int plen = trie_plen(rt->rt_originmask);
+
+    rn = rttrie;
+    while (rn && rn->rn_plen < plen)
+	rn = rn->rn_child[trie_bit(key, rn->rn_plen)];
+    if (!rn || rn->rn_rt != rt)
+	return;
+
+    rn->rn_rt = NULL;
+    while (rn && !rn->rn_rt) {
+	if (rn->rn_child[0] && rn->rn_child[1])
+	    break;		/* still needed as glue */
+
+	parent = rn->rn_parent;
+	child  = rn->rn_child[0] ? rn->rn_child[0] : rn->rn_child[1];
+	trie_replace(parent, rn, child);
+	free(rn);
+
+	rn = parent;
+    }
 }
 
 
@@ -361,6 +792,17 @@ static void discard_route(struct rtentry *rt)
  * to indicate a change of status of one of our own interfaces.
  */
 void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src, vifi_t vifi, struct listaddr *n)
+{
+    update_route_at(find_route(origin, mask), origin, mask, metric, src, vifi, n);
+}
+
+/*
+ * The guts of update_route(), 'found' is the result of looking up the
+ * origin with find_route() or merge_route(), i.e., 'rtp' points either
+ * to the matching entry or to the entry after which to insert it.
+ */
+static void update_route_at(int found, uint32_t origin, uint32_t mask, uint32_t metric,
+			    uint32_t src, vifi_t vifi, struct listaddr *n)
 {
     uint32_t adj_metric;
     struct rtentry *r;
@@ -382,9 +824,9 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
     if (adj_metric > UNREACHABLE) adj_metric = UNREACHABLE;
 
     /*
-     * Look up the reported origin in the routing table.
+     * Did we find the reported origin in the routing table?
      */
-    if (!find_route(origin, mask)) {
+    if (!found) {
 	/*
 	 * Not found.
 	 * Don't create a new entry if the report says it's unreachable,
@@ -452,10 +894,9 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
 	r->rt_gateway  = src;
 	init_children_and_leaves(r, vifi, 1);
 
-	r->rt_timer    = 0;
+	route_set_timer(r, 0);
 	r->rt_metric   = adj_metric;
-	r->rt_flags   |= RTF_CHANGED;
-	routes_changed = TRUE;
+	mark_route_changed(r);
 	update_table_entry(r, r->rt_gateway);
     } else if (src == r->rt_gateway) {
 	/*
@@ -466,7 +907,7 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
 	 * the route timer and, if the reported metric has changed, update
 	 * our entry accordingly.
 	 */
-	r->rt_timer = 0;
+	route_set_timer(r, 0);
 
 	IF_DEBUG(DEBUG_RTDETAIL) {
 	    logit(LOG_DEBUG, 0, "%s (current parent) advertises %s with adj_metric %d (ours was %d)",
@@ -479,17 +920,16 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
 
 	if (adj_metric == UNREACHABLE) {
 	    del_table_entry(r, 0, DEL_ALL_ROUTES);
-	    r->rt_timer = ROUTE_EXPIRE_TIME;
+	    route_set_timer(r, ROUTE_EXPIRE_TIME);
 	}
 	r->rt_metric   = adj_metric;
-	r->rt_flags   |= RTF_CHANGED;
-	routes_changed = TRUE;
+	mark_route_changed(r);
     } else if (src == 0 ||
 	       (r->rt_gateway != 0 &&
 		(adj_metric < r->rt_metric ||
 		 (adj_metric == r->rt_metric &&
 		  (ntohl(src) < ntohl(r->rt_gateway) ||
-		   r->rt_timer >= ROUTE_SWITCH_TIME))))) {
+		   route_timer(r) >= ROUTE_SWITCH_TIME))))) {
 	/*
 	 * The report is for an origin we consider reachable; the report
 	 * comes either from one of our own interfaces or from a gateway
@@ -531,10 +971,9 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
 	    /*???old_gateway???->al_nroutes--;*/
 	    /*n->al_nroutes++;*/
 	}
-	r->rt_timer    = 0;
+	route_set_timer(r, 0);
 	r->rt_metric   = adj_metric;
-	r->rt_flags   |= RTF_CHANGED;
-	routes_changed = TRUE;
+	mark_route_changed(r);
     } else if (vifi != r->rt_parent) {
 	/*
 	 * The report came from a vif other than the route's parent vif.
@@ -650,21 +1089,68 @@ void update_route(uint32_t origin, uint32_t mask, uint32_t metric, uint32_t src,
 
 
 /*
- * On every timer interrupt, advance the timer in each routing entry.
+ * Seconds since the route was last refreshed, i.e., the route timer.
+ */
+uint32_t route_timer(struct rtentry *r)
+{
+    return rtclock - r->rt_tstamp;
+}
+
+/*
+ * Move route 'r' to the timing wheel slot for route time 'when', or the
+ * next tick if 'when' has already passed.  Routes are only ever due at
+ * most ROUTE_DISCARD_TIME ahead, which fits in one turn of the wheel, but
+ * age_routes() checks rt_expire anyway so longer timeouts also work.
+ */
+static void route_schedule(struct rtentry *r, uint32_t when)
+{
+    if ((int32_t)(when - rtclock) <= 0)
+	when = rtclock + TIMER_INTERVAL;
+
+    TAILQ_REMOVE(RTWHEEL_SLOT(r->rt_expire), r, rt_wlink);
+    r->rt_expire = when;
+    TAILQ_INSERT_TAIL(RTWHEEL_SLOT(when), r, rt_wlink);
+}
+
+/*
+ * Set the route timer, the route is then next due when it would expire.
+ * If it is already unreachable by then age_routes() will reschedule it
+ * to when it is due for garbage collection.
+ */
+static void route_set_timer(struct rtentry *r, uint32_t timer)
+{
+    r->rt_tstamp = rtclock - timer;
+    route_schedule(r, r->rt_tstamp + ROUTE_EXPIRE_TIME);
+}
+
+/*
+ * On every timer interrupt, advance the route time and handle the routes
+ * that are due for expiry or garbage collection.  Only the routes in the
+ * current slot of the timing wheel are visited, except for every second
+ * report interval when subordinateness is timed out in all routes.
  */
 void age_routes(void)
 {
     extern uint32_t virtual_time;		/* from main.c */
+    struct rtwheelhead *slot;
     struct rtentry *r, *tmp;
+    uint32_t timer;
+
+    rtclock += TIMER_INTERVAL;
+
+    slot = RTWHEEL_SLOT(rtclock);
+    TAILQ_FOREACH_SAFE(r, slot, rt_wlink, tmp) {
+	if ((int32_t)(r->rt_expire - rtclock) > 0)
+	    continue;		/* Not yet, next turn of the wheel */
 
-    TAILQ_FOREACH_SAFE(r, &rtable, rt_link, tmp) {
-	if ((r->rt_timer += TIMER_INTERVAL) >= ROUTE_DISCARD_TIME) {
+	timer = route_timer(r);
+	if (timer >= ROUTE_DISCARD_TIME) {
 	    /*
 	     * Time to garbage-collect the route entry.
 	     */
 	    del_table_entry(r, 0, DEL_ALL_ROUTES);
 	    discard_route(r);
-	} else if (r->rt_timer >= ROUTE_EXPIRE_TIME &&
+	} else if (timer >= ROUTE_EXPIRE_TIME &&
 		 r->rt_metric != UNREACHABLE) {
 	    /*
 	     * Time to expire the route entry.  If the gateway is zero,
@@ -673,29 +1159,39 @@ void age_routes(void)
 	     * the interface to the subnet goes down.
 	     */
 	    if (r->rt_gateway == 0) {
-		r->rt_timer = 0;
+		route_set_timer(r, 0);
 	    } else {
 		del_table_entry(r, 0, DEL_ALL_ROUTES);
 		r->rt_metric   = UNREACHABLE;
-		r->rt_flags   |= RTF_CHANGED;
-		routes_changed = TRUE;
+		mark_route_changed(r);
+		route_schedule(r, r->rt_tstamp + ROUTE_DISCARD_TIME);
 	    }
-	} else if (virtual_time > 0 && (virtual_time % (ROUTE_REPORT_INTERVAL * 2) == 0)) {
-	    /*
-	     * Time out subordinateness that hasn't been reported in
-	     * the last 2 intervals.
-	     */
-	    if (!NBRM_SAME(r->rt_subordinates, r->rt_subordadv)) {
-		IF_DEBUG(DEBUG_ROUTE) {
-		    logit(LOG_DEBUG, 0, "rt %s sub 0x%08x%08x subadv 0x%08x%08x metric %d",
-			  RT_FMT(r, s1), r->rt_subordinates.hi, r->rt_subordinates.lo,
-			  r->rt_subordadv.hi, r->rt_subordadv.lo, r->rt_metric);
-		}
-		NBRM_MASK(r->rt_subordinates, r->rt_subordadv);
-		update_table_entry(r, r->rt_gateway);
+	} else if (timer >= ROUTE_EXPIRE_TIME) {
+	    /* Already unreachable, garbage-collect it later */
+	    route_schedule(r, r->rt_tstamp + ROUTE_DISCARD_TIME);
+	} else {
+	    route_schedule(r, r->rt_tstamp + ROUTE_EXPIRE_TIME);
+	}
+    }
+
+    if (virtual_time == 0 || (virtual_time % (ROUTE_REPORT_INTERVAL * 2) != 0))
+	return;
+
+    TAILQ_FOREACH(r, &rtable, rt_link) {
+	/*
+	 * Time out subordinateness that hasn't been reported in
+	 * the last 2 intervals.
+	 */
+	if (!NBRM_SAME(r->rt_subordinates, r->rt_subordadv)) {
+	    IF_DEBUG(DEBUG_ROUTE) {
+		logit(LOG_DEBUG, 0, "rt %s sub 0x%08x%08x subadv 0x%08x%08x metric %d",
+		      RT_FMT(r, s1), r->rt_subordinates.hi, r->rt_subordinates.lo,
+		      r->rt_subordadv.hi, r->rt_subordadv.lo, r->rt_metric);
 	    }
-	    NBRM_CLRALL(r->rt_subordadv);
+	    NBRM_MASK(r->rt_subordinates, r->rt_subordadv);
+	    update_table_entry(r, r->rt_gateway);
 	}
+	NBRM_CLRALL(r->rt_subordadv);
     }
 }
 
@@ -714,8 +1210,7 @@ void expire_all_routes(void)
 
     TAILQ_FOREACH(r, &rtable, rt_link) {
 	r->rt_metric   = UNREACHABLE;
-	r->rt_flags   |= RTF_CHANGED;
-	routes_changed = TRUE;
+	mark_route_changed(r);
     }
 }
 
@@ -729,6 +1224,10 @@ void free_all_routes(void)
 
     TAILQ_FOREACH_SAFE(r, &rtable, rt_link, tmp)
 	discard_route(r);
+    chunk_flush();
+
+    pool_destroy(rtpool);
+    rtpool = NULL;
 }
 
 
@@ -772,6 +1271,40 @@ static int compare_rts(const void *rt1, const void *rt2)
     return 0;
 }
 
+/*
+ * Sort route report entries in routing table order.  Reports from other
+ * mrouted are already sorted, in the opposite order, since report() walks
+ * the table backwards, so check for that before falling back to qsort().
+ */
+static void sort_rts(struct newrt *rt, size_t nrt)
+{
+    size_t i, asc = 0, desc = 0;
+
+    for (i = 1; i < nrt; i++) {
+	int rc = compare_rts(&rt[i - 1], &rt[i]);
+
+	if (rc > 0)
+	    asc++;
+	else if (rc < 0)
+	    desc++;
+    }
+
+    if (asc == 0)
+	return;
+
+    if (desc == 0) {
+	for (i = 0; i < nrt / 2; i++) {
+	    struct newrt tmp = rt[i];
+
+	    rt[i] = rt[nrt - 1 - i];
+	    rt[nrt - 1 - i] = tmp;
+	}
+	return;
+    }
+
+    qsort(rt, nrt, sizeof(rt[0]), compare_rts);
+}
+
 /*
  * Queue a route report from a route-blaster.
  * If the timer isn't running to process these reports,
@@ -881,7 +1414,8 @@ static void process_blaster_report(int id, void *vifip)
  */
 void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t level)
 {
-    static struct newrt rt[MAX_NUM_RT]; /* Use heap instead of stack */ /* XXX: fixme */
+    static struct newrt *rt = NULL;	/* Scratch buffer, grown as needed */
+    static size_t rtlen = 0;
     struct listaddr *nbr;
     struct uvif *uv;
     uint32_t origin;
@@ -889,15 +1423,9 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
     size_t width, i;
     size_t nrt = 0;
     vifi_t vifi;
+    size_t max;
     int metric;
 
-    /*
-     * Emulate a stack variable.  We use the heap insted of the stack
-     * to prevent stack overflow on systems that cannot do stack realloc
-     * at runtime, e.g., non-MMU Linux systems.
-     */
-    memset(rt, 0, MAX_NUM_RT * sizeof(rt[0]));
-
     if ((vifi = find_vif_direct(src, dst)) == NO_VIF) {
 	logit(LOG_INFO, 0, "Ignoring route report from non-neighbor %s",
 	      inet_fmt(src, s1, sizeof(s1)));
@@ -924,7 +1452,27 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
 	return;
     }
 
-    while (datalen > 0  && nrt < MAX_NUM_RT) { /* Loop through per-mask lists. */
+    /*
+     * Each route takes at least two bytes, origin and metric.  We use
+     * the heap instead of the stack to prevent stack overflow on systems
+     * that cannot do stack realloc at runtime, e.g., non-MMU Linux.
+     */
+    max = datalen / 2;
+    if (max > MAX_NUM_RT)
+	max = MAX_NUM_RT;
+    if (rtlen < max) {
+	struct newrt *tmp;
+
+	tmp = realloc(rt, max * sizeof(rt[0]));
+	if (!tmp) {
+	    logit(LOG_ERR, errno, "Failed allocating route report buffer in %s:%s()", __FILE__, __func__);
+	    return;
+	}
+	rt    = tmp;
+	rtlen = max;
+    }
+
+    while (datalen > 0  && nrt < max) { /* Loop through per-mask lists. */
 	if (datalen < 3) {
 	    logit(LOG_WARNING, 0, "Received truncated route report from %s", 
 		  inet_fmt(src, s1, sizeof(s1)));
@@ -957,10 +1505,10 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
 	    rt[nrt].origin = origin;
 	    rt[nrt].metric = (metric & 0x7f);
 	    ++nrt;
-	} while (!(metric & 0x80) && nrt < MAX_NUM_RT);
+	} while (!(metric & 0x80) && nrt < max);
     }
 
-    qsort((char *)rt, nrt, sizeof(rt[0]), compare_rts);
+    sort_rts(rt, nrt);
     start_route_updates();
 
     /*
@@ -975,32 +1523,31 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
     }
 
     for (i = 0; i < nrt; ++i) {
+	int found;
+
 	if (i > 0 && rt[i].origin == rt[i - 1].origin && rt[i].mask == rt[i - 1].mask) {
 	    logit(LOG_WARNING, 0, "%s reports duplicate route for %s",
                   inet_fmt(src, s1, sizeof(s1)), inet_fmts(rt[i].origin, rt[i].mask, s2, sizeof(s2)));
 	    continue;
 	}
+
+	found = merge_route(rt[i].origin, rt[i].mask);
+
 	/* Only filter non-poisoned updates. */
 	if (uv->uv_filter && rt[i].metric < UNREACHABLE) {
-	    struct vf_element *vfe;
-	    int match = 0;
-
-	    for (vfe = uv->uv_filter->vf_filter; vfe; vfe = vfe->vfe_next) {
-		if (vfe->vfe_flags & VFEF_EXACT) {
-		    if ((vfe->vfe_addr == rt[i].origin) && (vfe->vfe_mask == rt[i].mask)) {
-			match = 1;
-			break;
-		    }
-		} else {
-		    if ((rt[i].origin & vfe->vfe_mask) == vfe->vfe_addr) {
-			match = 1;
-			break;
-		    }
-		}
-	    }
+	    struct vf_element *vfe = NULL;
+	    int match;
+
+	    if (found)
+		match = route_filter(rtp, vifi, uv);
+	    else
+		match = vif_filter_match(uv->uv_filter, rt[i].origin, rt[i].mask, &vfe);
+
 	    if ((uv->uv_filter->vf_type == VFT_ACCEPT && match == 0) ||
 		(uv->uv_filter->vf_type == VFT_DENY && match == 1)) {
 		IF_DEBUG(DEBUG_ROUTE) {
+		    if (match && !vfe)
+			vif_filter_match(uv->uv_filter, rt[i].origin, rt[i].mask, &vfe);
 		    logit(LOG_DEBUG, 0, "%s skipped on vif %d because it %s %s",
 			  inet_fmts(rt[i].origin, rt[i].mask, s1, sizeof(s1)),
 			  vifi, match ? "matches" : "doesn't match",
@@ -1014,7 +1561,7 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
 		    rt[i].metric = UNREACHABLE;
 	    }
 	}
-	update_route(rt[i].origin, rt[i].mask, rt[i].metric, src, vifi, nbr);
+	update_route_at(found, rt[i].origin, rt[i].mask, rt[i].metric, src, vifi, nbr);
     }
 
     if (routes_changed && !delay_change_reports)
@@ -1028,11 +1575,17 @@ void accept_report(uint32_t src, uint32_t dst, char *p, size_t datalen, uint32_t
  */
 void report(int type, vifi_t vifi, uint32_t dst)
 {
-    struct rtentry *rt = TAILQ_LAST(&rtable, rthead);
+    struct rtentry *rt;
     int dummy;
 
+    if (type == CHANGED_ROUTES) {
+	sort_changed_routes();
+	rt = TAILQ_FIRST(&rtdirty);
+    } else
+	rt = TAILQ_LAST(&rtable, rthead);
+
     while (rt)
-	rt = report_chunk(type, rt, vifi, dst, &dummy);
+	rt = report_chunk(type, rt, vifi, dst, 0, &dummy);
 }
 
 
@@ -1043,7 +1596,7 @@ void report(int type, vifi_t vifi, uint32_t dst)
 void report_to_all_neighbors(int type)
 {
     int routes_changed_before;
-    struct rtentry *r;
+    struct rtentry *r, *tmp;
     struct uvif *uv;
     vifi_t vifi;
 
@@ -1067,8 +1620,10 @@ void report_to_all_neighbors(int type)
      * generated at the next timer interrupt.
      */
     if (routes_changed_before && !routes_changed) {
-	TAILQ_FOREACH(r, &rtable, rt_link)
+	TAILQ_FOREACH_SAFE(r, &rtdirty, rt_dirty, tmp)
 	    r->rt_flags &= ~RTF_CHANGED;
+	TAILQ_INIT(&rtdirty);
+	rtdirty_sorted = TRUE;
     }
 
     /*
@@ -1078,19 +1633,44 @@ void report_to_all_neighbors(int type)
     delay_change_reports = TRUE;
 }
 
+/*
+ * Check if route 'r' matches the filter of vif 'vifi'.  The verdict is
+ * cached in the route entry.  Since filters only change when the config
+ * is reloaded, which also flushes all routes, it remains valid for the
+ * lifetime of the route.
+ */
+static int route_filter(struct rtentry *r, vifi_t vifi, struct uvif *uv)
+{
+    if (!VIFM_ISSET(vifi, r->rt_filtvalid)) {
+	if (vif_filter_match(uv->uv_filter, r->rt_origin, r->rt_originmask, NULL))
+	    VIFM_SET(vifi, r->rt_filtmatch);
+	else
+	    VIFM_CLR(vifi, r->rt_filtmatch);
+	VIFM_SET(vifi, r->rt_filtvalid);
+    }
+
+    return VIFM_ISSET(vifi, r->rt_filtmatch) ? 1 : 0;
+}
+
 /*
  * Send a route report message to destination 'dst', via virtual interface
- * 'vifi'.  'type' specifies ALL_ROUTES or CHANGED_ROUTES.
+ * 'vifi'.  'type' specifies ALL_ROUTES or CHANGED_ROUTES.  For the former
+ * 'rt' is a position in the routing table, which is walked backwards, for
+ * the latter it is a position in the (sorted) list of changed routes.
+ * If 'max' is non-zero the message covers at most that many routes.
  */
-static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, uint32_t dst, int *nrt)
+static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, uint32_t dst,
+				    int max, int *nrt)
 {
+    struct rtchunk *hint = NULL;
     struct rtentry *r;
     struct uvif *uv;
     uint32_t mask = 0;
+    int room = MAX_DVMRP_DATA_LEN;
     int datalen = 0;
     int width = 0;
     int admetric;
-    uint8_t *p;
+    uint8_t *data, *p;
     int metric;
     int i;
 
@@ -1100,13 +1680,37 @@ static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, u
 	return NULL;
     admetric = uv->uv_admetric;
 
-    p = send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN;
+    p = data = send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN;
 
-    for (r = rt; r != TAILQ_END(&rtable); r = TAILQ_PREV(r, rthead, rt_link)) {
-	if (type == CHANGED_ROUTES && !(r->rt_flags & RTF_CHANGED)) {
-	    (*nrt)++;
-	    continue;
+    if (type == ALL_ROUTES) {
+	struct rtchunk *rc;
+	struct rtentry *next;
+
+	rc = chunk_lookup(vifi, rt, &next, &hint);
+	if (rc && (!max || rc->rc_nrt <= max)) {
+	    memcpy(p, rc->rc_data, rc->rc_datalen);
+	    *nrt = rc->rc_nrt;
+	    if (rc->rc_datalen != 0)
+		send_on_vif(uv, 0, DVMRP_REPORT, rc->rc_datalen);
+
+	    return next;
 	}
+	if (!hint)
+	    room -= RTCACHE_SLACK;
+    }
+
+    for (r = rt; r; r = (type == CHANGED_ROUTES)
+		 ? TAILQ_NEXT(r, rt_dirty)
+		 : TAILQ_PREV(r, rthead, rt_link)) {
+	/*
+	 * When rebuilding a chunk, end it where it ended before, if it
+	 * fits, so the chunks after it stay valid.
+	 */
+	if (hint && !hint->rc_last &&
+	    route_cmp(r->rt_origin, r->rt_originmask, hint->rc_endorigin, hint->rc_endmask) >= 0)
+	    break;
+	if (max && *nrt >= max)
+	    break;
 
 	/*
 	 * Do not poison-reverse a route for a directly-connected
@@ -1119,29 +1723,14 @@ static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, u
 	}
 
 	if (uv->uv_filter && uv->uv_filter->vf_flags & VFF_BIDIR) {
-	    struct vf_element *vfe;
-	    int match = 0;
-
-	    for (vfe = uv->uv_filter->vf_filter; vfe; vfe = vfe->vfe_next) {
-		if (vfe->vfe_flags & VFEF_EXACT) {
-		    if ((vfe->vfe_addr == r->rt_origin) &&
-			(vfe->vfe_mask == r->rt_originmask)) {
-			    match = 1;
-			    break;
-		    }
-
-		    continue;
-		}
-
-		if ((r->rt_origin & vfe->vfe_mask) == vfe->vfe_addr) {
-		    match = 1;
-		    break;
-		}
-	    }
+	    int match = route_filter(r, vifi, uv);
 
 	    if ((uv->uv_filter->vf_type == VFT_ACCEPT && match == 0) ||
 		(uv->uv_filter->vf_type == VFT_DENY   && match == 1)) {
 		IF_DEBUG(DEBUG_ROUTE) {
+		    struct vf_element *vfe;
+
+		    vif_filter_match(uv->uv_filter, r->rt_origin, r->rt_originmask, &vfe);
 		    logit(LOG_DEBUG, 0, "%s not reported on vif %d because it %s %s",
 			  RT_FMT(r, s1), vifi,
 			  (match
@@ -1162,8 +1751,10 @@ static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, u
 	 */
 	if (datalen + ((r->rt_originmask == mask)
 		       ? (width + 1)
-		       : (r->rt_originwidth + 4)) > MAX_DVMRP_DATA_LEN) {
+		       : (r->rt_originwidth + 4)) > room) {
 	    *(p-1) |= 0x80;
+	    if (type == ALL_ROUTES)
+		chunk_store(vifi, rt, r, *nrt, data, datalen);
 	    send_on_vif(uv, 0, DVMRP_REPORT, datalen);
 
 	    return r;
@@ -1198,24 +1789,216 @@ static struct rtentry *report_chunk(int type, struct rtentry *rt, vifi_t vifi, u
 	datalen += width + 1;
     }
 
-    if (datalen != 0) {
+    if (datalen != 0)
 	*(p-1) |= 0x80;
+    if (type == ALL_ROUTES)
+	chunk_store(vifi, rt, r, *nrt, data, datalen);
+    if (datalen != 0)
 	send_on_vif(uv, 0, DVMRP_REPORT, datalen);
-    }
 
     return r;
 }
 
+/*
+ * Index of the first chunk in 'c' starting at or after (origin, mask)
+ */
+static size_t chunk_find(struct rtcache *c, uint32_t origin, uint32_t mask)
+{
+    size_t lo = 0, hi = c->rc_num;
+
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	struct rtchunk *rc = c->rc_chunks[mid];
+
+	if (route_cmp(rc->rc_origin, rc->rc_mask, origin, mask) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Find a valid cached report chunk for vif 'vifi' starting at route 'rt',
+ * and the route following it in '*next'.  Otherwise '*hint' is set to
+ * the chunk whose end the new chunk should stop at: the invalidated one
+ * starting at 'rt', or the first one after 'rt' when chunk boundaries
+ * have shifted.
+ */
+static struct rtchunk *chunk_lookup(vifi_t vifi, struct rtentry *rt, struct rtentry **next,
+				    struct rtchunk **hint)
+{
+    struct rtcache *c = &rtcache[vifi];
+    struct rtchunk *rc;
+    size_t i;
+
+    *hint = NULL;
+    i = chunk_find(c, rt->rt_origin, rt->rt_originmask);
+    if (i == c->rc_num)
+	return NULL;
+
+    rc = c->rc_chunks[i];
+    if (rc->rc_origin != rt->rt_origin || rc->rc_mask != rt->rt_originmask) {
+	*hint = rc;
+	return NULL;
+    }
+
+    if (rc->rc_valid) {
+	if (rc->rc_last) {
+	    *next = NULL;
+	    return rc;
+	}
+
+	/* Removing that route invalidates the next chunk, not this */
+	*next = hash_route(rc->rc_endorigin, rc->rc_endmask);
+	if (*next)
+	    return rc;
+    }
+
+    *hint = rc;
+    return NULL;
+}
+
+/*
+ * Save an encoded report chunk for vif 'vifi', covering the routes from
+ * 'rt' up to 'next', replacing any chunks overlapping it.  Failing to
+ * allocate is not an error, we just don't cache the chunk.
+ */
+static void chunk_store(vifi_t vifi, struct rtentry *rt, struct rtentry *next,
+			int nrt, uint8_t *data, int datalen)
+{
+    struct rtcache *c = &rtcache[vifi];
+    struct rtchunk *rc = NULL;
+    size_t i, j;
+
+    i = chunk_find(c, rt->rt_origin, rt->rt_originmask);
+    if (i > 0) {
+	struct rtchunk *prev = c->rc_chunks[i - 1];
+
+	/* Previous chunk overlaps the start of this one, drop it */
+	if (prev->rc_last || route_cmp(prev->rc_endorigin, prev->rc_endmask,
+				       rt->rt_origin, rt->rt_originmask) > 0)
+	    i--;
+    }
+
+    for (j = i; j < c->rc_num; j++) {
+	struct rtchunk *old = c->rc_chunks[j];
+
+	if (next && route_cmp(old->rc_origin, old->rc_mask,
+			      next->rt_origin, next->rt_originmask) >= 0)
+	    break;
+	if (rc)
+	    free(old);
+	else
+	    rc = old;		/* Reuse the first one replaced */
+    }
+
+    if (!rc) {
+	if (c->rc_num == c->rc_max) {
+	    size_t max = c->rc_max ? 2 * c->rc_max : RTCACHE_MIN;
+	    struct rtchunk **arr;
+
+	    arr = realloc(c->rc_chunks, max * sizeof(*arr));
+	    if (!arr)
+		return;
+	    c->rc_chunks = arr;
+	    c->rc_max    = max;
+	}
+
+	rc = malloc(sizeof(struct rtchunk));
+	if (!rc)
+	    return;
+
+	memmove(&c->rc_chunks[i + 1], &c->rc_chunks[i], (c->rc_num - i) * sizeof(rc));
+	c->rc_num++;
+    } else if (j > i + 1) {
+	memmove(&c->rc_chunks[i + 1], &c->rc_chunks[j], (c->rc_num - j) * sizeof(rc));
+	c->rc_num -= j - i - 1;
+    }
+    c->rc_chunks[i] = rc;
+
+    rc->rc_origin    = rt->rt_origin;
+    rc->rc_mask      = rt->rt_originmask;
+    rc->rc_last      = next ? 0 : 1;
+    rc->rc_endorigin = next ? next->rt_origin : 0;
+    rc->rc_endmask   = next ? next->rt_originmask : 0;
+    rc->rc_valid     = 1;
+    rc->rc_nrt       = nrt;
+    rc->rc_datalen   = datalen;
+    memcpy(rc->rc_data, data, datalen);
+}
+
+/*
+ * Invalidate the cached report chunk covering route 'rt' on each vif.
+ * Called when the route is added, removed or changed.
+ */
+static void chunk_invalidate(struct rtentry *rt)
+{
+    vifi_t vifi;
+
+    for (vifi = 0; vifi < MAXVIFS; vifi++) {
+	struct rtcache *c = &rtcache[vifi];
+	struct rtchunk *rc;
+	size_t i;
+
+	if (!c->rc_num)
+	    continue;
+
+	i = chunk_find(c, rt->rt_origin, rt->rt_originmask);
+	if (i < c->rc_num) {
+	    rc = c->rc_chunks[i];
+	    if (rc->rc_origin == rt->rt_origin && rc->rc_mask == rt->rt_originmask) {
+		rc->rc_valid = 0;
+		continue;
+	    }
+	}
+	if (i == 0)
+	    continue;
+
+	rc = c->rc_chunks[i - 1];
+	if (rc->rc_last || route_cmp(rt->rt_origin, rt->rt_originmask,
+				     rc->rc_endorigin, rc->rc_endmask) < 0)
+	    rc->rc_valid = 0;
+    }
+}
+
+/*
+ * Drop all cached report chunks, called when the routing table is freed
+ * or vifs come and go.
+ */
+static void chunk_flush(void)
+{
+    vifi_t vifi;
+    size_t i;
+
+    for (vifi = 0; vifi < MAXVIFS; vifi++) {
+	struct rtcache *c = &rtcache[vifi];
+
+	for (i = 0; i < c->rc_num; i++)
+	    free(c->rc_chunks[i]);
+	free(c->rc_chunks);
+	memset(c, 0, sizeof(*c));
+    }
+}
+
 /*
  * send the next chunk of our routing table to all neighbors.
  * return the length of the smallest chunk we sent out.
+ *
+ * The position in the table is kept in 'rtcursor', which discard_route()
+ * moves along when the route it points to is removed, so we only touch
+ * the routes we actually send.  A NULL cursor means start over from the
+ * end of the table.
  */
 int report_next_chunk(void)
 {
-    static int start_rt = 0;
-    struct rtentry *sr;
+    struct rtchunk *rc, *hint;
+    struct rtentry *sr, *next;
     struct uvif *uv;
+    vifi_t cached[MAXVIFS];
     int min = 20000;
+    int num = 0;
     vifi_t vifi;
     int n = 0;
     int i;
@@ -1226,34 +2009,54 @@ int report_next_chunk(void)
     /*
      * find this round's starting route.
      */
-    i = start_rt;
-    TAILQ_FOREACH_REVERSE(sr, &rtable, rthead, rt_link) {
-	if (--i < 0)
-	    break;
-    }
+    if (!rtcursor)
+	rtcursor = TAILQ_LAST(&rtable, rthead);
+    sr = rtcursor;
 
     /*
      * send one chunk of routes starting at this round's start to
-     * all our neighbors.
+     * all our neighbors.  All vifs send the same number of routes,
+     * the smallest chunk, so they stay aligned with their cached
+     * chunks.  Vifs with a cached chunk go last, they only need to
+     * be rebuilt if another vif's chunk turns out to be smaller.
      */
     UVIF_FOREACH(vifi, uv) {
-	/* sr might turn up NULL above ... */
-	if (sr && !NBRM_ISEMPTY(uv->uv_nbrmap)) {
-	    report_chunk(ALL_ROUTES, sr, vifi, uv->uv_dst_addr, &n);
-	    if (n < min)
-		min = n;
+	if (NBRM_ISEMPTY(uv->uv_nbrmap))
+	    continue;
+
+	rc = chunk_lookup(vifi, sr, &next, &hint);
+	if (rc) {
+	    if (rc->rc_nrt < min)
+		min = rc->rc_nrt;
+	    cached[num++] = vifi;
+	    continue;
 	}
+
+	report_chunk(ALL_ROUTES, sr, vifi, uv->uv_dst_addr, min, &n);
+	if (n < min)
+	    min = n;
+    }
+    for (i = 0; i < num; i++) {
+	uv = find_uvif(cached[i]);
+	report_chunk(ALL_ROUTES, sr, cached[i], uv->uv_dst_addr, min, &n);
     }
     if (min == 20000)
 	min = 0;	/* Neighborless router didn't send any routes */
 
     n = min;
     IF_DEBUG(DEBUG_ROUTE) {
-	logit(LOG_INFO, 0, "update %d starting at %d of %d",
-	      n, (nroutes - start_rt), nroutes);
+	logit(LOG_INFO, 0, "update %d starting at %s of %d",
+	      n, RT_FMT(sr, s1), nroutes);
     }
 
-    start_rt = (start_rt + n) % nroutes;
+    /*
+     * advance the cursor past the routes sent, wrapping around
+     */
+    for (i = 0; i < n; i++) {
+	rtcursor = TAILQ_PREV(rtcursor, rthead, rt_link);
+	if (!rtcursor)
+	    rtcursor = TAILQ_LAST(&rtable, rthead);
+    }
 
     return n;
 }
@@ -1282,7 +2085,7 @@ void dump_routes(FILE *fp, int detail)
 	else
 	    fprintf(fp, "%4u ", r->rt_metric);
 
-	fprintf(fp, "  %3u %c%c %3u   ", r->rt_timer,
+	fprintf(fp, "  %3u %c%c %3u   ", route_timer(r),
 		(r->rt_flags & RTF_CHANGED) ? 'C' : '.',
 		(r->rt_flags & RTF_HOLDDOWN) ? 'H' : '.',
 		r->rt_parent);
@@ -1317,14 +2120,24 @@ void dump_routes(FILE *fp, int detail)
     fprintf(fp, "\n");
 }
 
+/*
+ * Find the longest prefix match for 'src' among the reachable routes,
+ * walking the LPM trie from the root.  Unreachable routes are skipped,
+ * so a shorter reachable covering route may be returned instead.
+ */
 struct rtentry *determine_route(uint32_t src)
 {
-    struct rtentry *rt;
-
-    TAILQ_FOREACH(rt, &rtable, rt_link) {
-	if (rt->rt_origin == (src & rt->rt_originmask) &&
-	    rt->rt_metric != UNREACHABLE) 
+    struct rtentry *rt = NULL;
+    struct rtnode *rn;
+    uint32_t key = ntohl(src);
+
+    rn = rttrie;
+    while (rn && (key & trie_mask(rn->rn_plen)) == rn->rn_key) {
+	if (rn->rn_rt && rn->rn_rt->rt_metric != UNREACHABLE)
+	    rt = rn->rn_rt;
+	if (rn->rn_plen == 32)
 	    break;
+	rn = rn->rn_child[trie_bit(key, rn->rn_plen)];
     }
 
     return rt;
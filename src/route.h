@@ -23,12 +23,21 @@
  * full or partial, for processing received full reports, for clearing the
  * CHANGED flags, and for periodically advancing the timers in all routes.
  * It is not so efficient for updating a small number of routes in response
- * to a partial report.  In a stable topology, the latter are rare; if they
- * turn out to be costing a lot, we can add an auxiliary hash table for
- * faster access to arbitrary route entries.
+ * to a partial report, so an auxiliary hash table on (origin, mask) is
+ * used for faster access to arbitrary route entries.
+ *
+ * RPF lookups, i.e. determine_route(), use a path-compressed binary trie
+ * kept alongside the list, see route.c, to find the longest matching and
+ * reachable origin in O(prefix length) time.
+ *
+ * Entries are allocated from a pool, with the per-vif dominants array
+ * stored inline at the end, so all routes are the same size and mostly
+ * laid out next to each other in memory.
  */
 struct rtentry {
     TAILQ_ENTRY(rtentry) rt_link;	/* link to next/prev vif            */
+    LIST_ENTRY(rtentry)  rt_hash;	/* link in (origin, mask) hash      */
+    TAILQ_ENTRY(rtentry) rt_dirty;	/* link in list of changed routes   */
     uint32_t	     rt_origin;		/* subnet origin of multicasts      */
     uint32_t	     rt_originmask;	/* subnet mask for origin           */
     uint16_t	     rt_originwidth;	/* # bytes of origin subnet number  */
@@ -37,14 +46,18 @@ struct rtentry {
     uint32_t	     rt_gateway;	/* first-hop gateway back to origin */
     vifi_t	     rt_parent;	    	/* incoming vif (ie towards origin) */
     vifbitmap_t	     rt_children;	/* outgoing children vifs           */
-    uint32_t	    *rt_dominants;      /* per vif dominant gateways        */
     nbrbitmap_t	     rt_subordinates;   /* bitmap of subordinate gateways   */
     nbrbitmap_t	     rt_subordadv;      /* recently advertised subordinates */
-    uint32_t	     rt_timer;		/* for timing out the route entry   */
+    vifbitmap_t	     rt_filtvalid;	/* vifs with a cached filter verdict */
+    vifbitmap_t	     rt_filtmatch;	/* vifs where the vif filter matches */
+    uint32_t	     rt_tstamp;		/* rtclock when route_timer() was 0 */
+    uint32_t	     rt_expire;		/* rtclock when next due in rtwheel */
+    TAILQ_ENTRY(rtentry) rt_wlink;	/* link in rtwheel slot             */
     struct gtable   *rt_groups;		/* link to active groups 	    */
+    uint32_t	     rt_dominants[];	/* per vif dominant gateways        */
 };
 
-#define	RTF_CHANGED	0x01		/* route changed but not reported   */
+#define	RTF_CHANGED	0x01		/* route changed, on rt_dirty list  */
 #define	RTF_HOLDDOWN	0x04		/* this route is in holddown	    */
 
 #define ALL_ROUTES	0		/* possible arguments to report()   */
@@ -230,6 +230,142 @@ void blaster_free(struct uvif *uv)
 	uv->uv_blastertimer = pev_timer_del(uv->uv_blastertimer);
 }
 
+static void vf_node_free(struct vf_node *n)
+{
+    if (!n)
+	return;
+
+    vf_node_free(n->vfn_child[0]);
+    vf_node_free(n->vfn_child[1]);
+    free(n);
+}
+
+/*
+ * Compile the list of filter elements into a binary trie, walked by
+ * vif_filter_match() in at most 32 steps regardless of the number of
+ * elements.  Returns non-zero if out of memory, then the filter is left
+ * uncompiled and vif_filter_match() falls back to the list.
+ */
+int vif_filter_compile(struct vif_filter *vf)
+{
+    struct vf_element *vfe;
+    struct vf_node *n;
+    int idx = 0;
+
+    vf_node_free(vf->vf_trie);
+    vf->vf_trie = NULL;
+
+    for (vfe = vf->vf_filter; vfe; vfe = vfe->vfe_next, idx++) {
+	uint32_t addr = ntohl(vfe->vfe_addr);
+	uint32_t mask = ntohl(vfe->vfe_mask);
+	struct vf_node **np = &vf->vf_trie;
+	int i;
+
+	/*
+	 * A prefix with host bits set can never match, neither can an
+	 * exact element since route origins never have host bits set.
+	 */
+	if (addr & ~mask)
+	    continue;
+
+	for (i = 0; ; i++) {
+	    if (!*np) {
+		*np = calloc(1, sizeof(struct vf_node));
+		if (!*np) {
+		    logit(LOG_ERR, errno, "Failed compiling filter, using slow path");
+		    vf_node_free(vf->vf_trie);
+		    vf->vf_trie = NULL;
+		    return 1;
+		}
+	    }
+	    n = *np;
+
+	    if (i == 32 || !(mask & (0x80000000U >> i)))
+		break;
+	    np = &n->vfn_child[(addr >> (31 - i)) & 1];
+	}
+
+	/* Only the first element in the list for each prefix matters */
+	if (vfe->vfe_flags & VFEF_EXACT) {
+	    if (!n->vfn_exact) {
+		n->vfn_exact = vfe;
+		n->vfn_eidx  = idx;
+	    }
+	} else if (!n->vfn_prefix) {
+	    n->vfn_prefix = vfe;
+	    n->vfn_pidx   = idx;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Check if route 'origin' and 'mask' matches filter 'vf'.  Like a walk of
+ * the element list, the first matching element is returned in 'match'.
+ */
+int vif_filter_match(struct vif_filter *vf, uint32_t origin, uint32_t mask, struct vf_element **match)
+{
+    struct vf_element *vfe, *found = NULL;
+    uint32_t addr = ntohl(origin);
+    struct vf_node *n;
+    int idx = -1;
+    int i;
+
+    if (!vf->vf_trie) {
+	for (vfe = vf->vf_filter; vfe; vfe = vfe->vfe_next) {
+	    if (vfe->vfe_flags & VFEF_EXACT) {
+		if (vfe->vfe_addr == origin && vfe->vfe_mask == mask)
+		    break;
+	    } else if ((origin & vfe->vfe_mask) == vfe->vfe_addr)
+		break;
+	}
+	found = vfe;
+	goto done;
+    }
+
+    for (n = vf->vf_trie, i = 0; n; i++) {
+	if (n->vfn_prefix && (idx < 0 || n->vfn_pidx < idx)) {
+	    found = n->vfn_prefix;
+	    idx   = n->vfn_pidx;
+	}
+
+	vfe = n->vfn_exact;
+	if (vfe && (idx < 0 || n->vfn_eidx < idx) &&
+	    vfe->vfe_addr == origin && vfe->vfe_mask == mask) {
+	    found = vfe;
+	    idx   = n->vfn_eidx;
+	}
+
+	if (i == 32)
+	    break;
+	n = n->vfn_child[(addr >> (31 - i)) & 1];
+    }
+
+done:
+    if (match)
+	*match = found;
+
+    return found != NULL;
+}
+
+void vif_filter_free(struct vif_filter *vf)
+{
+    struct vf_element *vfe;
+
+    if (!vf)
+	return;
+
+    while (vf->vf_filter) {
+	vfe = vf->vf_filter;
+	vf->vf_filter = vfe->vfe_next;
+	free(vfe);
+    }
+
+    vf_node_free(vf->vf_trie);
+    free(vf);
+}
+
 /*
  * Start routing on all virtual interfaces that are not down or
  * administratively disabled.
@@ -696,6 +832,9 @@ void stop_all_vifs(void)
 	}
 	uv->uv_addrs = NULL;
 
+	vif_filter_free(uv->uv_filter);
+	uv->uv_filter = NULL;
+
 	blaster_free(uv);
 	free(uv);
     }
@@ -1906,7 +2045,7 @@ struct listaddr *update_neighbor(vifi_t vifi, uint32_t addr, int msgtype, char *
 			neighbor_vifs--;
 		}
 		delete_neighbor_from_routes(addr, vifi, n->al_index);
-		reset_neighbor_state(vifi, addr);
+		reset_neighbor_state(vifi, addr, n->al_index);
 		logit(LOG_WARNING, 0, "Peering with %s on vif %u is one-way",
 		      inet_fmt(addr, s1, sizeof(s1)), vifi);
 		n->al_flags |= NBRF_ONEWAY;
@@ -1924,7 +2063,7 @@ struct listaddr *update_neighbor(vifi_t vifi, uint32_t addr, int msgtype, char *
 	/* check "leaf" flag */
     }
     if (do_reset) {
-	reset_neighbor_state(vifi, addr);
+	reset_neighbor_state(vifi, addr, n->al_index);
 	if (!send_tables)
 	    send_tables = addr;
     }
@@ -1985,7 +2124,7 @@ void age_vifs(void)
 	    TAILQ_REMOVE(&uv->uv_neighbors, a, al_link);
 
 	    delete_neighbor_from_routes(a->al_addr, vifi, a->al_index);
-	    reset_neighbor_state(vifi, a->al_addr);
+	    reset_neighbor_state(vifi, a->al_addr, a->al_index);
 
 	    if (NBRM_ISEMPTY(uv->uv_nbrmap))
 		neighbor_vifs--;
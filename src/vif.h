@@ -189,6 +189,7 @@ struct vif_filter {
     int			vf_flags;
 #define	VFF_BIDIR	1
     struct vf_element  *vf_filter;
+    struct vf_node     *vf_trie;	/* vf_filter compiled, for lookups */
 };
 
 struct vf_element {
@@ -199,6 +200,19 @@ struct vf_element {
 #define	VFEF_EXACT	0x0001
 };
 
+/*
+ * Binary trie node of a compiled filter.  Each node holds the first
+ * element, in list order, for the prefix it represents, both for prefix
+ * matches and for exact matches.  See vif_filter_compile().
+ */
+struct vf_node {
+    struct vf_node     *vfn_child[2];
+    struct vf_element  *vfn_prefix;	/* prefix match element, or NULL   */
+    struct vf_element  *vfn_exact;	/* exact match element, or NULL    */
+    int			vfn_pidx;	/* list position of vfn_prefix     */
+    int			vfn_eidx;	/* list position of vfn_exact      */
+};
+
 struct listaddr {
     TAILQ_ENTRY(listaddr) al_link;	/* link to next/prev addr           */
     uint32_t	     al_addr;		/* local group or neighbor address  */
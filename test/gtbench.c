@@ -0,0 +1,265 @@
+/* This is free and unencumbered software released into the public domain. */
+
+/*
+ * Benchmark of the forwarding cache ageing pass, the per-entry cost of
+ * walking a timing wheel slot like age_table_entry() does, for struct
+ * gtable as in prune.h, with the fields of the pass first, and for the
+ * older layout where they were spread over the whole entry.
+ *
+ * Entries come from pools like in prune.c and are linked in random
+ * order, as after some churn.  Nothing expires, so each visit is the
+ * common case of age_cache_entry(): read the timers, pointers and
+ * membership and scope bitmaps, then reschedule.
+ *
+ * Usage: gtbench [ENTRIES ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "defs.h"
+
+#define NPER		256		/* like CACHE_POOL_NPER in prune.c */
+#define ROUNDS		5
+
+/* Older struct gtable, ft_foo is gt_foo */
+struct gtfat {
+	struct gtfat   *ft_next;
+	struct gtfat   *ft_prev;
+	struct gtfat   *ft_gnext;
+	struct gtfat   *ft_gprev;
+	LIST_ENTRY(gtfat) ft_hash;
+	LIST_ENTRY(gtfat) ft_ghash;
+	uint32_t	ft_mcastgrp;
+	vifbitmap_t	ft_scope;
+	uint8_t		ft_ttls[MAXVIFS];
+	vifbitmap_t	ft_grpmems;
+	uint32_t	ft_prsent;
+	uint32_t	ft_expire;
+	time_t		ft_ctime;
+	uint8_t		ft_grftsnt;
+	uint32_t	ft_grftbase;
+	uint32_t	ft_due;
+	LIST_ENTRY(gtfat) ft_wlink;
+	LIST_ENTRY(gtfat) ft_nlink;
+	nbrbitmap_t	ft_prunes;
+	struct stable  *ft_srctbl;
+	struct ptable  *ft_pruntbl;
+	struct rtentry *ft_route;
+	int		ft_rexmit_timer;
+	int		ft_prune_rexmit;
+};
+
+LIST_HEAD(fatslot, gtfat);
+LIST_HEAD(slot, gtable);
+
+static struct rtentry route;		/* shared, always cached */
+static uint32_t now = 1000;
+static volatile uintptr_t sink;		/* keeps the reads */
+
+static void *xget(struct pool *p)
+{
+	void *obj;
+
+	obj = pool_get(p);
+	if (!obj) {
+		perror("pool_get");
+		exit(1);
+	}
+
+	return obj;
+}
+
+/* Random permutation of 0..n-1 */
+static size_t *shuffle(size_t n)
+{
+	unsigned int seed = 1;
+	size_t *idx, i;
+
+	idx = malloc(n * sizeof(*idx));
+	if (!idx) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++)
+		idx[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		size_t j, tmp;
+
+		seed = seed * 1103515245 + 12345;
+		j = ((size_t)seed << 15 ^ seed >> 16) % (i + 1);
+		tmp = idx[i];
+		idx[i] = idx[j];
+		idx[j] = tmp;
+	}
+
+	return idx;
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+/*
+ * The fields age_table_entry() and age_cache_entry() read when nothing
+ * has expired, and the earliest deadline, as in schedule_cache().  The
+ * entry is put back in the same slot, for the next walk to visit it.
+ */
+#define AGE(gt, pfx)							\
+	do {								\
+		uint32_t when = gt->pfx##_expire;			\
+									\
+		if (gt->pfx##_due != now)				\
+			break;						\
+		if (gt->pfx##_route && !VIFM_ISEMPTY(gt->pfx##_grpmems)) \
+			sum += (uintptr_t)gt->pfx##_srctbl;		\
+		else							\
+			sum += gt->pfx##_scope;				\
+		if (gt->pfx##_prsent && gt->pfx##_prsent < when)	\
+			when = gt->pfx##_prsent;			\
+		if (gt->pfx##_grftsnt && gt->pfx##_grftbase < when)	\
+			when = gt->pfx##_grftbase;			\
+		if (gt->pfx##_pruntbl)					\
+			sum++;						\
+		sum += when;						\
+		gt->pfx##_due = now;					\
+		num++;							\
+	} while (0)
+
+static size_t walk_fat(struct fatslot *head)
+{
+	struct gtfat *gt;
+	size_t num = 0;
+	uintptr_t sum = 0;
+
+	LIST_FOREACH(gt, head, ft_wlink)
+		AGE(gt, ft);
+
+	sink += sum;
+	return num;
+}
+
+static size_t walk(struct slot *head)
+{
+	struct gtable *gt;
+	size_t num = 0;
+	uintptr_t sum = 0;
+
+	LIST_FOREACH(gt, head, gt_wlink)
+		AGE(gt, gt);
+
+	sink += sum;
+	return num;
+}
+
+/* Best of ROUNDS, each at least ~50 msec, in nsec per entry */
+#define TIME(walk, head, n, best)					\
+	do {								\
+		int r;							\
+									\
+		best = 1e9;						\
+		for (r = 0; r < ROUNDS; r++) {				\
+			struct timespec t0;				\
+			size_t loops = 0, num = 0;			\
+			double ns;					\
+									\
+			clock_gettime(CLOCK_MONOTONIC, &t0);		\
+			do {						\
+				num += walk(head);			\
+				loops++;				\
+			} while (num < 5000000 || loops < 2);		\
+			ns = elapsed(&t0) / num;			\
+			if (num != loops * n)				\
+				fprintf(stderr, "visited %zu of %zu\n", num, loops * n); \
+			if (ns < best)					\
+				best = ns;				\
+		}							\
+	} while (0)
+
+static void bench(size_t n)
+{
+	struct pool *fpool, *gpool;
+	struct gtfat **fat;
+	struct gtable **gt;
+	struct fatslot fhead;
+	struct slot head;
+	double tfat, tgt;
+	size_t *idx, i;
+
+	fpool = pool_create("fat", sizeof(struct gtfat), NPER, 0);
+	gpool = pool_create("groups", sizeof(struct gtable), NPER, 0);
+	fat = malloc(n * sizeof(*fat));
+	gt = malloc(n * sizeof(*gt));
+	if (!fpool || !gpool || !fat || !gt) {
+		perror("alloc");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		fat[i] = xget(fpool);
+		gt[i] = xget(gpool);
+
+		fat[i]->ft_route = gt[i]->gt_route = &route;
+		fat[i]->ft_expire = gt[i]->gt_expire = now + 100;
+		fat[i]->ft_due = gt[i]->gt_due = now;
+	}
+
+	LIST_INIT(&fhead);
+	LIST_INIT(&head);
+	idx = shuffle(n);
+	for (i = 0; i < n; i++) {
+		LIST_INSERT_HEAD(&fhead, fat[idx[i]], ft_wlink);
+		LIST_INSERT_HEAD(&head, gt[idx[i]], gt_wlink);
+	}
+
+	TIME(walk_fat, &fhead, n, tfat);
+	TIME(walk, &head, n, tgt);
+
+	printf("%9zu %10.2f %10.2f\n", n, tfat, tgt);
+
+	free(idx);
+	free(gt);
+	free(fat);
+	pool_destroy(gpool);
+	pool_destroy(fpool);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t def[] = { 1000, 10000, 100000, 1000000 };
+	int i;
+
+	printf("struct gtable %zu bytes, older layout %zu bytes\n",
+	       sizeof(struct gtable), sizeof(struct gtfat));
+	printf("%9s %10s %10s   (nsec/entry)\n", "entries", "older", "gtable");
+
+	if (argc < 2) {
+		for (i = 0; i < (int)(sizeof(def) / sizeof(def[0])); i++)
+			bench(def[i]);
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		long n = strtol(argv[i], NULL, 0);
+
+		if (n <= 0) {
+			fprintf(stderr, "Invalid number of entries: %s\n", argv[i]);
+			return 1;
+		}
+		bench(n);
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
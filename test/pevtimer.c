@@ -0,0 +1,250 @@
+/* This is free and unencumbered software released into the public domain. */
+
+/*
+ * Unit test of the pev timer heap: expiry order, re-arming, periodic
+ * timers, deleting timers from inside a callback, that one-shot timers
+ * are released when they have fired, and that the id of a deleted timer
+ * is not handed out again.  Built twice, with
+ * config.h for the timerfd backend, and without it for the portable one
+ * where the event loop sleeps until the earliest expiry.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pev.h"
+#include "pool.h"
+
+#define MSEC		1000		/* pev timers are in usec */
+#define NUM		32
+#define SPENT		(1 << 22)	/* more one-shots than pev has slots for */
+#define BATCH		16		/* one-shots added per feed_cb() run */
+
+static int order[NUM + 1];		/* timeout of each fired timer */
+static int fired;
+
+static int rearm_id, rearm_cnt;
+static int victim_id, victim_cnt;
+static int self_cnt;
+static int slow_id, slow_cnt;
+static int tick_id, tick_cnt;
+static int spent_added, spent_fired, spent_fail;
+static int stale_id, stale_cnt;
+
+static int failed;
+
+#define check(cond, fmt, args...)					\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "FAIL %s: " fmt "\n", #cond, ##args); \
+			failed++;					\
+		}							\
+	} while (0)
+
+static void order_cb(int id, void *arg)
+{
+	if (fired <= NUM)
+		order[fired] = (int)(long)arg;
+	fired++;
+}
+
+/* One-shot, re-arms itself twice from its own callback */
+static void rearm_cb(int id, void *arg)
+{
+	check(id == rearm_id, "got id %d", id);
+	if (++rearm_cnt < 3)
+		pev_timer_set(id, 20 * MSEC);
+}
+
+/* Stall the loop, so the killer and its victim are due at once */
+static void stall_cb(int id, void *arg)
+{
+	usleep(20 * MSEC);
+}
+
+/* Must never run, deleted by killer_cb() in the same timer run */
+static void victim_cb(int id, void *arg)
+{
+	victim_cnt++;
+}
+
+static void killer_cb(int id, void *arg)
+{
+	pev_timer_del(victim_id);
+}
+
+/* Periodic, pushed back by pev_timer_set() from its first run */
+static void slow_cb(int id, void *arg)
+{
+	if (++slow_cnt == 1)
+		pev_timer_set(id, 300 * MSEC);
+}
+
+/* Periodic, deletes itself on its second run */
+static void self_cb(int id, void *arg)
+{
+	if (++self_cnt == 2)
+		pev_timer_del(id);
+}
+
+static void tick_cb(int id, void *arg)
+{
+	tick_cnt++;
+}
+
+static void done_cb(int id, void *arg)
+{
+	pev_exit(0);
+}
+
+/* Never deleted, must be released by pev when it returns */
+static void spent_cb(int id, void *arg)
+{
+	spent_fired++;
+}
+
+/*
+ * Third part, keeps adding one-shots until SPENT have been added.  Few
+ * at a time, so each slot is reused many times over.
+ */
+static void feed_cb(int id, void *arg)
+{
+	int i;
+
+	for (i = 0; i < BATCH && spent_added < SPENT; i++, spent_added++) {
+		int spent;
+
+		spent = pev_timer_add(1, 0, spent_cb, NULL);
+		if (spent < 0)
+			spent_fail++;
+		if (spent == stale_id)
+			stale_cnt++;
+	}
+
+	if (spent_added < SPENT)
+		return;
+
+	pev_timer_del(id);
+	pev_timer_add(10 * MSEC, 0, done_cb, NULL);
+}
+
+/* Ends the second part, and starts the third */
+static void spend_cb(int id, void *arg)
+{
+	pev_timer_del(tick_id);
+	pev_timer_del(slow_id);
+	pev_timer_add(0, 1, feed_cb, NULL);
+}
+
+/* Second part, started after the order test */
+static void start_cb(int id, void *arg)
+{
+	rearm_id = pev_timer_add(20 * MSEC, 0, rearm_cb, NULL);
+
+	pev_timer_add(90 * MSEC, 0, stall_cb, NULL);
+	pev_timer_add(95 * MSEC, 0, killer_cb, NULL);
+	victim_id = pev_timer_add(100 * MSEC, 0, victim_cb, NULL);
+
+	pev_timer_add(0, 30 * MSEC, self_cb, NULL);
+	tick_id = pev_timer_add(0, 50 * MSEC, tick_cb, NULL);
+	slow_id = pev_timer_add(0, 40 * MSEC, slow_cb, NULL);
+
+	pev_timer_add(520 * MSEC, 0, spend_cb, NULL);
+}
+
+static void watchdog(int signo)
+{
+	fprintf(stderr, "FAIL event loop stuck\n");
+	_exit(1);
+}
+
+int main(void)
+{
+	struct pool *p = NULL;
+	unsigned int seed = 2;
+	int ids[2 * NUM];
+	int i, id;
+
+	signal(SIGALRM, watchdog);
+	alarm(30);
+
+	if (pev_init()) {
+		perror("pev_init");
+		return 1;
+	}
+
+	/*
+	 * Added in random order, every other deleted, rest must fire in
+	 * order.  The seed is one where a delete must move a timer up.
+	 */
+	for (i = 0; i < 2 * NUM; i++) {
+		int tmo;
+
+		seed = seed * 1103515245 + 12345;
+		tmo  = 10 + (seed >> 16) % 190;
+
+		ids[i] = pev_timer_add(tmo * MSEC, 0, order_cb, (void *)(long)tmo);
+		if (ids[i] < 0) {
+			perror("pev_timer_add");
+			return 1;
+		}
+	}
+	for (i = 1; i < 2 * NUM; i += 2)
+		pev_timer_del(ids[i]);
+
+	/* Moved from last to first, then a deleted one */
+	id = pev_timer_add(500 * MSEC, 0, order_cb, (void *)5L);
+	pev_timer_set(id, 5 * MSEC);
+	stale_id = pev_timer_add(30 * MSEC, 0, order_cb, (void *)30L);
+	pev_timer_del(stale_id);
+
+	/* The rest start after these, not to disturb the heap */
+	pev_timer_add(200 * MSEC, 0, start_cb, NULL);
+
+	if (pev_run()) {
+		fprintf(stderr, "FAIL pev_run\n");
+		return 1;
+	}
+
+	check(fired == NUM + 1, "fired %d timers, expected %d", fired, NUM + 1);
+	check(order[0] == 5, "first fired had timeout %d", order[0]);
+	for (i = 1; i <= NUM && i < fired; i++)
+		check(order[i - 1] <= order[i], "timeout %d fired after %d", order[i], order[i - 1]);
+
+	check(rearm_cnt == 3, "re-armed timer ran %d times", rearm_cnt);
+	check(pev_timer_get(rearm_id) < 0, "timer left after pev_exit()");
+	check(victim_cnt == 0, "deleted timer ran %d times", victim_cnt);
+	check(self_cnt == 2, "self deleting timer ran %d times", self_cnt);
+	check(slow_cnt >= 5 && slow_cnt <= 6, "pushed back timer ran %d times", slow_cnt);
+	check(tick_cnt >= 8 && tick_cnt <= 10, "50 msec timer ran %d times in 520 msec", tick_cnt);
+
+	check(spent_fail == 0, "%d of %d one-shot timers could not be added", spent_fail, SPENT);
+	check(spent_fired == SPENT - spent_fail, "%d of %d one-shot timers fired", spent_fired, SPENT);
+	check(stale_cnt == 0, "id of deleted timer handed out %d times", stale_cnt);
+	check(pev_timer_get(stale_id) < 0, "id of deleted timer still valid");
+	while (pool_iter(&p)) {
+		if (strcmp(p->p_name, "events"))
+			continue;
+		check(p->p_hiwat < 2 * NUM + 4 * BATCH, "%zu events in use at once", p->p_hiwat);
+	}
+
+	if (failed)
+		return 1;
+
+	printf("OK\n");
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
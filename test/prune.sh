@@ -0,0 +1,191 @@
+#!/bin/sh
+# Verify pacing of prunes sent upstream, and that a graft is still sent
+# when the prune it annuls has gone out and is queued for retransmission.
+#
+# The LAN namespace holds the shared segment, a bridge with a member of
+# all groups, so R1 keeps forwarding to it and R2 keeps retransmitting
+# its prunes.  R2 has no members until ED2 joins, and sends at most one
+# prune or graft per second.
+#
+# ED1         R1               LAN              R2               ED2
+# [eth0]------[eth1:R1:eth2]---[br0]---[eth3:R2:eth4]------[eth0]
+#     10.0.0.0/24       10.0.1.0/24             10.0.2.0/24
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+NUM=10				# Number of groups, > prune-rate
+RATE=1				# R2 prune-rate
+
+print "Check deps ..."
+check_dep ip
+
+print "Creating world ..."
+ED1="/tmp/$NM/ED1"
+R1="/tmp/$NM/R1"
+LAN="/tmp/$NM/LAN"
+R2="/tmp/$NM/R2"
+ED2="/tmp/$NM/ED2"
+touch "$ED1" "$R1" "$LAN" "$R2" "$ED2"
+
+echo "$ED1"  > "/tmp/$NM/mounts"
+echo "$R1"  >> "/tmp/$NM/mounts"
+echo "$LAN" >> "/tmp/$NM/mounts"
+echo "$R2"  >> "/tmp/$NM/mounts"
+echo "$ED2" >> "/tmp/$NM/mounts"
+
+for ns in "$ED1" "$R1" "$LAN" "$R2" "$ED2"; do
+    unshare --net="$ns" -- ip link set lo up
+done
+
+# Creates a VETH pair between two namespaces:
+#
+#     vpair /tmp/foo eth0 /tmp/bar eth1
+vpair()
+{
+    nsenter --net="$3" -- sleep 3 &
+    pid=$!
+
+    nsenter --net="$1" -- ip link add "$2" type veth peer "$4"
+    nsenter --net="$1" -- ip link set "$4" netns "$pid"
+    nsenter --net="$1" -- ip link set "$2" up
+    nsenter --net="$3" -- ip link set "$4" up
+}
+
+# Set address on interface in namespace
+addr()
+{
+    nsenter --net="$1" -- ip addr add "$3" broadcast + dev "$2"
+}
+
+# Join or send to all groups
+groups()
+{
+    i=1
+    while [ $i -le $NUM ]; do
+	echo "225.1.2.$i"
+	i=$((i + 1))
+    done
+}
+
+# Number of groups R1 has got a prune or graft, $1, for from R2
+count()
+{
+    grep -E "10.0.1.2 on vif [0-9]+ $1 " "/tmp/$NM/r1.log" \
+	| sed 's/.* \(225[^)]*\)).*/\1/' | sort -u | wc -l
+}
+
+# Prune/graft queue counter, column $1, in R2
+queue()
+{
+    nsenter --net="$R2" -- ../src/mroutectl -p -u "/tmp/$NM/r2.sock" -d show mfc \
+	| grep -A3 "Prune/Graft Queue" | tail -1 | awk "{ print \$$1 }"
+}
+
+dprint "Creating topology ..."
+vpair "$ED1" eth0 "$R1"  eth1
+vpair "$R1"  eth2 "$LAN" lan1
+vpair "$LAN" lan2 "$R2"  eth3
+vpair "$R2"  eth4 "$ED2" eth0
+
+nsenter --net="$LAN" -- ip link add br0 type bridge mcast_snooping 0
+nsenter --net="$LAN" -- ip link set lan1 master br0
+nsenter --net="$LAN" -- ip link set lan2 master br0
+nsenter --net="$LAN" -- ip link set br0 up
+
+addr "$ED1" eth0 10.0.0.10/24
+addr "$R1"  eth1 10.0.0.1/24
+addr "$R1"  eth2 10.0.1.1/24
+addr "$LAN" br0  10.0.1.10/24
+addr "$R2"  eth3 10.0.1.2/24
+addr "$R2"  eth4 10.0.2.1/24
+addr "$ED2" eth0 10.0.2.10/24
+
+print "Starting mrouted ..."
+cat <<EOF > "/tmp/$NM/r1.conf"
+phyint eth1 enable
+phyint eth2 enable
+EOF
+cat <<EOF > "/tmp/$NM/r2.conf"
+prune-rate $RATE
+phyint eth3 enable rexmit_prunes on
+phyint eth4 enable
+EOF
+cat "/tmp/$NM/r2.conf"
+
+nsenter --net="$R1" -- ../src/mrouted -i R1 -n -f "/tmp/$NM/r1.conf" -p "/tmp/$NM/r1.pid" \
+	-l debug -d prunes -u "/tmp/$NM/r1.sock" > "/tmp/$NM/r1.log" 2>&1 &
+echo $! >> "/tmp/$NM/PIDs"
+nsenter --net="$R2" -- ../src/mrouted -i R2 -n -f "/tmp/$NM/r2.conf" -p "/tmp/$NM/r2.pid" \
+	-l debug -d prunes -u "/tmp/$NM/r2.sock" > "/tmp/$NM/r2.log" 2>&1 &
+echo $! >> "/tmp/$NM/PIDs"
+
+has_route()
+{
+    nsenter --net="$R2" -- ../src/mroutectl -pt -u "/tmp/$NM/r2.sock" show routes 2>/dev/null \
+	| grep -q "^10.0.0"
+}
+
+print "Waiting for R2 to learn the route to ED1 (30 sec) ..."
+tenacious 30 has_route
+sleep 5				# R1 learns R2 depends on it
+dprint "OK"
+
+print "Joining all groups on the LAN ..."
+for grp in $(groups); do
+    nsenter --net="$LAN" -- ip addr add "$grp/32" dev br0 autojoin
+done
+sleep 2
+
+print "Starting emitters on ED1 ..."
+for grp in $(groups); do
+    nsenter --net="$ED1" -- ./mping -qs -i eth0 -t 3 -w 120 "$grp" >/dev/null &
+    echo $! >> "/tmp/$NM/PIDs"
+done
+
+all_pruned()
+{
+    [ "$(count prunes)" -eq $NUM ]
+}
+
+rexmit_queued()
+{
+    [ "$(queue 1)" -gt 0 ]
+}
+
+all_grafted()
+{
+    [ "$(count grafts)" -eq $NUM ]
+}
+
+print "Waiting for R1 to get prunes for all groups ($((3 * NUM / RATE)) sec) ..."
+tenacious $((3 * NUM / RATE)) all_pruned
+dprint "OK"
+
+print "Checking prunes from R2 were paced ..."
+delayed=$(queue 4)
+if [ "$delayed" -eq 0 ]; then
+    FAIL "Expected R2 to delay prunes over the rate"
+fi
+grep -E "^R1: .*10.0.1.2 on vif [0-9]+ prunes" "/tmp/$NM/r1.log" \
+    | awk '{ print substr($2, 1, 8) }' | uniq -c > "/tmp/$NM/pacing"
+max=$(awk 'BEGIN { max = 0 } $1 > max { max = $1 } END { print max }' "/tmp/$NM/pacing")
+if [ "$max" -gt $((2 * RATE)) ]; then
+    FAIL "R1 got $max prunes from R2 in one second, expected at most $((2 * RATE))"
+fi
+dprint "$delayed prunes delayed, at most $max a second"
+
+print "Waiting for R2 to queue prune retransmissions (30 sec) ..."
+tenacious 30 rexmit_queued
+dprint "OK"
+
+print "Joining all groups on ED2 ..."
+for grp in $(groups); do
+    nsenter --net="$ED2" -- ip addr add "$grp/32" dev eth0 autojoin
+done
+
+print "Waiting for R1 to get grafts for all groups ($((3 * NUM / RATE)) sec) ..."
+tenacious $((3 * NUM / RATE)) all_grafted
+dprint "OK"
+
+OK
@@ -0,0 +1,142 @@
+#!/bin/sh
+# Verify the timing of periodic IGMP queries, DVMRP neighbor probes,
+# and route reports, all driven by the event loop timers.
+#
+# R1 and R2 each have a leaf LAN, a VETH pair with the far end unused,
+# and share a link.
+#
+#     a1:R1:eth1-------eth2:R2:a2
+#      10.0.0.0/24  10.0.1.0/24  10.0.2.0/24
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+QI=2				# igmp-query-interval
+DUR=45				# Seconds to run
+SLACK=300			# Max msec off from period
+
+print "Check deps ..."
+check_dep ip
+
+print "Creating world ..."
+R1="/tmp/$NM/R1"
+R2="/tmp/$NM/R2"
+touch "$R1" "$R2"
+
+echo "$R1"  > "/tmp/$NM/mounts"
+echo "$R2" >> "/tmp/$NM/mounts"
+
+for ns in "$R1" "$R2"; do
+    unshare --net="$ns" -- ip link set lo up
+done
+
+nsenter --net="$R2" -- sleep 3 &
+pid=$!
+nsenter --net="$R1" -- ip link add eth1 type veth peer eth2
+nsenter --net="$R1" -- ip link set eth2 netns "$pid"
+
+# Set up a named interface with address in a namespace
+iface()
+{
+    nsenter --net="$1" -- ip link set "$2" up
+    nsenter --net="$1" -- ip link set "$2" multicast on
+    nsenter --net="$1" -- ip addr add "$3" broadcast + dev "$2"
+}
+
+nsenter --net="$R1" -- ip link add a1 type veth peer b1
+nsenter --net="$R1" -- ip link set b1 up
+nsenter --net="$R2" -- ip link add a2 type veth peer b2
+nsenter --net="$R2" -- ip link set b2 up
+iface "$R1" a1   10.0.0.1/24
+iface "$R1" eth1 10.0.1.1/24
+iface "$R2" eth2 10.0.1.2/24
+iface "$R2" a2   10.0.2.1/24
+
+print "Starting mrouted ..."
+cat <<EOF > "/tmp/$NM/mrouted.conf"
+igmp-query-interval $QI
+EOF
+
+nsenter --net="$R1" -- ../src/mrouted -i R1 -n -f "/tmp/$NM/mrouted.conf" -p "/tmp/$NM/r1.pid" \
+	-l debug -d igmp,routes,peers -u "/tmp/$NM/r1.sock" > "/tmp/$NM/r1.log" 2>&1 &
+echo $! >> "/tmp/$NM/PIDs"
+nsenter --net="$R2" -- ../src/mrouted -i R2 -n -f "/tmp/$NM/mrouted.conf" -p "/tmp/$NM/r2.pid" \
+	-l debug -d igmp,routes,peers -u "/tmp/$NM/r2.sock" > "/tmp/$NM/r2.log" 2>&1 &
+echo $! >> "/tmp/$NM/PIDs"
+
+print "Collecting $DUR sec of logs ..."
+sleep $DUR
+kill_pids
+
+# Print msec since startup, the first packet sent, of all "SENT $2 from
+# $3" lines in log $1, skipping the first $4 sec
+offsets()
+{
+    grep "SENT " "$1" | awk -v kind="SENT $2 *from $3 " -v skip="$4" '
+	{
+	    split($2, t, ":")
+	    ms = ((t[1] * 60 + t[2]) * 60 + t[3]) * 1000
+	    if (!start)
+		start = ms
+	    if (ms - start >= skip * 1000 && $0 ~ kind)
+		printf "%d\n", ms - start
+	}'
+}
+
+# Check that packets of kind $2 from address $3 in log $1, after the
+# first $5 sec, are at least $6, and sent every $4 sec.  With $7 set
+# they need only be on the $4 sec grid from startup, gaps allowed.
+# Extra packets sent right after another, e.g. on a new neighbor, are
+# skipped.
+check()
+{
+    offsets "$1" "$2" "$3" "$5" > "/tmp/$NM/offsets"
+    num=$(wc -l < "/tmp/$NM/offsets")
+    if [ "$num" -lt "$6" ]; then
+	FAIL "Expected at least $6 of $2 from $3 in $(basename "$1"), got $num"
+    fi
+
+    err=$(awk -v p="$(($4 * 1000))" -v s="$SLACK" -v grid="${7:-0}" '
+	{
+	    if (NR == 1 && !grid)
+		phase = $1
+	    if (NR > 1 && $1 - last < s)
+		next
+	    d = ($1 - phase) % p
+	    if (d > p / 2)
+		d = p - d
+	    if (d > max)
+		max = d
+	    if (d > s || (!grid && NR > 1 && ($1 - last < p - s || $1 - last > p + s))) {
+		printf "%d msec", $1
+		err = 1
+		exit
+	    }
+	    last = $1
+	}
+	END { if (!err) printf "ok, max %d msec off", max }' "/tmp/$NM/offsets")
+    dprint "$(basename "$1" .log) $2 from $3, $num sent: $err"
+    case "$err" in
+	ok*)
+	    ;;
+	*)
+	    FAIL "$2 from $3 not sent every $4 sec, at $err"
+	    ;;
+    esac
+}
+
+print "Checking periodic IGMP queries ..."
+check "/tmp/$NM/r1.log" "membership query" 10.0.0.1 $QI 10 $((DUR / QI - 10))
+check "/tmp/$NM/r1.log" "membership query" 10.0.1.1 $QI 10 $((DUR / QI - 10))
+check "/tmp/$NM/r2.log" "membership query" 10.0.2.1 $QI 10 $((DUR / QI - 10))
+
+print "Checking periodic DVMRP neighbor probes ..."
+check "/tmp/$NM/r1.log" "neighbor probe" 10.0.0.1 10 5 3
+check "/tmp/$NM/r1.log" "neighbor probe" 10.0.1.1 10 5 3
+check "/tmp/$NM/r2.log" "neighbor probe" 10.0.1.2 10 5 3
+
+print "Checking DVMRP route reports are sent from the 1 sec timer ..."
+check "/tmp/$NM/r1.log" "route report" 10.0.1.1 1 5 2 grid
+check "/tmp/$NM/r2.log" "route report" 10.0.1.2 1 5 2 grid
+
+OK